@@ -0,0 +1,99 @@
+#!/bin/sh
+# Times the code the transpiler generates for a fixed set of programs at several
+# optimization levels and compares ns/call and checksums against baseline.json.
+#
+# Usage: bench/bench.sh [-u] [-s seconds] [-l levels] [-x options] [-r ratio]
+#   -u          Write the results to baseline.json instead of failing on regressions.
+#   -s seconds  Time budget per program and level. (Default: 0.5)
+#   -l levels   Optimization levels to compile with. (Default: "-O0 -O1 -O2 -O3")
+#   -x options  Extra transpiler options, e.g. "-s" or "-m 1024".
+#   -r ratio    Slowdown against the baseline that counts as a regression. (Default: 1.25)
+# The JSON report goes to stdout, regressions to stderr. CC selects the compiler.
+
+set -e
+cd "$(dirname "$0")"
+seconds=0.5
+levels="-O0 -O1 -O2 -O3"
+extra=""
+limit=1.25
+update=0
+while getopts us:l:x:r: option; do
+	case $option in
+	u) update=1 ;;
+	s) seconds=$OPTARG ;;
+	l) levels=$OPTARG ;;
+	x) extra=$OPTARG ;;
+	r) limit=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+CC=${CC:-cc}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+$CC -O2 -pthread -o "$work/loop" ../loop.c
+
+# name, program, and the input grid as one lo:hi range per input
+while read -r name file grid; do
+	"$work/loop" -k -W -T $extra -n "$name" -o "$work/$name.c" "$file"
+	for level in $levels; do
+		$CC $level -o "$work/$name" "$work/$name.c"
+		line=$("$work/$name" -s "$seconds" $grid)
+		echo "{\"program\": \"$name\", \"level\": \"$level\", ${line#*, }"
+	done
+done > "$work/results" <<EOF
+binlen ../binlen.loop 0:4095
+program1 ../program1.loop 0:60
+program2 ../program2.loop 0:60
+program3 ../program3.loop 0:60
+nested nested.loop 0:12 0:12 0:12
+straight straight.loop 0:200 0:3
+search search.loop 0:5000
+EOF
+
+touch baseline.json
+awk -v limit="$limit" -v compiler="$($CC --version | head -n 1)" -v options="-k -W -T $extra" -v seconds="$seconds" '
+function field(line, key,   value) {
+	if (!match(line, "\"" key "\": \"?[^,\"}]*")) return ""
+	value = substr(line, RSTART, RLENGTH)
+	sub(/^[^:]*: "?/, "", value)
+	return value
+}
+FILENAME == ARGV[1] {
+	if (field($0, "program") != "") {
+		key = field($0, "program") " " field($0, "level")
+		baseline[key] = field($0, "ns_per_call")
+		checksum[key] = field($0, "checksum")
+	}
+	next
+}
+{
+	key = field($0, "program") " " field($0, "level")
+	ns = field($0, "ns_per_call")
+	extra = ""
+	if (key in baseline) {
+		ratio = ns / baseline[key]
+		extra = sprintf(", \"baseline_ns_per_call\": %s, \"ratio\": %.3f", baseline[key], ratio)
+		if (checksum[key] != field($0, "checksum")) {
+			printf "%s: checksum %s differs from baseline %s\n", key, field($0, "checksum"), checksum[key] > "/dev/stderr"
+			failed = 1
+		} else if (ratio > limit) {
+			printf "%s: %.3f ns/call is %.2fx the baseline %s ns/call\n", key, ns, ratio, baseline[key] > "/dev/stderr"
+			failed = 1
+		}
+	}
+	sub(/}$/, extra "}")
+	results[++count] = $0
+}
+END {
+	printf "{\n\t\"compiler\": \"%s\",\n\t\"options\": \"%s\",\n\t\"seconds\": %s,\n\t\"results\": [\n", compiler, options, seconds
+	for (k = 1; k <= count; ++k)
+		printf "\t\t%s%s\n", results[k], k < count ? "," : ""
+	printf "\t]\n}\n"
+	exit failed
+}' baseline.json "$work/results" > "$work/report" && status=0 || status=$?
+cat "$work/report"
+if [ $update = 1 ]; then
+	cp "$work/report" baseline.json
+	exit 0
+fi
+exit $status
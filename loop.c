@@ -1,16 +1,74 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include "loop.h"
 
-#define LINE_BUF_SIZE 256
+#define READ_BUF_SIZE 65536
+#define OUTPUT_BUF_SIZE 65536
+#define MAX_JIT_DEPTH_WEIGHT 6
+#define MAX_TERM_FACTORS 4
+#define MAX_EFFECT_TERMS 8
+#define MAX_VARIABLE_INDEX 0x0FFFFFFF
+#define LANE_COUNT 8
+#define MEMO_WAYS 4
+#define MAX_MEMO_CAPACITY (1u << 26)
+#define SERVE_CACHE_SLOTS 1024
+#define MAX_REQUEST_LINE 65536
+#define MAX_REQUEST_SOURCE (64u << 20)
+#define SERVE_ACCEPT_BACKOFF 100
+#define CACHE_CAPACITY (256ull << 20)
+/* Part of every cache key. Bump it with every change to the generated code. */
+#define CACHE_FORMAT_VERSION 1
+#define MAX_UNROLL_COUNT 64
+#define MAX_UNROLL_INSTRUCTIONS 4096
 
-int heighestIndex;
-const char *type = "uint_fast64_t";
-const char *typePrintMacro = "PRIuFAST64";
+/* Parser and writer state belongs to the file being transpiled, and every worker thread transpiles one file at a time. */
+_Thread_local int heighestIndex;
+_Thread_local const char *type = "uint_fast64_t";
+_Thread_local const char *typePrintMacro = "PRIuFAST64";
+_Thread_local int scalarVariables = 0;
+_Thread_local int bignumVariables = 0;
+_Thread_local int checkedArithmetic = 0;
+_Thread_local int batchMain = 0;
+_Thread_local int benchMain = 0;
+_Thread_local int profileCounters = 0;
+_Thread_local int laneVariables = 0;
+_Thread_local int laneMask = 1;
+_Thread_local int laneBatch = 0;
+_Thread_local uint32_t memoCapacity = 0;
+_Thread_local int divisionRuntime = 0;
+_Thread_local int idiomRuntime = 0;
+_Thread_local uint32_t *reciprocalLoops = NULL;
+_Thread_local uint8_t *earlyExits = NULL;
+_Thread_local uint32_t unrollBudget = 0;
+_Thread_local int keepOverflows = 0;
+_Thread_local char *sourceFileName = "";
+_Thread_local char *jobFileName = NULL;
 char *file = "a";
 char *name = "program";
+char *compiler = "cc -O2";
+uint64_t cacheHits = 0;
+uint64_t cacheMisses = 0;
 
 enum InstructionType {
 	undefinedType = 0,
@@ -18,7 +76,9 @@ enum InstructionType {
 	loopInstruction,
 	whileInstruction,
 	ifInstructionStart,
-	ifInstructionEnd
+	ifInstructionEnd,
+	/* left by the optimizer where a block must not be empty, never parsed */
+	emptyInstruction
 };
 
 enum Operation {
@@ -38,30 +98,196 @@ enum Operation {
 	lessEqual
 };
 
+enum EffectType {
+	undefinedEffect = 0,
+	incrementEffect,
+	decrementEffect,
+	setEffect
+};
+
+enum IdiomType {
+	undefinedIdiom = 0,
+	bitLengthIdiom,
+	powerIdiom,
+	divisionIdiom
+};
+
+enum ExitType {
+	undefinedExit = 0,
+	guardExit,
+	fixedPointExit
+};
+
+typedef struct Instruction {
+	uint8_t instructionType;
+	uint8_t operation;
+	uint8_t treatCAsVariable;
+	uint32_t i, j;
+	uint64_t c;
+	uint32_t innerInstruction;
+	uint32_t nextInstruction;
+	uint32_t line, column;
+} Instruction;
+
+/*
+ * All instructions of a program live in one contiguous array and refer to each
+ * other by index. Index 0 is reserved to mean "none", so the program starts at 1.
+ */
 typedef struct Program {
-	enum InstructionType instructionType;
-	enum Operation operation;
-	int treatCAsVariable;
-	uint64_t i, j, c;
-	struct Program *innerProgram;
-	struct Program *nextProgram;
+	Instruction *instructions;
+	uint32_t size;
+	uint32_t capacity;
+	struct LoopSummary **summaries;
+	struct Idiom **idioms;
+	int heighestIndex;
 } Program;
 
-typedef struct ProgramStack {
-	Program *program;
-	struct ProgramStack *next;
-} ProgramStack;
+/* Generated code collects in memory and goes out with a single write once it is complete. */
+typedef struct Output {
+	char *data;
+	size_t size;
+	size_t capacity;
+} Output;
+
+/* coefficient * x[factors[0]] * ... * x[factors[factorCount - 1]] */
+typedef struct Term {
+	uint64_t coefficient;
+	int factorCount;
+	uint32_t factors[MAX_TERM_FACTORS];
+} Term;
+
+/*
+ * The effect of a whole LOOP on one variable:
+ * incrementEffect: x += iterations * (terms[0] + ... + terms[termCount - 1])
+ * decrementEffect: x -= iterations * terms[0], saturating at 0
+ * setEffect:       x = <assignment> if the LOOP runs at least once
+ */
+typedef struct Effect {
+	enum EffectType effectType;
+	uint32_t variable;
+	int termCount;
+	Term terms[MAX_EFFECT_TERMS];
+	uint32_t assignment;
+} Effect;
+
+typedef struct LoopSummary {
+	int effectCount;
+	int capacity;
+	Effect *effects;
+} LoopSummary;
+
+/*
+ * A LOOP that spells out an operation C has natively, with steps = min(iterations, bit length of x[variable]):
+ * bitLengthIdiom: x[counter] += steps; x[variable] >>= steps
+ * powerIdiom:     x[variable] *= base^iterations, base being x[base] or a constant;
+ *                 then x[temporary] = x[variable] if copyTemporary and the LOOP runs at least once
+ * divisionIdiom:  with steps = min(iterations, x[variable] / base), or iterations for a base of 0,
+ *                 x[counter] += steps; x[variable] -= steps * base
+ */
+typedef struct Idiom {
+	enum IdiomType idiomType;
+	uint32_t variable;
+	uint32_t counter;
+	uint32_t temporary;
+	int copyTemporary;
+	uint8_t treatBaseAsVariable;
+	uint64_t base;
+} Idiom;
+
+/* The Constant/Variable variants of each opcode are adjacent, as are the relations in Operation order. */
+enum Opcode {
+	opHalt = 0,
+	opConstant,
+	opCopy,
+	opAddConstant,
+	opAddVariable,
+	opSubtractConstant,
+	opSubtractVariable,
+	opMultiplyConstant,
+	opMultiplyVariable,
+	opDivideConstant,
+	opDivideVariable,
+	opModuloConstant,
+	opModuloVariable,
+	opJumpEqualConstant,
+	opJumpEqualVariable,
+	opJumpNotEqualConstant,
+	opJumpNotEqualVariable,
+	opJumpGreaterConstant,
+	opJumpGreaterVariable,
+	opJumpGreaterEqualConstant,
+	opJumpGreaterEqualVariable,
+	opJumpLessConstant,
+	opJumpLessVariable,
+	opJumpLessEqualConstant,
+	opJumpLessEqualVariable,
+	opJump,
+	opLoopStart,
+	opLoopNext
+};
+
+/*
+ * Arithmetic:   r[a] = r[b] <op> c (or r[c])
+ * Conditional:  if (r[a] <relation> c (or r[c])) jump to b
+ * opLoopStart:  r[a] = r[b]; if (r[a] == 0) jump to c
+ * opLoopNext:   if (--r[a] != 0) jump to c
+ * opJump:       jump to c
+ */
+typedef struct BytecodeInstruction {
+	uint32_t opcode;
+	uint32_t a, b;
+	uint64_t c;
+} BytecodeInstruction;
+
+typedef struct Bytecode {
+	BytecodeInstruction *instructions;
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t registerCount;
+	uint32_t inputCount;
+} Bytecode;
 
-typedef struct LineReader {
+typedef struct IndexStack {
+	uint32_t *indices;
+	uint32_t size;
+	uint32_t capacity;
+} IndexStack;
+
+enum CharacterClass {
+	otherCharacter = 0,
+	whitespaceCharacter,
+	digitCharacter
+};
+
+/*
+ * The whole input is mapped (or, for pipes, read) into one buffer and scanned
+ * in place. Line and column are only reconstructed when reporting an error, or
+ * counted forward from the last instruction when recording where one starts.
+ * With --stream, a pipe instead fills a window that refillLexer slides over the
+ * input, and the dropped lines and columns are added back.
+ */
+typedef struct Lexer {
 	char *inputFileName;
-	FILE *input;
-	char *buf;
-	int size;
-	int line;
-	int segment;
-	int position;
-	int endOfLine;
-} LineReader;
+	const char *data;
+	size_t size;
+	size_t position;
+	int mapped;
+	int borrowed;
+	int refilling;
+	int fd;
+	size_t capacity;
+	size_t scanned;
+	size_t lineStart;
+	uint32_t line;
+	uint32_t droppedLines;
+	size_t droppedColumns;
+	IndexStack blocks;
+} Lexer;
+
+typedef struct Specialization {
+	uint32_t variable;
+	uint64_t value;
+} Specialization;
 
 typedef struct ParserOptions {
 	char *inputFileName;
@@ -72,28 +298,150 @@ typedef struct ParserOptions {
 	int extensionIf;
 	int extensionIfExtended;
 	int extensionWhileExtended;
+	int noOptimize;
+	int keepOverflows;
+	Specialization *specializations;
+	uint32_t specializationCount;
 } ParserOptions;
 
+static const unsigned char characterClasses[256] = {
+	[' '] = whitespaceCharacter, ['\t'] = whitespaceCharacter, ['\r'] = whitespaceCharacter, ['\n'] = whitespaceCharacter,
+	['0'] = digitCharacter, ['1'] = digitCharacter, ['2'] = digitCharacter, ['3'] = digitCharacter, ['4'] = digitCharacter,
+	['5'] = digitCharacter, ['6'] = digitCharacter, ['7'] = digitCharacter, ['8'] = digitCharacter, ['9'] = digitCharacter
+};
+
 typedef struct WriteOptions {
 	char *outputFileName;
 	char *functionName;
 	int extensionHeader;
+	int extensionScalar;
+	int extensionBignum;
+	int extensionChecked;
+	int extensionBatch;
+	int extensionBench;
+	int extensionProfile;
+	int extensionLanes;
+	uint32_t memoCapacity;
+	int explainIdioms;
+	char *inputFileName;
+	char *cacheDirectory;
+	uint64_t cacheCapacity;
+	int showCacheStatistics;
+	int extensionStream;
 } WriteOptions;
 
+typedef struct JobOptions {
+	char **inputFileNames;
+	size_t inputCount;
+	size_t capacity;
+	int multipleFiles;
+	int threadCount;
+	char *outputDirectory;
+} JobOptions;
+
+typedef struct Job {
+	char *inputFileName;
+	char *outputFileName;
+	char *functionName;
+} Job;
+
+typedef struct JobQueue {
+	Job *jobs;
+	size_t count;
+	size_t next;
+	ParserOptions *parserOptions;
+	WriteOptions *writeOptions;
+} JobQueue;
+
+typedef struct RunOptions {
+	int extensionRun;
+	int extensionJit;
+	int inputCount;
+	char **inputs;
+	char *serveSocket;
+	char *connectSocket;
+	int extensionExec;
+	char *compiler;
+} RunOptions;
+
+/*
+ * Library calls keep what they allocate here while they run, so that an error can jump
+ * back to the call through the jump buffer and release it instead of ending the process.
+ */
+struct loop_context {
+	ParserOptions parserOptions;
+	WriteOptions writeOptions;
+	char *functionName;
+	loop_error error;
+	jmp_buf jump;
+	Lexer *lexer;
+	Program *program;
+	Output output;
+};
+
+/* A parsed program keeps a copy of its file name for the messages of generated code. */
+struct loop_program {
+	Program *program;
+	char *fileName;
+};
+
+_Thread_local loop_context *errorContext = NULL;
+
+void fail(int code, uint32_t line, uint32_t column, char *message) {
+	loop_error *error = &errorContext->error;
+	error->code = code;
+	error->line = line;
+	error->column = column;
+	snprintf(error->message, sizeof(error->message), "%s", message);
+	longjmp(errorContext->jump, 1);
+}
+
 void error(char *message) {
-	fprintf(stderr, "loop: error: %s\n", message);
+	if (errorContext != NULL) fail(LOOP_ERROR_INVALID, 0, 0, message);
+	flockfile(stderr);
+	if (jobFileName != NULL)
+		fprintf(stderr, "loop: error: %s: %s\n", jobFileName, message);
+	else
+		fprintf(stderr, "loop: error: %s\n", message);
 	exit(EXIT_FAILURE);
 }
 
+void systemError() {
+	if (errorContext != NULL) fail(LOOP_ERROR_SYSTEM, 0, 0, strerror(errno));
+	error(strerror(errno));
+}
+
 void help() {
 	char *message =
 		"Usage: ./loop [options] file\n"
+		"       ./loop [options] file|directory|@list ...\n"
+		"       ./loop [options] --run file [x1 x2 ...]\n"
+		"       ./loop [options] --serve socket\n"
+		"       ./loop [options] --connect socket file [x1 x2 ...]\n"
+		"A file name of \"-\" reads the program from stdin, an output file name of \"-\" writes the C code to stdout.\n"
+		"Several files, a directory (searched for *.loop files), or @list (a file naming one input per line)\n"
+		"get transpiled in parallel. Each x.loop becomes x.c with a function named x, next to the input\n"
+		"or inside the directory given with -o.\n"
 		"Options:\n"
 		"  --help             -h           Display this information.\n"
 		"  --version          -v           Display version information.\n"
 		"  --output <file>    -o <file>    Place the output into <file>. (Default: \"%s\")\n"
 		"  --name <name>      -n <name>    Name the function that gets generated <name>. (Default: \"%s\")\n"
+		"  --threads <n>      -t <n>       Transpile several files on <n> threads. (Default: one per core)\n"
 		"  --header           -H           Also generate and include a header file.\n"
+		"  --scalar           -s           Keep every variable in its own local instead of a heap array.\n"
+		"  --bignum           -b           Compute with arbitrary-precision natural numbers instead of 64 bits.\n"
+		"  --checked          -c           Compute with 128 bits and report where the first overflow happens.\n"
+		"  --batch            -B           Make the generated program evaluate one input tuple per line of stdin or a file,\n"
+		"                                  spread over all cores or the number of threads given with -t. Link with -pthread.\n"
+		"  --bench            -T           Make the generated program time the function over a grid of inputs given as\n"
+		"                                  lo:hi ranges, one per input, and print the result as JSON.\n"
+		"  --profile          -P           Count how often every instruction runs and print a report sorted by cost to\n"
+		"                                  stderr at exit. Compile with -DLOOP_PROFILE_CYCLES to also time every LOOP and\n"
+		"                                  WHILE, and set LOOP_PROFILE_FOLDED=<file> to get folded stacks for flame graphs.\n"
+		"  --simd             -S           Also generate <name>_lanes, evaluating %d inputs at once with vector instructions.\n"
+		"  --memo <size>      -m <size>    Remember the results of up to <size> recent calls and return them on repeats.\n"
+		"                                  Define LOOP_MEMO_THREAD_SAFE when calling from several threads (implied by -B).\n"
 		"  --operations       -O           Also accept multiplication, division, and modulo.\n"
 		"  --assignment       -a           Also accept various different assignments.\n"
 		"  --if               -i           Also accept basic IF programs.\n"
@@ -101,8 +449,28 @@ void help() {
 		"  --while            -w           Also accept basic WHILE programs.\n"
 		"  --whileExtended    -W           Also accept various different WHILE programs.\n"
 		"  --noWhitespace     -N           Also accept programs with missing whitespace.\n"
-		"  --klausur          -k           The same as -O -a -I.\n";
-	printf(message, file, name);
+		"  --klausur          -k           The same as -O -a -I.\n"
+		"  --noOptimize       -X           Skip constant propagation and dead code elimination.\n"
+		"  --specialize <x=v> -p <x=v>     Fix inputs to the values given as a list like x2=10,x5=0 and optimize for them.\n"
+		"                                  The function then takes only the remaining inputs, in their order.\n"
+		"  --explainIdioms    -E           List every LOOP that gets replaced by a native operation on stderr.\n"
+		"  --stream           -l           Write the C code while parsing, with memory bounded by the nesting depth instead\n"
+		"                                  of the program length, also for stdin and pipes, which get read in chunks.\n"
+		"                                  Skips all optimizations, and a syntax error leaves the C code unfinished.\n"
+		"  --run              -r           Interpret the program with the given inputs and print x0.\n"
+		"  --jit              -j           The same as --run, but compile the program to x86-64 machine code first.\n"
+		"  --serve <socket>   -L <socket>  Listen on the Unix socket <socket> and evaluate the programs that clients send\n"
+		"                                  on -t threads, keeping every program compiled for its next request.\n"
+		"  --connect <socket> -C <socket>  The same as --run, but let the server on <socket> evaluate the program.\n"
+		"  --exec             -x           The same as --run, but compile the C code into a shared object and load it.\n"
+		"                                  With --cache the object gets reused for as long as the C code stays the same.\n"
+		"  --compiler <cmd>   -G <cmd>     Build the object for --exec with <cmd>. (Default: \"%s\")\n"
+		"  --cache <dir>      -D <dir>     Reuse the C code generated for the same program and options before, kept in <dir>.\n"
+		"                                  Changes to whitespace alone still find it. Output files that would not change\n"
+		"                                  are left untouched.\n"
+		"  --cacheSize <n>    -Z <n>       Evict the least recently used code once the cache exceeds <n> MiB. (Default: %d)\n"
+		"  --cacheStats       -Q           Print the hits and misses of all runs and the size of the cache.\n";
+	printf(message, file, name, LANE_COUNT, compiler, (int) (CACHE_CAPACITY >> 20));
 }
 
 void version() {
@@ -112,101 +480,346 @@ void version() {
 	printf(message);
 }
 
-void changeWhitespaceToSpaces(char *string) {
-	if (string == NULL) return;
-	for (int i = 0; i < strlen(string); ++i)
-		if (strchr("\t\r\n", string[i]))
-			string[i] = ' ';
-}
-
-void parserError(LineReader *lineReader, char *message) {
-	if (lineReader->inputFileName == NULL) error("Input file name not set");
-	fprintf(stderr, "%s:%d:%d: error: %s\n", lineReader->inputFileName, lineReader->line, lineReader->segment * (lineReader->size - 1) + lineReader->position, message);
-	changeWhitespaceToSpaces(lineReader->buf);
-	fprintf(stderr, "%s\n", lineReader->buf);
-	for (int i = 1; i < lineReader->position; ++i)
-		fprintf(stderr, " ");
-	fprintf(stderr, "^");
+void parserError(Lexer *lexer, char *message) {
+	if (lexer->inputFileName == NULL) error("Input file name not set");
+	size_t offset = lexer->position > 0 ? lexer->position - 1 : 0;
+	if (offset > lexer->size) offset = lexer->size;
+	size_t lineStart = offset, lineEnd = offset;
+	while (lineStart > 0 && lexer->data[lineStart - 1] != '\n')
+		--lineStart;
+	while (lineEnd < lexer->size && lexer->data[lineEnd] != '\n')
+		++lineEnd;
+	int line = 1 + lexer->droppedLines;
+	for (size_t k = 0; k < lineStart; ++k)
+		if (lexer->data[k] == '\n')
+			++line;
+	size_t column = offset - lineStart + 1 + (lineStart == 0 ? lexer->droppedColumns : 0);
+	if (errorContext != NULL) fail(LOOP_ERROR_SYNTAX, line, column, message);
+	flockfile(stderr);
+	fprintf(stderr, "%s:%d:%zu: error: %s\n", lexer->inputFileName, line, column, message);
+	for (size_t k = lineStart; k < lineEnd; ++k)
+		fputc(characterClasses[(unsigned char) lexer->data[k]] == whitespaceCharacter ? ' ' : lexer->data[k], stderr);
+	fputc('\n', stderr);
+	for (size_t k = lineStart; k < offset; ++k)
+		fputc(' ', stderr);
+	fprintf(stderr, "^\n");
 	exit(EXIT_FAILURE);
 }
 
 Program *newProgram() {
 	Program *program = (Program *) calloc(1, sizeof(Program));
+	if (program == NULL) systemError();
+	return program;
+}
+
+uint32_t newInstruction(Program *program) {
+	if (program->size == program->capacity) {
+		if (program->capacity > UINT32_MAX / 2) error("Program too large");
+		program->capacity = program->capacity ? 2 * program->capacity : 1024;
+		program->instructions = (Instruction *) realloc(program->instructions, program->capacity * sizeof(Instruction));
+		if (program->instructions == NULL) systemError();
+	}
+	memset(program->instructions + program->size, 0, sizeof(Instruction));
+	return program->size++;
+}
+
+uint32_t newInnerInstruction(Program *program, uint32_t index) {
+	uint32_t inner = newInstruction(program);
+	program->instructions[index].innerInstruction = inner;
+	return inner;
+}
+
+uint32_t newNextInstruction(Program *program, uint32_t index) {
+	uint32_t next = newInstruction(program);
+	program->instructions[index].nextInstruction = next;
+	return next;
+}
+
+void freeLoopSummary(LoopSummary *summary) {
+	if (summary == NULL) return;
+	free(summary->effects);
+	free(summary);
 }
 
 void freeProgram(Program *program) {
 	if (program == NULL) return;
-	freeProgram(program->innerProgram);
-	freeProgram(program->nextProgram);
+	if (program->summaries != NULL)
+		for (uint32_t k = 0; k < program->size; ++k)
+			freeLoopSummary(program->summaries[k]);
+	free(program->summaries);
+	if (program->idioms != NULL)
+		for (uint32_t k = 0; k < program->size; ++k)
+			free(program->idioms[k]);
+	free(program->idioms);
+	free(program->instructions);
 	free(program);
 }
 
-ProgramStack *newProgramStack() {
-	return NULL;
+void push(IndexStack *stack, uint32_t index) {
+	if (stack->size == stack->capacity) {
+		stack->capacity = stack->capacity ? 2 * stack->capacity : 64;
+		stack->indices = (uint32_t *) realloc(stack->indices, stack->capacity * sizeof(uint32_t));
+		if (stack->indices == NULL) systemError();
+	}
+	stack->indices[stack->size++] = index;
 }
 
-void push(ProgramStack **programStack, Program *program) {
-	ProgramStack *newProgramStack = (ProgramStack *) malloc(sizeof(ProgramStack));
-	newProgramStack->program = program;
-	newProgramStack->next = *programStack;
-	*programStack = newProgramStack;
+uint32_t pop(IndexStack *stack) {
+	if (stack->size == 0) return 0;
+	return stack->indices[--stack->size];
 }
 
-Program *pop(ProgramStack **programStack) {
-	if (programStack == NULL || *programStack == NULL) return NULL;
-	ProgramStack *oldProgramStack = *programStack;
-	Program *program = oldProgramStack->program;
-	*programStack = oldProgramStack->next;
-	free(oldProgramStack);
-	return program;
+void freeIndexStack(IndexStack *stack) {
+	free(stack->indices);
+	stack->indices = NULL;
+	stack->size = stack->capacity = 0;
 }
 
-void freeProgramStack(ProgramStack *programStack) {
-	if (programStack == NULL) return;
-	freeProgramStack(programStack->next);
-	free(programStack);
+char *readAll(int fd, size_t *size) {
+	size_t capacity = READ_BUF_SIZE;
+	char *data = (char *) malloc(capacity);
+	if (data == NULL) systemError();
+	*size = 0;
+	while (1) {
+		if (*size == capacity) {
+			capacity *= 2;
+			data = (char *) realloc(data, capacity);
+			if (data == NULL) systemError();
+		}
+		ssize_t count = read(fd, data + *size, capacity - *size);
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0) systemError();
+		if (count == 0) return data;
+		*size += count;
+	}
 }
 
-LineReader *newLineReader(char *inputFileName, int size) {
-	LineReader *lineReader = malloc(sizeof(LineReader));
-	lineReader->inputFileName = inputFileName;
-	lineReader->input = fopen(inputFileName, "r");
-	if (lineReader->input == NULL) error(strerror(errno));
-	lineReader->buf = malloc(size);
-	lineReader->size = size;
-	lineReader->line = 0;
-	lineReader->segment = 0;
-	lineReader->position = 0;
-	lineReader->endOfLine = 1;
-	return lineReader;
+Lexer *newMemoryLexer(const char *data, size_t size, char *inputFileName) {
+	Lexer *lexer = (Lexer *) calloc(1, sizeof(Lexer));
+	if (lexer == NULL) systemError();
+	lexer->inputFileName = inputFileName;
+	lexer->data = data;
+	lexer->size = size;
+	lexer->borrowed = 1;
+	lexer->line = 1;
+	return lexer;
 }
 
-void freeLineReader(LineReader *lineReader) {
-	if (lineReader == NULL) return;
-	free(lineReader->buf);
-	fclose(lineReader->input);
-	free(lineReader);
+/*
+ * An input file name of "-" reads from stdin. A streamed input that cannot be mapped is read
+ * in chunks as the lexer needs them instead of all at once, see refillLexer.
+ */
+Lexer *newLexer(char *inputFileName, int streamed) {
+	Lexer *lexer = (Lexer *) calloc(1, sizeof(Lexer));
+	if (lexer == NULL) systemError();
+	int fd = STDIN_FILENO;
+	lexer->inputFileName = inputFileName;
+	lexer->line = 1;
+	if (strcmp(inputFileName, "-") == 0)
+		lexer->inputFileName = "<stdin>";
+	else if ((fd = open(inputFileName, O_RDONLY)) < 0)
+		systemError();
+	struct stat status;
+	if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+		void *data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, status.st_size, MADV_SEQUENTIAL);
+			lexer->data = (const char *) data;
+			lexer->size = status.st_size;
+			lexer->mapped = 1;
+		}
+	}
+	if (!lexer->mapped && streamed) {
+		lexer->capacity = READ_BUF_SIZE;
+		lexer->data = (const char *) malloc(lexer->capacity);
+		if (lexer->data == NULL) systemError();
+		lexer->refilling = 1;
+		lexer->fd = fd;
+		return lexer;
+	}
+	if (!lexer->mapped)
+		lexer->data = readAll(fd, &lexer->size);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return lexer;
 }
 
+void freeLexer(Lexer *lexer) {
+	if (lexer == NULL) return;
+	if (lexer->mapped)
+		munmap((void *) lexer->data, lexer->size);
+	else if (!lexer->borrowed)
+		free((void *) lexer->data);
+	if (lexer->refilling && lexer->fd != STDIN_FILENO)
+		close(lexer->fd);
+	freeIndexStack(&lexer->blocks);
+	free(lexer);
+}
 
 void adjustOutputFileName(char **outputFileName) {
 	if (outputFileName == NULL || *outputFileName == NULL) error("Unexpected output file name null pointer");
 	int length = strlen(*outputFileName);
-	char *name = malloc(length + 2);
+	char *name = malloc(length + 3);
+	if (name == NULL) systemError();
 	strcpy(name, *outputFileName);
-	if (length < 2 || name[length - 2] != '.' || name[length - 1] != 'c')
+	if (strcmp(name, "-") != 0 && (length < 2 || name[length - 2] != '.' || name[length - 1] != 'c'))
 		strcat(name, ".c");
 	*outputFileName = name;
 }
 
-void handleArguments(int argc, char **argv, ParserOptions *parserOptions, WriteOptions *writeOptions) {
+int parseThreadCount(char *argument) {
+	char *end;
+	errno = 0;
+	long count = strtol(argument, &end, 10);
+	if (*argument < '0' || *argument > '9' || *end != '\0' || count <= 0) error("Thread count must be a positive number");
+	if (errno == ERANGE || count > 4096) error("Thread count too large");
+	return (int) count;
+}
+
+void addInputFile(JobOptions *jobOptions, char *inputFileName) {
+	if (jobOptions->inputCount == jobOptions->capacity) {
+		jobOptions->capacity = jobOptions->capacity == 0 ? 16 : jobOptions->capacity * 2;
+		jobOptions->inputFileNames = (char **) realloc(jobOptions->inputFileNames, jobOptions->capacity * sizeof(char *));
+		if (jobOptions->inputFileNames == NULL) systemError();
+	}
+	jobOptions->inputFileNames[jobOptions->inputCount++] = inputFileName;
+}
+
+char *joinPath(char *directory, char *entry) {
+	size_t length = strlen(directory);
+	char *path = (char *) malloc(length + strlen(entry) + 2);
+	if (path == NULL) systemError();
+	strcpy(path, directory);
+	if (length == 0 || directory[length - 1] != '/')
+		strcat(path, "/");
+	strcat(path, entry);
+	return path;
+}
+
+void addInputDirectory(JobOptions *jobOptions, char *directoryName) {
+	DIR *directory = opendir(directoryName);
+	if (directory == NULL) systemError();
+	struct dirent *entry;
+	while ((entry = readdir(directory)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		char *path = joinPath(directoryName, entry->d_name);
+		struct stat status;
+		size_t length = strlen(entry->d_name);
+		if (stat(path, &status) != 0) systemError();
+		if (S_ISDIR(status.st_mode)) {
+			addInputDirectory(jobOptions, path);
+		} else if (S_ISREG(status.st_mode) && length > 5 && strcmp(entry->d_name + length - 5, ".loop") == 0) {
+			addInputFile(jobOptions, path);
+			continue;
+		}
+		free(path);
+	}
+	closedir(directory);
+}
+
+/* A manifest names one input per line, relative to the working directory. Its buffer stays alive for the names. */
+void addInputManifest(JobOptions *jobOptions, char *manifestName) {
+	int fd = open(manifestName, O_RDONLY);
+	if (fd < 0) systemError();
+	size_t size;
+	char *data = readAll(fd, &size);
+	close(fd);
+	data = (char *) realloc(data, size + 1);
+	if (data == NULL) systemError();
+	data[size] = '\n';
+	for (char *line = data, *end; line < data + size; line = end + 1) {
+		end = memchr(line, '\n', data + size + 1 - line);
+		*end = '\0';
+		if (end > line && end[-1] == '\r') end[-1] = '\0';
+		if (*line != '\0') addInputFile(jobOptions, line);
+	}
+}
+
+void addInput(JobOptions *jobOptions, char *argument) {
+	struct stat status;
+	if (argument[0] == '@') {
+		addInputManifest(jobOptions, argument + 1);
+		jobOptions->multipleFiles = 1;
+	} else if (strcmp(argument, "-") != 0 && stat(argument, &status) == 0 && S_ISDIR(status.st_mode)) {
+		addInputDirectory(jobOptions, argument);
+		jobOptions->multipleFiles = 1;
+	} else
+		addInputFile(jobOptions, argument);
+}
+
+/* The table is split into sets of MEMO_WAYS slots, so the capacity gets rounded up to a power of two of at least that. */
+uint32_t roundMemoCapacity(unsigned long long capacity) {
+	if (capacity > MAX_MEMO_CAPACITY) error("Memo capacity too large");
+	uint32_t rounded = MEMO_WAYS;
+	while (rounded < capacity) rounded <<= 1;
+	return rounded;
+}
+
+uint32_t parseMemoCapacity(char *argument) {
+	char *end;
+	errno = 0;
+	unsigned long long capacity = strtoull(argument, &end, 10);
+	if (*argument < '0' || *argument > '9' || *end != '\0' || capacity == 0) error("Memo capacity must be a positive number");
+	if (errno == ERANGE) error("Memo capacity too large");
+	return roundMemoCapacity(capacity);
+}
+
+/* Appends to the inputs fixed so far, so the option may be repeated. A later value for the same input wins. */
+void parseSpecializations(char *argument, ParserOptions *parserOptions) {
+	char *end = argument;
+	do {
+		if (end[0] != 'x' || end[1] < '0' || end[1] > '9') error("--specialize expects a list like x2=10,x5=0");
+		errno = 0;
+		unsigned long long variable = strtoull(end + 1, &end, 10);
+		if (errno == ERANGE || variable > MAX_VARIABLE_INDEX) error("Variable index too large");
+		if (variable == 0) error("x0 is the result and cannot be fixed");
+		if (end[0] != '=' || end[1] < '0' || end[1] > '9') error("--specialize expects a list like x2=10,x5=0");
+		unsigned long long value = strtoull(end + 1, &end, 10);
+		if (errno == ERANGE) error("Fixed value too large");
+		if (*end != '\0' && *end != ',') error("--specialize expects a list like x2=10,x5=0");
+		Specialization *specializations = (Specialization *) realloc(parserOptions->specializations, (parserOptions->specializationCount + 1) * sizeof(Specialization));
+		if (specializations == NULL) systemError();
+		specializations[parserOptions->specializationCount].variable = variable;
+		specializations[parserOptions->specializationCount++].value = value;
+		parserOptions->specializations = specializations;
+	} while (*end++ == ',');
+}
+
+uint64_t parseCacheCapacity(char *argument) {
+	char *end;
+	errno = 0;
+	unsigned long long capacity = strtoull(argument, &end, 10);
+	if (*argument < '0' || *argument > '9' || *end != '\0') error("Cache size must be a number of MiB");
+	if (errno == ERANGE || capacity > UINT64_MAX >> 20) error("Cache size too large");
+	return (uint64_t) capacity << 20;
+}
+
+/* The writer relies on these, the command line checks the rest before. */
+void checkWriteOptions(WriteOptions *writeOptions) {
+	if (writeOptions->extensionBench && writeOptions->extensionBatch) error("--bench and --batch cannot be combined");
+	if (writeOptions->extensionProfile && writeOptions->extensionBatch) error("--profile counters are not thread-safe and cannot be combined with --batch");
+	if (writeOptions->extensionLanes && (writeOptions->extensionBignum || writeOptions->extensionChecked)) error("--simd needs 64-bit variables and cannot be combined with --bignum or --checked");
+	if (writeOptions->extensionChecked && writeOptions->extensionBignum) error("--checked and --bignum cannot be combined");
+	if (writeOptions->memoCapacity && writeOptions->extensionBignum) error("--memo cannot be combined with --bignum");
+}
+
+void handleArguments(int argc, char **argv, ParserOptions *parserOptions, WriteOptions *writeOptions, JobOptions *jobOptions, RunOptions *runOptions) {
 	struct option longOptions[] = {
 		{"help", no_argument, NULL, 'h'},
 		{"version", no_argument, NULL, 'v'},
 		{"output", required_argument, NULL, 'o'},
 		{"while", no_argument, NULL, 'w'},
 		{"header", no_argument, NULL, 'H'},
+		{"scalar", no_argument, NULL, 's'},
+		{"bignum", no_argument, NULL, 'b'},
+		{"checked", no_argument, NULL, 'c'},
+		{"batch", no_argument, NULL, 'B'},
+		{"bench", no_argument, NULL, 'T'},
+		{"profile", no_argument, NULL, 'P'},
+		{"simd", no_argument, NULL, 'S'},
+		{"memo", required_argument, NULL, 'm'},
 		{"name", required_argument, NULL, 'n'},
+		{"threads", required_argument, NULL, 't'},
 		{"operations", no_argument, NULL, 'O'},
 		{"assignment", no_argument, NULL, 'a'},
 		{"noWhitespace", no_argument, NULL, 'N'},
@@ -214,11 +827,25 @@ void handleArguments(int argc, char **argv, ParserOptions *parserOptions, WriteO
 		{"ifExtended", no_argument, NULL, 'I'},
 		{"whileExtended", no_argument, NULL, 'W'},
 		{"klausur", no_argument, NULL, 'k'},
+		{"noOptimize", no_argument, NULL, 'X'},
+		{"explainIdioms", no_argument, NULL, 'E'},
+		{"explain-idioms", no_argument, NULL, 'E'},
+		{"run", no_argument, NULL, 'r'},
+		{"jit", no_argument, NULL, 'j'},
+		{"serve", required_argument, NULL, 'L'},
+		{"connect", required_argument, NULL, 'C'},
+		{"cache", required_argument, NULL, 'D'},
+		{"cacheSize", required_argument, NULL, 'Z'},
+		{"cacheStats", no_argument, NULL, 'Q'},
+		{"exec", no_argument, NULL, 'x'},
+		{"compiler", required_argument, NULL, 'G'},
+		{"stream", no_argument, NULL, 'l'},
+		{"specialize", required_argument, NULL, 'p'},
 		{NULL, 0, NULL, 0}
 	};
 	while (1) {
 		int index = 0;
-		int c = getopt_long(argc, argv, "hvo:wn:HOaNiIWk", longOptions, &index);
+		int c = getopt_long(argc, argv, "hvo:wn:t:HsbcBTPSm:OaNiIWkXErjL:C:D:Z:QxG:lp:", longOptions, &index);
 		if (c == EOF) break;
 		switch (c) {
 		case 'h':
@@ -236,9 +863,37 @@ void handleArguments(int argc, char **argv, ParserOptions *parserOptions, WriteO
 		case 'H':
 			writeOptions->extensionHeader = 1;
 			break;
+		case 's':
+			writeOptions->extensionScalar = 1;
+			break;
+		case 'b':
+			writeOptions->extensionBignum = 1;
+			break;
+		case 'c':
+			writeOptions->extensionChecked = 1;
+			parserOptions->keepOverflows = 1;
+			break;
+		case 'B':
+			writeOptions->extensionBatch = 1;
+			break;
+		case 'T':
+			writeOptions->extensionBench = 1;
+			break;
+		case 'P':
+			writeOptions->extensionProfile = 1;
+			break;
+		case 'S':
+			writeOptions->extensionLanes = 1;
+			break;
+		case 'm':
+			writeOptions->memoCapacity = parseMemoCapacity(optarg);
+			break;
 		case 'n':
 			writeOptions->functionName = optarg;
 			break;
+		case 't':
+			jobOptions->threadCount = parseThreadCount(optarg);
+			break;
 		case 'O':
 			parserOptions->extensionOperations = 1;
 			break;
@@ -265,572 +920,6128 @@ void handleArguments(int argc, char **argv, ParserOptions *parserOptions, WriteO
 			parserOptions->extensionIf = 1;
 			parserOptions->extensionIfExtended = 1;
 			break;
+		case 'X':
+			parserOptions->noOptimize = 1;
+			break;
+		case 'E':
+			writeOptions->explainIdioms = 1;
+			break;
+		case 'r':
+			runOptions->extensionRun = 1;
+			break;
+		case 'j':
+			runOptions->extensionRun = 1;
+			runOptions->extensionJit = 1;
+			break;
+		case 'L':
+			runOptions->serveSocket = optarg;
+			break;
+		case 'C':
+			runOptions->extensionRun = 1;
+			runOptions->connectSocket = optarg;
+			break;
+		case 'D':
+			writeOptions->cacheDirectory = optarg;
+			break;
+		case 'Z':
+			writeOptions->cacheCapacity = parseCacheCapacity(optarg);
+			break;
+		case 'Q':
+			writeOptions->showCacheStatistics = 1;
+			break;
+		case 'x':
+			runOptions->extensionRun = 1;
+			runOptions->extensionExec = 1;
+			break;
+		case 'G':
+			runOptions->compiler = optarg;
+			break;
+		case 'l':
+			writeOptions->extensionStream = 1;
+			break;
+		case 'p':
+			parseSpecializations(optarg, parserOptions);
+			break;
 		case '?':
 			break;
 		default:
 			error("Unknown argument parser error");
 		}
 	}
+	if (runOptions->serveSocket != NULL) {
+		if (runOptions->connectSocket != NULL) error("--serve and --connect cannot be combined");
+		if (runOptions->extensionRun) error("--serve takes the inputs with every request, not from --run");
+		if (optind < argc) error("--serve takes the programs with every request, not as input files");
+		return;
+	}
+	if (writeOptions->cacheDirectory == NULL && writeOptions->showCacheStatistics) error("--cacheStats needs the cache directory given with --cache");
+	if (runOptions->extensionExec && (runOptions->extensionJit || runOptions->connectSocket != NULL)) error("--exec cannot be combined with --jit or --connect");
+	if (runOptions->compiler != NULL && !runOptions->extensionExec) error("--compiler only applies to --exec");
+	if (runOptions->compiler == NULL) runOptions->compiler = compiler;
+	if (writeOptions->cacheDirectory != NULL && runOptions->extensionRun && !runOptions->extensionExec) error("--cache only applies to generated C code and --exec");
+	if (optind >= argc && writeOptions->showCacheStatistics) return;
 	if (optind >= argc) error("No input file");
-	if (optind < argc - 1) error("Too many input files");
+	if (writeOptions->extensionBignum && runOptions->extensionRun) error("--bignum only applies to generated C code");
+	if (writeOptions->extensionChecked && runOptions->extensionRun) error("--checked only applies to generated C code");
+	if (writeOptions->extensionBatch && runOptions->extensionRun) error("--batch only applies to generated C code");
+	if (writeOptions->extensionBench && runOptions->extensionRun) error("--bench only applies to generated C code");
+	if (writeOptions->extensionProfile && runOptions->extensionRun) error("--profile only applies to generated C code");
+	if (writeOptions->extensionLanes && runOptions->extensionRun) error("--simd only applies to generated C code");
+	if (writeOptions->memoCapacity && runOptions->extensionRun) error("--memo only applies to generated C code");
+	if (writeOptions->explainIdioms && runOptions->extensionRun) error("--explainIdioms only applies to generated C code");
+	if (writeOptions->extensionStream && runOptions->extensionRun) error("--stream only applies to generated C code");
+	if (writeOptions->extensionStream && (writeOptions->extensionScalar || writeOptions->extensionBignum || writeOptions->extensionLanes
+		|| writeOptions->memoCapacity || writeOptions->extensionProfile || writeOptions->explainIdioms))
+		error("--stream cannot be combined with --scalar, --bignum, --simd, --memo, --profile, or --explainIdioms");
+	if (writeOptions->extensionStream && writeOptions->cacheDirectory != NULL) error("--stream cannot be combined with --cache");
+	if (writeOptions->extensionStream && parserOptions->specializationCount) error("--stream cannot be combined with --specialize");
+	if (runOptions->connectSocket != NULL && parserOptions->specializationCount) error("--connect cannot be combined with --specialize");
+	checkWriteOptions(writeOptions);
+	if (writeOptions->extensionHeader && strcmp(writeOptions->outputFileName, "-") == 0) error("--header needs an output file name to derive the header name from");
+	if (!runOptions->extensionRun) {
+		for (int k = optind; k < argc; ++k)
+			addInput(jobOptions, argv[k]);
+		if (jobOptions->inputCount == 0) error("No input file");
+		jobOptions->multipleFiles |= argc - optind > 1;
+	}
+	if (jobOptions->multipleFiles) {
+		if (writeOptions->functionName != name) error("--name only applies to a single input file");
+		if (strcmp(writeOptions->outputFileName, "-") == 0) error("Writing to stdout only works with a single input file");
+		if (writeOptions->outputFileName != file) jobOptions->outputDirectory = writeOptions->outputFileName;
+		return;
+	}
 	parserOptions->inputFileName = argv[optind];
+	writeOptions->inputFileName = strcmp(argv[optind], "-") == 0 ? "<stdin>" : argv[optind];
+	runOptions->inputCount = argc - optind - 1;
+	runOptions->inputs = argv + optind + 1;
 	adjustOutputFileName(&(writeOptions->outputFileName));
 }
 
-char getChar(LineReader *lineReader) {
+/* Counts the lines up to end, which must not lie before the start of the last located instruction. */
+void scanLines(Lexer *lexer, size_t end) {
+	const char *newline;
+	while ((newline = memchr(lexer->data + lexer->scanned, '\n', end - lexer->scanned)) != NULL) {
+		++lexer->line;
+		lexer->scanned = lexer->lineStart = newline - lexer->data + 1;
+		lexer->droppedColumns = 0;
+	}
+	lexer->scanned = end;
+}
+
+/*
+ * Reads the next chunk of a streamed input once the lexer has used up its data, and returns
+ * whether there is more. Everything before the current line gets dropped first, and so does the
+ * current line up to the position once it is longer than a chunk, so that memory stays bounded.
+ * Positions held across a call are therefore invalid, and a syntax error shows the line from the
+ * first byte still held. Only the streaming parser calls it, between instructions or after having
+ * located the current one.
+ */
+int refillLexer(Lexer *lexer) {
+	if (!lexer->refilling) return 0;
+	scanLines(lexer, lexer->position);
+	size_t drop = lexer->position - lexer->lineStart < READ_BUF_SIZE ? lexer->lineStart : lexer->position;
+	if (drop > lexer->lineStart) {
+		lexer->droppedColumns += drop - lexer->lineStart;
+		lexer->lineStart = drop;
+	}
+	char *data = (char *) lexer->data;
+	memmove(data, data + drop, lexer->size - drop);
+	lexer->size -= drop;
+	lexer->position -= drop;
+	lexer->scanned -= drop;
+	lexer->lineStart -= drop;
+	lexer->droppedLines = lexer->line - 1;
+	if (lexer->size == lexer->capacity) {
+		lexer->capacity *= 2;
+		data = (char *) realloc(data, lexer->capacity);
+		if (data == NULL) systemError();
+		lexer->data = data;
+	}
 	while (1) {
-		if (lineReader->position >= lineReader->size) error("Invalid line reader buffer position");
-		char c = lineReader->buf[lineReader->position++];
-		if (c != '\0') return c;
-		char *res = fgets(lineReader->buf, lineReader->size, lineReader->input);
-		if (res == NULL) return EOF;
-		if (lineReader->endOfLine) {
-			lineReader->line++;
-			lineReader->segment = 0;
-			lineReader->position = 0;
-			lineReader->endOfLine = 0;
-		} else {
-			lineReader->segment++;
-			lineReader->position = 0;
+		ssize_t count = read(lexer->fd, data + lexer->size, lexer->capacity - lexer->size);
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0) systemError();
+		if (count > 0) {
+			lexer->size += count;
+			return 1;
 		}
-		int len = strlen(res);
-		if (len > 0 && res[len - 1] == '\n')
-			lineReader->endOfLine = 1;
+		if (lexer->fd != STDIN_FILENO)
+			close(lexer->fd);
+		lexer->refilling = 0;
+		return 0;
 	}
+}
+
+/* Past the end, the position keeps pointing one behind the data so that position-- undoes the read. */
+char getChar(Lexer *lexer) {
+	if (lexer->position < lexer->size || refillLexer(lexer))
+		return lexer->data[lexer->position++];
+	lexer->position = lexer->size + 1;
 	return EOF;
 }
 
-int consumeWhitespace(LineReader *lineReader, int minimum, ParserOptions *parserOptions) {
+int consumeWhitespace(Lexer *lexer, int minimum, ParserOptions *parserOptions) {
 	int count = 0;
-	char c;
-	while (c = getChar(lineReader), strchr(" \t\r\n", c))
+	while ((lexer->position < lexer->size || refillLexer(lexer)) && characterClasses[(unsigned char) lexer->data[lexer->position]] == whitespaceCharacter) {
+		++lexer->position;
 		++count;
+	}
 	if (count < minimum && !parserOptions->noWhitespace) {
-		if (c == EOF) parserError(lineReader, "Unexpected end of file");
-		else parserError(lineReader, "Expected whitespace");
+		if (getChar(lexer) == EOF) parserError(lexer, "Unexpected end of file");
+		else parserError(lexer, "Expected whitespace");
 	}
-	lineReader->position--;
 	return count;
 }
 
-int parseNumber(LineReader *lineReader) {
-	int count = 0, x = 0;
-	char c;
-	while (c = getChar(lineReader), c >= '0' && c <= '9') {
-		x *= 10;
-		x += c - '0';
-		++count;
+uint64_t parseNumber(Lexer *lexer) {
+	int digits = 0;
+	uint64_t x = 0;
+	while ((lexer->position < lexer->size || refillLexer(lexer)) && characterClasses[(unsigned char) lexer->data[lexer->position]] == digitCharacter) {
+		unsigned digit = lexer->data[lexer->position++] - '0';
+		if (x > (UINT64_MAX - digit) / 10) parserError(lexer, "Number too large");
+		x = 10 * x + digit;
+		digits = 1;
 	}
-	if (count < 1) {
-		if (c == EOF)
-			parserError(lineReader, "Unexpected end of file");
+	if (!digits) {
+		if (getChar(lexer) == EOF)
+			parserError(lexer, "Unexpected end of file");
 		else
-			parserError(lineReader, "Expected number");
+			parserError(lexer, "Expected number");
 	}
-	lineReader->position--;
 	return x;
 }
 
-void consumeString(LineReader *lineReader, char *string) {
+uint32_t parseVariable(Lexer *lexer) {
+	uint64_t index = parseNumber(lexer);
+	if (index > MAX_VARIABLE_INDEX) parserError(lexer, "Variable index too large");
+	if (index > (uint64_t) heighestIndex)
+		heighestIndex = index;
+	return index;
+}
+
+/* Records where the instruction whose first character was just read starts. */
+void locateInstruction(Lexer *lexer, Instruction *instruction, size_t start) {
+	scanLines(lexer, start);
+	instruction->line = lexer->line;
+	instruction->column = start - lexer->lineStart + 1 + lexer->droppedColumns;
+}
+
+void consumeString(Lexer *lexer, char *string) {
 	if (string == NULL) return;
-	for (int i = 0; i < strlen(string); ++i) {
-		char c = getChar(lineReader);
+	size_t length = strlen(string);
+	if (lexer->position + length <= lexer->size && memcmp(lexer->data + lexer->position, string, length) == 0) {
+		lexer->position += length;
+		return;
+	}
+	for (size_t i = 0; i < length; ++i) {
+		char c = getChar(lexer);
 		if (c != string[i]) {
-			if (c == EOF) parserError(lineReader, "Unexpected end of file");
+			if (c == EOF) parserError(lexer, "Unexpected end of file");
 			char buf[20];
 			sprintf(buf, "Expected '%c'", string[i]);
-			parserError(lineReader, buf);
+			parserError(lexer, buf);
 		}
 	}
 }
 
-void parseAssignment(Program *program, LineReader *lineReader, ParserOptions *parserOptions, int *count) {
+void parseAssignment(Instruction *instruction, Lexer *lexer, ParserOptions *parserOptions, int *count) {
 	char c;
-	program->instructionType = assignment;
-	program->i = parseNumber(lineReader);
-	if (program->i > heighestIndex)
-		heighestIndex = program->i;
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, ":=");
-	consumeWhitespace(lineReader, 1, parserOptions);
+	instruction->instructionType = assignment;
+	instruction->i = parseVariable(lexer);
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, ":=");
+	consumeWhitespace(lexer, 1, parserOptions);
 	if (parserOptions->extensionAssignment) {
-		c = getChar(lineReader);
-		lineReader->position--;
+		c = getChar(lexer);
+		lexer->position--;
 		if (c >= '0' && c <= '9') {
-			program->operation = constant;
-			program->c = parseNumber(lineReader);
-			*count = consumeWhitespace(lineReader, 0, parserOptions);
+			instruction->operation = constant;
+			instruction->c = parseNumber(lexer);
+			*count = consumeWhitespace(lexer, 0, parserOptions);
 			return;
 		}
 	}
-	consumeString(lineReader, "x");
-	program->j = parseNumber(lineReader);
-	if (program->j > heighestIndex)
-		heighestIndex = program->j;
+	consumeString(lexer, "x");
+	instruction->j = parseVariable(lexer);
 	if (parserOptions->extensionAssignment) {
-		*count = consumeWhitespace(lineReader, 0, parserOptions);
-		c = getChar(lineReader);
-		lineReader->position--;
+		*count = consumeWhitespace(lexer, 0, parserOptions);
+		c = getChar(lexer);
+		lexer->position--;
 		if (c == ';' || c == 'E' || c == EOF) {
-			if (!parserOptions->noWhitespace && c == 'E' && *count == 0) parserError(lineReader, "Expected whitespace");
-			program->operation = variable;
+			if (!parserOptions->noWhitespace && c == 'E' && *count == 0) parserError(lexer, "Expected whitespace");
+			instruction->operation = variable;
 			return;
 		}
 	} else
-		consumeWhitespace(lineReader, 1, parserOptions);
-	c = getChar(lineReader);
+		consumeWhitespace(lexer, 1, parserOptions);
+	c = getChar(lexer);
 	if (c == '+') {
-		program->operation = plus;
+		instruction->operation = plus;
 	} else if (c == '-') {
-		program->operation = minus;
+		instruction->operation = minus;
 	} else if (parserOptions->extensionOperations && c == '*') {
-		program->operation = times;
+		instruction->operation = times;
 	} else if (parserOptions->extensionOperations && c == 'D') {
-		consumeString(lineReader, "IV");
-		program->operation = dividedBy;
+		consumeString(lexer, "IV");
+		instruction->operation = dividedBy;
 	} else if (parserOptions->extensionOperations && c == 'M') {
-		consumeString(lineReader, "OD");
-		program->operation = modulo;
+		consumeString(lexer, "OD");
+		instruction->operation = modulo;
 	} else if (c == EOF) {
-		parserError(lineReader, "Unexpected end of file");
+		parserError(lexer, "Unexpected end of file");
 	} else {
-		if (parserOptions->extensionOperations) parserError(lineReader, "Expected '+', '-', '*', \"DIV\", or \"MOD\"");	
-		else parserError(lineReader, "Expected '+' or '-'");	
+		if (parserOptions->extensionOperations) parserError(lexer, "Expected '+', '-', '*', \"DIV\", or \"MOD\"");	
+		else parserError(lexer, "Expected '+' or '-'");	
 	}
-	consumeWhitespace(lineReader, 1, parserOptions);
+	consumeWhitespace(lexer, 1, parserOptions);
 	if (parserOptions->extensionAssignment) {
-		c = getChar(lineReader);
+		c = getChar(lexer);
 		if (c == 'x')
-			program->treatCAsVariable = 1;
+			instruction->treatCAsVariable = 1;
 		else if (c >= '0' && c <= '9')
-			lineReader->position--;
-		else parserError(lineReader, "Expected a variable or number");
-	}
-	program->c = parseNumber(lineReader);
-	*count = consumeWhitespace(lineReader, 0, parserOptions);
-}
-
-void parseLoop(Program *program, LineReader *lineReader, ParserOptions *parserOptions) {
-	program->instructionType = loopInstruction;
-	consumeString(lineReader, "OOP");
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, "x");
-	program->i = parseNumber(lineReader);
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, "DO");
-	consumeWhitespace(lineReader, 1, parserOptions);
-}
-
-void parseWhile(Program *program, LineReader *lineReader, ParserOptions *parserOptions) {
-	program->instructionType = whileInstruction;
-	consumeString(lineReader, "HILE");
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, "x");
-	program->i = parseNumber(lineReader);
-	consumeWhitespace(lineReader, 1, parserOptions);
-	char c = getChar(lineReader);
+			lexer->position--;
+		else parserError(lexer, "Expected a variable or number");
+	}
+	instruction->c = instruction->treatCAsVariable ? parseVariable(lexer) : parseNumber(lexer);
+	*count = consumeWhitespace(lexer, 0, parserOptions);
+}
+
+void parseLoop(Instruction *instruction, Lexer *lexer, ParserOptions *parserOptions) {
+	instruction->instructionType = loopInstruction;
+	consumeString(lexer, "OOP");
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, "x");
+	instruction->i = parseVariable(lexer);
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, "DO");
+	consumeWhitespace(lexer, 1, parserOptions);
+}
+
+void parseWhile(Instruction *instruction, Lexer *lexer, ParserOptions *parserOptions) {
+	instruction->instructionType = whileInstruction;
+	consumeString(lexer, "HILE");
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, "x");
+	instruction->i = parseVariable(lexer);
+	consumeWhitespace(lexer, 1, parserOptions);
+	char c = getChar(lexer);
 	if (c == '!') {
-		consumeString(lineReader, "=");
-		program->operation = notEqual;
+		consumeString(lexer, "=");
+		instruction->operation = notEqual;
 	} else {
 		if (parserOptions->extensionWhileExtended) {
 			if (c == '=') {
-				program->operation = equal;
+				instruction->operation = equal;
 			} else if (c == '>') {
-				c = getChar(lineReader);
+				c = getChar(lexer);
 				if (c == '=') {
-					program->operation = greaterEqual;
+					instruction->operation = greaterEqual;
 				} else {
-					lineReader->position--;
-					program->operation = greater;
+					lexer->position--;
+					instruction->operation = greater;
 				}
 			} else if (c == '<') {
-				c = getChar(lineReader);
+				c = getChar(lexer);
 				if (c == '=') {
-					program->operation = lessEqual;
+					instruction->operation = lessEqual;
 				} else {
-					lineReader->position--;
-					program->operation = less;
+					lexer->position--;
+					instruction->operation = less;
 				}
-			} else parserError(lineReader, "Expected \"=\", \"!=\", \">\", \">=\", \"<\", or \"<=\"");
-		} else parserError(lineReader, "Expected \"!=\"");
+			} else parserError(lexer, "Expected \"=\", \"!=\", \">\", \">=\", \"<\", or \"<=\"");
+		} else parserError(lexer, "Expected \"!=\"");
 	}
-	consumeWhitespace(lineReader, 1, parserOptions);
+	consumeWhitespace(lexer, 1, parserOptions);
 	if (parserOptions->extensionWhileExtended) {
-		c = getChar(lineReader);
+		c = getChar(lexer);
 		if (c == 'x') {
-			program->treatCAsVariable = 1;
+			instruction->treatCAsVariable = 1;
 		} else {
-			lineReader->position--;
+			lexer->position--;
 		}
-		program->c = parseNumber(lineReader);
+		instruction->c = instruction->treatCAsVariable ? parseVariable(lexer) : parseNumber(lexer);
 	} else {
-		consumeString(lineReader, "0");
+		consumeString(lexer, "0");
 	}
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, "DO");
-	consumeWhitespace(lineReader, 1, parserOptions);
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, "DO");
+	consumeWhitespace(lexer, 1, parserOptions);
 }
 
-void parseIf(Program *program, LineReader *lineReader, ParserOptions *parserOptions) {
-	program->instructionType = ifInstructionStart;
-	consumeString(lineReader, "F");
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, "x");
-	program->i = parseNumber(lineReader);
-	consumeWhitespace(lineReader, 1, parserOptions);
-	char c = getChar(lineReader);
+void parseIf(Instruction *instruction, Lexer *lexer, ParserOptions *parserOptions) {
+	instruction->instructionType = ifInstructionStart;
+	consumeString(lexer, "F");
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, "x");
+	instruction->i = parseVariable(lexer);
+	consumeWhitespace(lexer, 1, parserOptions);
+	char c = getChar(lexer);
 	if (c == '=') {
-		program->operation = equal;
+		instruction->operation = equal;
 	} else {
 		if (parserOptions->extensionIfExtended) {
 			if (c == '!') {
-				consumeString(lineReader, "=");
-				program->operation = notEqual;
+				consumeString(lexer, "=");
+				instruction->operation = notEqual;
 			} else if (c == '>') {
-				c = getChar(lineReader);
+				c = getChar(lexer);
 				if (c == '=') {
-					program->operation = greaterEqual;
+					instruction->operation = greaterEqual;
 				} else {
-					lineReader->position--;
-					program->operation = greater;
+					lexer->position--;
+					instruction->operation = greater;
 				}
 			} else if (c == '<') {
-				c = getChar(lineReader);
+				c = getChar(lexer);
 				if (c == '=') {
-					program->operation = lessEqual;
+					instruction->operation = lessEqual;
 				} else {
-					lineReader->position--;
-					program->operation = less;
+					lexer->position--;
+					instruction->operation = less;
 				}
-			} else parserError(lineReader, "Expected \"=\", \"!=\", \">\", \">=\", \"<\", or \"<=\"");
-		} else parserError(lineReader, "Expected '='");
+			} else parserError(lexer, "Expected \"=\", \"!=\", \">\", \">=\", \"<\", or \"<=\"");
+		} else parserError(lexer, "Expected '='");
 	}
-	consumeWhitespace(lineReader, 1, parserOptions);
+	consumeWhitespace(lexer, 1, parserOptions);
 	if (parserOptions->extensionIfExtended) {
-		c = getChar(lineReader);
+		c = getChar(lexer);
 		if (c == 'x') {
-			program->treatCAsVariable = 1;
+			instruction->treatCAsVariable = 1;
 		} else {
-			lineReader->position--;
+			lexer->position--;
 		}
-		program->c = parseNumber(lineReader);
+		instruction->c = instruction->treatCAsVariable ? parseVariable(lexer) : parseNumber(lexer);
 	} else {
-		consumeString(lineReader, "0");
+		consumeString(lexer, "0");
 	}
-	consumeWhitespace(lineReader, 1, parserOptions);
-	consumeString(lineReader, "THEN");
-	consumeWhitespace(lineReader, 1, parserOptions);
+	consumeWhitespace(lexer, 1, parserOptions);
+	consumeString(lexer, "THEN");
+	consumeWhitespace(lexer, 1, parserOptions);
 }
 
-Program *parse(ParserOptions *parserOptions) {
+/* The caller keeps the lexer, the blocks still open at the current position are on its stack. */
+Program *parseLexer(Lexer *lexer, ParserOptions *parserOptions) {
 	heighestIndex = 0;
-	Program *ret = newProgram();
-	Program *program = ret;
-	ProgramStack *programStack = newProgramStack();
-	LineReader *lineReader = newLineReader(parserOptions->inputFileName, LINE_BUF_SIZE);
+	Program *program = newProgram();
+	if (errorContext != NULL) errorContext->program = program;
+	newInstruction(program);
+	uint32_t current = newInstruction(program);
+	IndexStack *stack = &lexer->blocks;
 	int count;
 	
 	while (1) {
-		consumeWhitespace(lineReader, 0, parserOptions);
-		char c = getChar(lineReader);
-		if (c == EOF) parserError(lineReader, "Unexpected end of file");
-		else if (c == 'x')
-			parseAssignment(program, lineReader, parserOptions, &count);
+		consumeWhitespace(lexer, 0, parserOptions);
+		char c = getChar(lexer);
+		Instruction *instruction = program->instructions + current;
+		if (c == EOF) parserError(lexer, "Unexpected end of file");
+		locateInstruction(lexer, instruction, lexer->position - 1);
+		if (c == 'x')
+			parseAssignment(instruction, lexer, parserOptions, &count);
 		else if (c == 'L') {
-			parseLoop(program, lineReader, parserOptions);
-			program->innerProgram = newProgram();
-			push(&programStack, program);
-			program = program->innerProgram;
+			parseLoop(instruction, lexer, parserOptions);
+			push(stack, current);
+			current = newInnerInstruction(program, current);
 			continue;
 		} else if (c == 'W' && parserOptions->extensionWhile) {
-			parseWhile(program, lineReader, parserOptions);
-			program->innerProgram = newProgram();
-			push(&programStack, program);
-			program = program->innerProgram;
+			parseWhile(instruction, lexer, parserOptions);
+			push(stack, current);
+			current = newInnerInstruction(program, current);
 			continue;
 		} else if (c == 'I' && parserOptions->extensionIf) {
-			parseIf(program, lineReader, parserOptions);
-			program->innerProgram = newProgram();
-			push(&programStack, program);
-			program = program->innerProgram;
+			parseIf(instruction, lexer, parserOptions);
+			push(stack, current);
+			current = newInnerInstruction(program, current);
 			continue;
-		} else parserError(lineReader, "Expected beginning of instruction");
+		} else parserError(lexer, "Expected beginning of instruction");
 		
 		end_of_instruction:
-		c = getChar(lineReader);
+		c = getChar(lexer);
 		if (c == ';') {
-			program->nextProgram = newProgram();
-			program = program->nextProgram;
+			current = newNextInstruction(program, current);
 		} else if (c == 'E') {
-			if (count == 0 && !parserOptions->noWhitespace) parserError(lineReader, "Expected whitespace");
-			c = getChar(lineReader);
+			if (count == 0 && !parserOptions->noWhitespace) parserError(lexer, "Expected whitespace");
+			c = getChar(lexer);
 			if (c == 'N') {
-				consumeString(lineReader, "D");
-				program = pop(&programStack);
-				if (program == NULL) parserError(lineReader, "Unexpected END token");
-				count = consumeWhitespace(lineReader, 0, parserOptions);
+				consumeString(lexer, "D");
+				current = pop(stack);
+				if (current == 0) parserError(lexer, "Unexpected END token");
+				count = consumeWhitespace(lexer, 0, parserOptions);
 				goto end_of_instruction;
 			} else if (parserOptions->extensionIfExtended) {
 				if (c == 'L') {
-					consumeString(lineReader, "SE");
-					program = pop(&programStack);
-					if (program->instructionType != ifInstructionStart) parserError(lineReader, "Unexpected ELSE token");
-					consumeWhitespace(lineReader, 1, parserOptions);
-					program->nextProgram = newProgram();
-					program = program->nextProgram;
-					program->instructionType = ifInstructionEnd;
-					program->innerProgram = newProgram();
-					push(&programStack, program);
-					program = program->innerProgram;
+					size_t start = lexer->position - 2;
+					consumeString(lexer, "SE");
+					current = pop(stack);
+					if (current == 0 || program->instructions[current].instructionType != ifInstructionStart) parserError(lexer, "Unexpected ELSE token");
+					consumeWhitespace(lexer, 1, parserOptions);
+					current = newNextInstruction(program, current);
+					program->instructions[current].instructionType = ifInstructionEnd;
+					locateInstruction(lexer, program->instructions + current, start);
+					push(stack, current);
+					current = newInnerInstruction(program, current);
 					continue;
-				} else parserError(lineReader, "Expected 'N' or 'L'");
-			} else parserError(lineReader, "Expected 'N'");
+				} else parserError(lexer, "Expected 'N' or 'L'");
+			} else parserError(lexer, "Expected 'N'");
 		} else if (c == EOF) {
-			if (pop(&programStack) != NULL) parserError(lineReader, "Unexpected end of file");
+			if (pop(stack) != 0) parserError(lexer, "Unexpected end of file");
 			break;
 		} else {
-			if (pop(&programStack) == NULL) parserError(lineReader, "Expected ';' or end of file");
-			else parserError(lineReader, "Expected ';' or \"END\"");
+			if (pop(stack) == 0) parserError(lexer, "Expected ';' or end of file");
+			else parserError(lexer, "Expected ';' or \"END\"");
 		}
 	}
 	
-	freeLineReader(lineReader);
-	freeProgramStack(programStack);
-	return ret;
-}
-
-void writeIncludes(FILE *output) {
-	const char *includes =
-		"#include <stdlib.h>\n"
-		"#include <stdio.h>\n"
-		"#include <string.h>\n"
-		"#include <inttypes.h>\n";
-	fprintf(output, includes);
-}
-
-void writeStart(FILE *output, char *functionName) {
-	const char *start =
-		"\n"
-		"%s %s(%s argc, %s *argv) {\n"
-		"\t%s *x = calloc(%d, sizeof(%s));\n"
-		"\t%s n = argc < %d ? argc : %d;\n"
-		"\tmemcpy(x + 1, argv, n * sizeof(%s));\n";
-	fprintf(output, start, type, functionName, type, type, type, heighestIndex + 1, type, type, heighestIndex, heighestIndex, type);
-}
-
-void writeEnd(FILE *output, char *functionName) {
-	const char *end =
-		"\t\n"
-		"\t\n"
-		"\t%s ret = x[0];\n"
-		"\tfree(x);\n"
-		"\treturn ret;\n"
-		"}\n"
-		"\n"
-		"int main(int argc, char **argv) {\n"
-		"\t%s *arr = malloc((argc - 1) * sizeof(%s));\n"
-		"\tfor (int i = 0; i < argc - 1; ++i) {\n"
-		"\t\tarr[i] = atoi(argv[i + 1]);\n"
-		"\t}\n"
-		"\t%s res = %s(argc - 1, arr);\n"
-		"\tfree(arr);\n"
-		"\tprintf(\"%%\" %s \"\\n\", res);\n"
-		"\treturn 0;\n"
-		"}";
-	fprintf(output, end, type, type, type, type, functionName, typePrintMacro);
+	program->heighestIndex = heighestIndex;
+	return program;
 }
 
-void writeIndentation(int indentation, FILE *output) {
-	fputc('\n', output);
-	for (int i = 0; i < indentation; ++i)
-		fputc('\t', output);
-}
+typedef struct Constant {
+	uint64_t value;
+	uint8_t known;
+} Constant;
 
-void writeAssignment(Program *program, FILE *output) {
-	switch (program->operation) {
-	case constant:
-		fprintf(output, "x[%d] = %d;", program->i, program->c);
-		break;
-	case variable:
-		fprintf(output, "x[%d] = x[%d];", program->i, program->j);
-		break;
+/* Only folds what every backend computes the same way, so nothing that overflows 64 bits or divides by zero. */
+int foldOperation(uint8_t operation, uint64_t a, uint64_t b, uint64_t *result) {
+	switch (operation) {
 	case plus:
-		fprintf(output, program->treatCAsVariable ? "x[%d] = x[%d] + x[%d];" : "x[%d] = x[%d] + %d;", program->i, program->j, program->c);
-		break;
+		return !__builtin_add_overflow(a, b, result);
 	case minus:
-		fprintf(output, program->treatCAsVariable ? "x[%d] = x[%d] > x[%d] ? x[%d] - x[%d] : 0;" : "x[%d] = x[%d] > %d ? x[%d] - %d : 0;", program->i, program->j, program->c, program->j, program->c);
-		break;
+		*result = a > b ? a - b : 0;
+		return 1;
 	case times:
-		fprintf(output, program->treatCAsVariable ? "x[%d] = x[%d] * x[%d];" : "x[%d] = x[%d] * %d;", program->i, program->j, program->c);
-		break;
+		return !__builtin_mul_overflow(a, b, result);
 	case dividedBy:
-		fprintf(output, program->treatCAsVariable ? "x[%d] = x[%d] / x[%d];" : "x[%d] = x[%d] / %d;", program->i, program->j, program->c);
-		break;
+		if (b == 0) return 0;
+		*result = a / b;
+		return 1;
 	case modulo:
-		fprintf(output, program->treatCAsVariable ? "x[%d] = x[%d] %% x[%d];" : "x[%d] = x[%d] %% %d;", program->i, program->j, program->c);
-		break;
+		if (b == 0) return 0;
+		*result = a % b;
+		return 1;
 	default:
-		error("Encountered assignment with undefined operation");
+		return 0;
 	}
 }
 
-void writeLoop(Program *program, FILE *output) {
-	fprintf(output, "for (int i = x[%d]; i; --i) {", program->i);
-}
-
-void writeWhile(Program *program, FILE *output) {
-	char *relation;
-	switch (program->operation) {
+int foldComparison(uint8_t operation, uint64_t a, uint64_t b) {
+	switch (operation) {
 	case equal:
-		relation = "==";
-		break;
+		return a == b;
 	case notEqual:
-		relation = "!=";
-		break;
+		return a != b;
 	case greater:
-		relation = ">";
-		break;
+		return a > b;
 	case greaterEqual:
-		relation = ">=";
-		break;
+		return a >= b;
 	case less:
-		relation = "<";
-		break;
+		return a < b;
 	case lessEqual:
-		relation = "<=";
-		break;
+		return a <= b;
 	default:
-		error("Encountered WHILE with undefined relation");
+		error("Encountered comparison with undefined relation");
 	}
-	fprintf(output, program->treatCAsVariable ? "while (x[%d] %s x[%d]) {" : "while (x[%d] %s %d) {", program->i, relation, program->c);
+	return 0;
 }
 
-void writeIfStart(Program *program, FILE *output) {
-	char *relation;
-	switch (program->operation) {
+uint8_t invertRelation(uint8_t operation) {
+	switch (operation) {
 	case equal:
-		relation = "==";
-		break;
+		return notEqual;
 	case notEqual:
-		relation = "!=";
-		break;
+		return equal;
 	case greater:
-		relation = ">";
-		break;
+		return lessEqual;
 	case greaterEqual:
-		relation = ">=";
-		break;
+		return less;
 	case less:
-		relation = "<";
-		break;
+		return greaterEqual;
 	case lessEqual:
-		relation = "<=";
-		break;
+		return greater;
 	default:
-		error("Encountered IF with undefined relation");
+		error("Encountered comparison with undefined relation");
 	}
-	fprintf(output, program->treatCAsVariable ? "if (x[%d] %s x[%d]) {" : "if (x[%d] %s %d) {", program->i, relation, program->c);
+	return 0;
 }
 
-void writeIfEnd(Program *program, FILE *output) {
-	fprintf(output, "else {");
-}
-
-void writeInstruction(Program *program, FILE *output) {
-	switch (program->instructionType) {
-	case assignment:
-		writeAssignment(program, output);
-		break;
-	case loopInstruction:
-		writeLoop(program, output);
-		break;
-	case whileInstruction:
-		writeWhile(program, output);
-		break;
-	case ifInstructionStart:
-		writeIfStart(program, output);
-		break;
-	case ifInstructionEnd:
-		writeIfEnd(program, output);
-		break;
-	default:
-		error("Encountered Instruction of undefined type");
+void foldOperand(Instruction *instruction, Constant *constants) {
+	if (instruction->treatCAsVariable && constants[instruction->c].known) {
+		instruction->c = constants[instruction->c].value;
+		instruction->treatCAsVariable = 0;
 	}
 }
 
-void writeLoopEnd(FILE *output) {
-	fprintf(output, "}");
+/* Returns whether the condition is known to hold (1), known to fail (0), or unknown (-1). */
+int knownCondition(Instruction *instruction, Constant *constants) {
+	Constant *operand = instruction->treatCAsVariable ? constants + instruction->c : NULL;
+	if (!constants[instruction->i].known || (operand != NULL && !operand->known)) return -1;
+	return foldComparison(instruction->operation, constants[instruction->i].value, operand != NULL ? operand->value : instruction->c);
 }
 
-void writeHeader(WriteOptions *writeOptions, FILE *output) {
-	char *name = writeOptions->outputFileName;
-	int length = strlen(name);
-	name[length - 1] = 'h';
-	fprintf(output, "#include \"%s\"\n", name);
-	output = fopen(name, "w");
-	if (output == NULL) error(strerror(errno));
-	name[length - 1] = 'c';
-	char *functionName = writeOptions->functionName;
-	
-	const char *headerText =
-		"#ifndef LOOP_%s_H\n"
-		"#define LOOP_%s_H\n"
-		"\n"
-		"%s %s(%s argc, %s *argv);\n"
-		"\n"
-		"#endif";
-	fprintf(output, headerText, functionName, functionName, type, functionName, type, type);
-	
-	fclose(output);
+void foldAssignment(Instruction *instruction, Constant *constants) {
+	uint8_t operation = instruction->operation;
+	Constant *source = constants + instruction->j;
+	uint64_t result;
+	foldOperand(instruction, constants);
+	if (operation == variable && source->known) {
+		instruction->operation = constant;
+		instruction->c = source->value;
+	} else if (operation != constant && operation != variable && source->known) {
+		if (!instruction->treatCAsVariable && foldOperation(operation, source->value, instruction->c, &result)) {
+			instruction->operation = constant;
+			instruction->c = result;
+		} else if (instruction->treatCAsVariable && (operation == plus || operation == times)) {
+			instruction->j = (uint32_t) instruction->c;
+			instruction->c = source->value;
+			instruction->treatCAsVariable = 0;
+		}
+	}
+	operation = instruction->operation;
+	if (operation != constant && operation != variable && !instruction->treatCAsVariable) {
+		if ((instruction->c == 0 && (operation == plus || operation == minus)) || (instruction->c == 1 && (operation == times || operation == dividedBy))) {
+			instruction->operation = variable;
+		} else if ((instruction->c == 0 && operation == times) || (instruction->c == 1 && operation == modulo)) {
+			instruction->operation = constant;
+			instruction->c = 0;
+		}
+	}
+	constants[instruction->i].known = instruction->operation == constant;
+	constants[instruction->i].value = instruction->c;
 }
 
-void writeProgram(Program *program, WriteOptions *writeOptions) {
-	if (program == NULL) error("Encountered empty program");
-	FILE *output = fopen(writeOptions->outputFileName, "w");
-	if (output == NULL) error(strerror(errno));
-	writeIncludes(output);
-	if (writeOptions->extensionHeader)
-		writeHeader(writeOptions, output);
-	writeStart(output, writeOptions->functionName);
-	int indentation = 1;
-	ProgramStack *programStack = newProgramStack();
-	
-	while (1) {
-		if (program->instructionType == ifInstructionEnd)
-			fprintf(output, " ");
-		else
-			writeIndentation(indentation, output);
-		writeInstruction(program, output);
-		if (program->innerProgram != NULL) {
-			push(&programStack, program);
-			program = program->innerProgram;
-			++indentation;
-		} else {
-			while (program->nextProgram == NULL) {
-				program = pop(&programStack);
-				if (program == NULL) break;
-				--indentation;
-				writeIndentation(indentation, output);
-				writeLoopEnd(output);
-			}
-			if (program == NULL) break;
-			program = program->nextProgram;
+/* Walks every instruction below first, marking assigned variables as unknown or read variables as live. */
+void markBlock(Program *program, uint32_t first, Constant *constants, uint8_t *live) {
+	IndexStack stack = {NULL, 0, 0};
+	push(&stack, first);
+	while (stack.size > 0) {
+		for (uint32_t k = pop(&stack); k != 0; k = program->instructions[k].nextInstruction) {
+			Instruction *instruction = program->instructions + k;
+			if (instruction->innerInstruction != 0) push(&stack, instruction->innerInstruction);
+			if (instruction->instructionType == ifInstructionEnd || instruction->instructionType == emptyInstruction) continue;
+			if (constants != NULL && instruction->instructionType == assignment)
+				constants[instruction->i].known = 0;
+			if (live == NULL) continue;
+			if (instruction->instructionType != assignment || instruction->operation != constant)
+				live[instruction->instructionType == assignment ? instruction->j : instruction->i] = 1;
+			if (instruction->treatCAsVariable)
+				live[instruction->c] = 1;
 		}
 	}
+	freeIndexStack(&stack);
+}
+
+/* A WHILE may never terminate, so its body must not vanish even if nothing in it is needed. */
+uint32_t newNoOperation(Program *program, uint32_t loop) {
+	uint32_t k = newInstruction(program);
+	Instruction *instruction = program->instructions + k;
+	Instruction *whileInstruction = program->instructions + loop;
+	instruction->instructionType = emptyInstruction;
+	instruction->line = whileInstruction->line;
+	instruction->column = whileInstruction->column;
+	return k;
+}
+
+/* Relinks an IF after its branches were rewritten and returns what is left of it; an empty THEN branch swaps in the ELSE branch. */
+uint32_t joinBranches(Program *program, uint32_t k, uint32_t then, uint32_t otherwise, uint32_t otherwiseInner) {
+	Instruction *instruction = program->instructions + k;
+	instruction->nextInstruction = 0;
+	if (then == 0 && otherwiseInner == 0) return 0;
+	if (then == 0) {
+		instruction->operation = invertRelation(instruction->operation);
+		instruction->innerInstruction = otherwiseInner;
+		return k;
+	}
+	instruction->innerInstruction = then;
+	if (otherwiseInner != 0) {
+		instruction->nextInstruction = otherwise;
+		program->instructions[otherwise].innerInstruction = otherwiseInner;
+		program->instructions[otherwise].nextInstruction = 0;
+	}
+	return k;
+}
+
+uint32_t lastInstruction(Program *program, uint32_t k) {
+	while (program->instructions[k].nextInstruction != 0)
+		k = program->instructions[k].nextInstruction;
+	return k;
+}
+
+uint32_t countInstructions(Program *program, uint32_t first) {
+	uint32_t count = 0;
+	for (uint32_t k = first; k != 0; k = program->instructions[k].nextInstruction)
+		count += 1 + countInstructions(program, program->instructions[k].innerInstruction);
+	return count;
+}
+
+/* Returns the first instruction of a copy of the block starting at first. */
+uint32_t copyBlock(Program *program, uint32_t first) {
+	uint32_t head = 0, tail = 0;
+	for (uint32_t k = first; k != 0; k = program->instructions[k].nextInstruction) {
+		uint32_t copy = newInstruction(program);
+		program->instructions[copy] = program->instructions[k];
+		program->instructions[copy].nextInstruction = 0;
+		if (program->instructions[k].innerInstruction != 0) {
+			uint32_t inner = copyBlock(program, program->instructions[k].innerInstruction);
+			program->instructions[copy].innerInstruction = inner;
+		}
+		if (head == 0) head = copy;
+		else program->instructions[tail].nextInstruction = copy;
+		tail = copy;
+	}
+	return head;
+}
+
+/*
+ * Forward pass over one block: substitutes and folds known values, drops LOOPs
+ * and WHILEs that never run, inlines LOOPs that run once and IFs whose outcome
+ * is known, and unrolls LOOPs with a known small count while unrollBudget lasts,
+ * so that every iteration gets folded with its own values. Other loop bodies
+ * start with everything they assign unknown, which is where any fixed point
+ * would end up. Returns the new first instruction, or 0.
+ */
+uint32_t propagateConstants(Program *program, uint32_t first, Constant *constants) {
+	uint32_t head = 0, tail = 0;
+	size_t stateSize = (heighestIndex + 1) * sizeof(Constant);
+	for (uint32_t k = first, next; k != 0; k = next) {
+		Instruction *instruction = program->instructions + k;
+		uint32_t kept = k;
+		next = instruction->nextInstruction;
+		instruction->nextInstruction = 0;
+		if (instruction->instructionType == assignment) {
+			foldAssignment(instruction, constants);
+		} else if (instruction->instructionType == loopInstruction) {
+			Constant count = constants[instruction->i];
+			uint32_t inner = instruction->innerInstruction;
+			uint32_t size = count.known && count.value <= MAX_UNROLL_COUNT ? countInstructions(program, inner) : 0;
+			if (count.known && count.value <= 1) {
+				kept = count.value == 1 ? propagateConstants(program, inner, constants) : 0;
+			} else if (size != 0 && count.value * size <= unrollBudget) {
+				unrollBudget -= count.value * size;
+				uint32_t copies = 0;
+				for (uint64_t n = 1; n < count.value; ++n) {
+					uint32_t copy = copyBlock(program, inner);
+					program->instructions[lastInstruction(program, copy)].nextInstruction = copies;
+					copies = copy;
+				}
+				program->instructions[lastInstruction(program, inner)].nextInstruction = copies;
+				kept = propagateConstants(program, inner, constants);
+			} else {
+				markBlock(program, inner, constants, NULL);
+				inner = propagateConstants(program, inner, constants);
+				program->instructions[k].innerInstruction = inner;
+				if (inner == 0) kept = 0;
+				else markBlock(program, inner, constants, NULL);
+			}
+		} else if (instruction->instructionType == whileInstruction) {
+			uint32_t inner = instruction->innerInstruction;
+			if (knownCondition(instruction, constants) == 0) {
+				kept = 0;
+			} else {
+				markBlock(program, inner, constants, NULL);
+				foldOperand(instruction, constants);
+				inner = propagateConstants(program, inner, constants);
+				if (inner == 0) inner = newNoOperation(program, k);
+				program->instructions[k].innerInstruction = inner;
+				markBlock(program, inner, constants, NULL);
+			}
+		} else if (instruction->instructionType == ifInstructionStart) {
+			uint32_t otherwise = 0;
+			if (next != 0 && program->instructions[next].instructionType == ifInstructionEnd) {
+				otherwise = next;
+				next = program->instructions[otherwise].nextInstruction;
+				program->instructions[otherwise].nextInstruction = 0;
+			}
+			uint32_t otherwiseInner = otherwise != 0 ? program->instructions[otherwise].innerInstruction : 0;
+			int condition = knownCondition(instruction, constants);
+			if (condition >= 0) {
+				uint32_t branch = condition ? instruction->innerInstruction : otherwiseInner;
+				kept = branch != 0 ? propagateConstants(program, branch, constants) : 0;
+			} else {
+				foldOperand(instruction, constants);
+				Constant *otherwiseConstants = (Constant *) malloc(stateSize);
+				if (otherwiseConstants == NULL) systemError();
+				memcpy(otherwiseConstants, constants, stateSize);
+				uint32_t then = propagateConstants(program, instruction->innerInstruction, constants);
+				otherwiseInner = otherwiseInner != 0 ? propagateConstants(program, otherwiseInner, otherwiseConstants) : 0;
+				for (int v = 0; v <= heighestIndex; ++v)
+					constants[v].known &= otherwiseConstants[v].known && constants[v].value == otherwiseConstants[v].value;
+				free(otherwiseConstants);
+				kept = joinBranches(program, k, then, otherwise, otherwiseInner);
+			}
+		}
+		if (kept == 0) continue;
+		if (head == 0) head = kept;
+		else program->instructions[tail].nextInstruction = kept;
+		tail = lastInstruction(program, kept);
+	}
+	return head;
+}
+
+/* Whether evaluating the assignment can stop the program, which has to happen even if its result is never read. */
+int mayFail(Instruction *instruction) {
+	if (instruction->operation == dividedBy || instruction->operation == modulo)
+		return instruction->treatCAsVariable || instruction->c == 0;
+	return keepOverflows && (instruction->operation == plus || instruction->operation == times);
+}
+
+/*
+ * Backward pass over one block: live holds the variables read after the block
+ * and ends up holding those read before it. Stores into dead variables go away
+ * unless they may fail, and so do LOOPs and IFs that end up empty. Loop bodies count everything read
+ * anywhere in the loop as live, an upper bound of the fixed point.
+ */
+uint32_t eliminateDeadStores(Program *program, uint32_t first, uint8_t *live) {
+	IndexStack chain = {NULL, 0, 0};
+	size_t liveSize = heighestIndex + 1;
+	uint32_t head = 0, otherwise = 0;
+	for (uint32_t k = first; k != 0; k = program->instructions[k].nextInstruction)
+		push(&chain, k);
+	while (chain.size > 0) {
+		uint32_t k = pop(&chain);
+		Instruction *instruction = program->instructions + k;
+		if (instruction->instructionType == ifInstructionEnd) {
+			otherwise = k;
+			continue;
+		}
+		if (instruction->instructionType == emptyInstruction) continue;
+		instruction->nextInstruction = 0;
+		if (instruction->instructionType == assignment) {
+			if (!live[instruction->i] && !mayFail(instruction)) continue;
+			live[instruction->i] = 0;
+			if (instruction->operation != constant) live[instruction->j] = 1;
+			if (instruction->treatCAsVariable) live[instruction->c] = 1;
+		} else {
+			uint8_t type = instruction->instructionType;
+			uint32_t i = instruction->i, operand = instruction->treatCAsVariable ? (uint32_t) instruction->c : 0;
+			uint8_t *innerLive = (uint8_t *) malloc(liveSize);
+			if (innerLive == NULL) systemError();
+			memcpy(innerLive, live, liveSize);
+			if (type == whileInstruction) {
+				innerLive[i] = 1;
+				innerLive[operand] |= instruction->treatCAsVariable;
+			}
+			if (type != ifInstructionStart)
+				markBlock(program, instruction->innerInstruction, NULL, innerLive);
+			uint32_t inner = eliminateDeadStores(program, instruction->innerInstruction, innerLive);
+			if (type == ifInstructionStart) {
+				uint32_t otherwiseInner = 0;
+				if (otherwise != 0)
+					otherwiseInner = eliminateDeadStores(program, program->instructions[otherwise].innerInstruction, live);
+				k = joinBranches(program, k, inner, otherwise, otherwiseInner);
+				otherwise = 0;
+			} else if (inner == 0 && type == loopInstruction) {
+				k = 0;
+			} else {
+				if (inner == 0) inner = newNoOperation(program, k);
+				program->instructions[k].innerInstruction = inner;
+			}
+			for (size_t v = 0; v < liveSize; ++v)
+				live[v] |= innerLive[v];
+			free(innerLive);
+			if (k == 0) continue;
+			live[i] = 1;
+			live[operand] |= program->instructions[k].treatCAsVariable;
+		}
+		program->instructions[lastInstruction(program, k)].nextInstruction = head;
+		head = k;
+	}
+	freeIndexStack(&chain);
+	return head;
+}
+
+/* Copies the instructions reachable from first into a fresh array in program order, which restores the index invariants. */
+void compactProgram(Program *program, uint32_t first) {
+	Instruction *instructions = program->instructions;
+	IndexStack stack = {NULL, 0, 0};
+	program->instructions = NULL;
+	program->size = program->capacity = 0;
+	newInstruction(program);
+	if (first == 0) {
+		uint32_t k = newInstruction(program);
+		program->instructions[k].instructionType = emptyInstruction;
+	} else {
+		push(&stack, first);
+		push(&stack, 0);
+		push(&stack, 0);
+	}
+	while (stack.size > 0) {
+		int inner = pop(&stack);
+		uint32_t parent = pop(&stack), old = pop(&stack);
+		uint32_t k = newInstruction(program);
+		program->instructions[k] = instructions[old];
+		program->instructions[k].innerInstruction = program->instructions[k].nextInstruction = 0;
+		if (parent != 0 && inner) program->instructions[parent].innerInstruction = k;
+		else if (parent != 0) program->instructions[parent].nextInstruction = k;
+		if (instructions[old].nextInstruction != 0) {
+			push(&stack, instructions[old].nextInstruction);
+			push(&stack, k);
+			push(&stack, 0);
+		}
+		if (instructions[old].innerInstruction != 0) {
+			push(&stack, instructions[old].innerInstruction);
+			push(&stack, k);
+			push(&stack, 1);
+		}
+	}
+	freeIndexStack(&stack);
+	free(instructions);
+}
+
+/*
+ * x0 starts at 0 and is the only variable read at the end, every other variable may be an input.
+ * With checkOverflows, dead additions and multiplications stay for the checks of --checked.
+ */
+void optimizeProgram(Program *program, int checkOverflows) {
+	Constant *constants = (Constant *) calloc(heighestIndex + 1, sizeof(Constant));
+	uint8_t *live = (uint8_t *) calloc(heighestIndex + 1, sizeof(uint8_t));
+	if (constants == NULL || live == NULL) systemError();
+	constants[0].known = 1;
+	live[0] = 1;
+	unrollBudget = MAX_UNROLL_INSTRUCTIONS;
+	keepOverflows = checkOverflows;
+	uint32_t first = propagateConstants(program, 1, constants);
+	if (first != 0)
+		first = eliminateDeadStores(program, first, live);
+	compactProgram(program, first);
+	free(constants);
+	free(live);
+}
+
+void registerEffect(LoopSummary *summary, int *effectSlots, uint32_t variable) {
+	if (effectSlots[variable]) return;
+	if (summary->effectCount == summary->capacity) {
+		summary->capacity = summary->capacity ? 2 * summary->capacity : 4;
+		summary->effects = realloc(summary->effects, summary->capacity * sizeof(Effect));
+		if (summary->effects == NULL) systemError();
+	}
+	Effect *effect = summary->effects + summary->effectCount;
+	memset(effect, 0, sizeof(Effect));
+	effect->variable = variable;
+	effectSlots[variable] = ++summary->effectCount;
+}
+
+int isWritten(int *effectSlots, uint32_t variable) {
+	return variable <= (uint32_t) heighestIndex && effectSlots[variable];
+}
+
+int addFactor(Term *term, uint32_t factor) {
+	if (term->factorCount == MAX_TERM_FACTORS) return 0;
+	int k = term->factorCount++;
+	for (; k > 0 && term->factors[k - 1] > factor; --k)
+		term->factors[k] = term->factors[k - 1];
+	term->factors[k] = factor;
+	return 1;
+}
+
+int sameFactors(Term *a, Term *b) {
+	if (a->factorCount != b->factorCount) return 0;
+	for (int k = 0; k < a->factorCount; ++k)
+		if (a->factors[k] != b->factors[k])
+			return 0;
+	return 1;
+}
+
+int addIncrement(LoopSummary *summary, int *effectSlots, uint32_t variable, Term *term) {
+	Effect *effect = summary->effects + effectSlots[variable] - 1;
+	if (effect->effectType == undefinedEffect)
+		effect->effectType = incrementEffect;
+	if (effect->effectType != incrementEffect) return 0;
+	if (term->coefficient == 0) return 1;
+	for (int k = 0; k < effect->termCount; ++k) {
+		if (sameFactors(effect->terms + k, term)) {
+			if (effect->terms[k].coefficient + term->coefficient < term->coefficient) return 0;
+			effect->terms[k].coefficient += term->coefficient;
+			return 1;
+		}
+	}
+	if (effect->termCount == MAX_EFFECT_TERMS) return 0;
+	effect->terms[effect->termCount++] = *term;
+	return 1;
+}
+
+/* Saturating decrements only compose into a single term without overflow. */
+int addDecrement(LoopSummary *summary, int *effectSlots, uint32_t variable, Term *term) {
+	Effect *effect = summary->effects + effectSlots[variable] - 1;
+	if (effect->effectType == undefinedEffect)
+		effect->effectType = decrementEffect;
+	if (effect->effectType != decrementEffect) return 0;
+	if (term->coefficient == 0) return 1;
+	if (effect->termCount == 0) {
+		effect->terms[effect->termCount++] = *term;
+		return 1;
+	}
+	if (!sameFactors(effect->terms, term)) return 0;
+	if (effect->terms[0].coefficient + term->coefficient < term->coefficient) return 0;
+	effect->terms[0].coefficient += term->coefficient;
+	return 1;
+}
+
+int operandTerm(Instruction *instruction, int *effectSlots, Term *term) {
+	term->factorCount = 0;
+	if (!instruction->treatCAsVariable) {
+		term->coefficient = instruction->c;
+		return 1;
+	}
+	if (isWritten(effectSlots, instruction->c)) return 0;
+	term->coefficient = 1;
+	return addFactor(term, instruction->c);
+}
+
+int summarizeAssignment(LoopSummary *summary, int *effectSlots, Program *program, uint32_t index) {
+	Instruction *instruction = program->instructions + index;
+	Term term;
+	if (instruction->operation == variable && instruction->j == instruction->i) return 1;
+	if (instruction->operation == plus && instruction->treatCAsVariable && instruction->c == instruction->i && instruction->j != instruction->i) {
+		if (isWritten(effectSlots, instruction->j)) return 0;
+		term.coefficient = 1;
+		term.factorCount = 0;
+		addFactor(&term, instruction->j);
+		return addIncrement(summary, effectSlots, instruction->i, &term);
+	}
+	if (instruction->operation != constant && instruction->j == instruction->i) {
+		if (!operandTerm(instruction, effectSlots, &term)) return 0;
+		if (instruction->operation == plus) return addIncrement(summary, effectSlots, instruction->i, &term);
+		if (instruction->operation == minus) return addDecrement(summary, effectSlots, instruction->i, &term);
+		return 0;
+	}
+	if (instruction->operation != constant) {
+		if (isWritten(effectSlots, instruction->j)) return 0;
+		if (instruction->operation != variable && instruction->treatCAsVariable && isWritten(effectSlots, instruction->c)) return 0;
+	}
+	Effect *effect = summary->effects + effectSlots[instruction->i] - 1;
+	effect->effectType = setEffect;
+	effect->termCount = 0;
+	effect->assignment = index;
+	return 1;
+}
+
+int summarizeInnerLoop(LoopSummary *summary, int *effectSlots, Program *program, uint32_t index) {
+	LoopSummary *innerSummary = program->summaries[index];
+	uint32_t counter = program->instructions[index].i;
+	if (innerSummary == NULL || isWritten(effectSlots, counter)) return 0;
+	for (int k = 0; k < innerSummary->effectCount; ++k) {
+		Effect *effect = innerSummary->effects + k;
+		if (effect->effectType == setEffect) return 0;
+		for (int l = 0; l < effect->termCount; ++l) {
+			Term term = effect->terms[l];
+			for (int m = 0; m < term.factorCount; ++m)
+				if (isWritten(effectSlots, term.factors[m]))
+					return 0;
+			if (!addFactor(&term, counter)) return 0;
+			if (effect->effectType == incrementEffect && !addIncrement(summary, effectSlots, effect->variable, &term)) return 0;
+			if (effect->effectType == decrementEffect && !addDecrement(summary, effectSlots, effect->variable, &term)) return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Returns the closed form of a LOOP whose body only consists of assignments and
+ * already summarized LOOPs, or NULL if its effect is not affine in the iteration count.
+ */
+LoopSummary *summarizeLoop(Program *program, uint32_t loop, int *effectSlots) {
+	LoopSummary *summary = (LoopSummary *) calloc(1, sizeof(LoopSummary));
+	int summarizable = 1;
+	uint32_t k;
+	for (k = program->instructions[loop].innerInstruction; k != 0; k = program->instructions[k].nextInstruction) {
+		Instruction *instruction = program->instructions + k;
+		if (instruction->instructionType == assignment) {
+			registerEffect(summary, effectSlots, instruction->i);
+		} else if (instruction->instructionType == loopInstruction && program->summaries[k] != NULL) {
+			for (int l = 0; l < program->summaries[k]->effectCount; ++l)
+				registerEffect(summary, effectSlots, program->summaries[k]->effects[l].variable);
+		} else {
+			summarizable = 0;
+			break;
+		}
+	}
+	for (k = program->instructions[loop].innerInstruction; summarizable && k != 0; k = program->instructions[k].nextInstruction) {
+		if (program->instructions[k].instructionType == assignment)
+			summarizable = summarizeAssignment(summary, effectSlots, program, k);
+		else
+			summarizable = summarizeInnerLoop(summary, effectSlots, program, k);
+	}
+	for (int l = 0; l < summary->effectCount; ++l)
+		effectSlots[summary->effects[l].variable] = 0;
+	if (summarizable) return summary;
+	freeLoopSummary(summary);
+	return NULL;
+}
+
+/* Inner instructions always have higher indices, so walking backwards visits inner LOOPs first. */
+void summarizeProgram(Program *program) {
+	int *effectSlots = (int *) calloc(heighestIndex + 1, sizeof(int));
+	program->summaries = (LoopSummary **) calloc(program->size, sizeof(LoopSummary *));
+	if (effectSlots == NULL || program->summaries == NULL) systemError();
+	for (uint32_t k = program->size - 1; k > 0; --k)
+		if (program->instructions[k].instructionType == loopInstruction)
+			program->summaries[k] = summarizeLoop(program, k, effectSlots);
+	free(effectSlots);
+}
+
+/* LOOP n DO IF v != 0 THEN v := v DIV 2; c := c + 1 END END, with v > 0 or v >= 1 as the condition and the assignments in either order */
+int recognizeBitLength(Program *program, uint32_t loop, Idiom *idiom) {
+	Instruction *guard = program->instructions + program->instructions[loop].innerInstruction;
+	if (guard->instructionType != ifInstructionStart || guard->nextInstruction != 0 || guard->treatCAsVariable) return 0;
+	if (guard->c != (guard->operation == greaterEqual) || (guard->operation != notEqual && guard->operation != greater && guard->operation != greaterEqual)) return 0;
+	Instruction *halving = program->instructions + guard->innerInstruction;
+	if (halving->nextInstruction == 0) return 0;
+	Instruction *counting = program->instructions + halving->nextInstruction;
+	if (counting->nextInstruction != 0) return 0;
+	if (halving->operation == plus) {
+		Instruction *swap = halving;
+		halving = counting;
+		counting = swap;
+	}
+	if (halving->instructionType != assignment || halving->operation != dividedBy || halving->treatCAsVariable || halving->c != 2) return 0;
+	if (counting->instructionType != assignment || counting->operation != plus || counting->treatCAsVariable || counting->c != 1) return 0;
+	if (halving->i != guard->i || halving->j != guard->i || counting->j != counting->i || counting->i == guard->i) return 0;
+	idiom->idiomType = bitLengthIdiom;
+	idiom->variable = guard->i;
+	idiom->counter = counting->i;
+	return 1;
+}
+
+/*
+ * LOOP n DO r := r * b END, or without multiplication
+ * LOOP n DO t := 0; LOOP r DO t := t + b END; r := t END
+ * where the inner LOOP is summarized and may also count b times adding r, or add a constant instead of b.
+ */
+int recognizePower(Program *program, uint32_t loop, Idiom *idiom) {
+	Instruction *first = program->instructions + program->instructions[loop].innerInstruction;
+	if (first->instructionType == assignment && first->nextInstruction == 0 && first->operation == times && first->i == first->j) {
+		if (first->treatCAsVariable && first->c == first->i) return 0;
+		idiom->idiomType = powerIdiom;
+		idiom->variable = first->i;
+		idiom->treatBaseAsVariable = first->treatCAsVariable;
+		idiom->base = first->c;
+		return 1;
+	}
+	if (first->instructionType != assignment || first->operation != constant || first->c != 0 || first->nextInstruction == 0) return 0;
+	uint32_t inner = first->nextInstruction;
+	Instruction *counted = program->instructions + inner;
+	LoopSummary *summary = program->summaries[inner];
+	if (counted->instructionType != loopInstruction || summary == NULL || counted->nextInstruction == 0) return 0;
+	Instruction *copy = program->instructions + counted->nextInstruction;
+	if (copy->instructionType != assignment || copy->operation != variable || copy->nextInstruction != 0) return 0;
+	uint32_t t = first->i, r = copy->i, n = counted->i;
+	if (copy->j != t || r == t || n == t) return 0;
+	if (summary->effectCount != 1 || summary->effects->effectType != incrementEffect || summary->effects->variable != t || summary->effects->termCount != 1) return 0;
+	Term *term = summary->effects->terms;
+	if (n == r && term->factorCount == 0) {
+		idiom->treatBaseAsVariable = 0;
+		idiom->base = term->coefficient;
+	} else if (term->factorCount == 1 && term->coefficient == 1 && (n == r) != (term->factors[0] == r)) {
+		idiom->treatBaseAsVariable = 1;
+		idiom->base = n == r ? term->factors[0] : n;
+		if (idiom->base == t) return 0;
+	} else
+		return 0;
+	idiom->idiomType = powerIdiom;
+	idiom->variable = r;
+	idiom->temporary = t;
+	idiom->copyTemporary = 1;
+	return 1;
+}
+
+/*
+ * LOOP n DO IF r >= d THEN r := r - d; q := q + 1 END END, with d <= r as the condition, the assignments
+ * in either order, and d a variable or a constant. Once r < d the LOOP does nothing, so the counted
+ * iterations are the quotient unless n runs out first.
+ */
+int recognizeDivision(Program *program, uint32_t loop, Idiom *idiom) {
+	Instruction *guard = program->instructions + program->instructions[loop].innerInstruction;
+	if (guard->instructionType != ifInstructionStart || guard->nextInstruction != 0) return 0;
+	uint32_t r;
+	uint64_t d;
+	uint8_t treatDAsVariable;
+	if (guard->operation == greaterEqual) {
+		r = guard->i;
+		d = guard->c;
+		treatDAsVariable = guard->treatCAsVariable;
+	} else if (guard->operation == lessEqual && guard->treatCAsVariable) {
+		r = (uint32_t) guard->c;
+		d = guard->i;
+		treatDAsVariable = 1;
+	} else
+		return 0;
+	Instruction *subtracting = program->instructions + guard->innerInstruction;
+	if (subtracting->nextInstruction == 0) return 0;
+	Instruction *counting = program->instructions + subtracting->nextInstruction;
+	if (counting->nextInstruction != 0) return 0;
+	if (subtracting->operation == plus) {
+		Instruction *swap = subtracting;
+		subtracting = counting;
+		counting = swap;
+	}
+	if (subtracting->instructionType != assignment || subtracting->operation != minus) return 0;
+	if (subtracting->treatCAsVariable != treatDAsVariable || subtracting->c != d) return 0;
+	if (counting->instructionType != assignment || counting->operation != plus || counting->treatCAsVariable || counting->c != 1) return 0;
+	if (subtracting->i != r || subtracting->j != r || counting->j != counting->i || counting->i == r) return 0;
+	if (treatDAsVariable && (d == r || d == counting->i)) return 0;
+	idiom->idiomType = divisionIdiom;
+	idiom->variable = r;
+	idiom->counter = counting->i;
+	idiom->treatBaseAsVariable = treatDAsVariable;
+	idiom->base = d;
+	return 1;
+}
+
+/* Counts the instructions from first on, including nested ones, that read the variable. */
+uint32_t countReads(Program *program, uint32_t first, uint32_t variable) {
+	IndexStack stack = {NULL, 0, 0};
+	uint32_t reads = 0;
+	push(&stack, first);
+	while (stack.size > 0) {
+		for (uint32_t k = pop(&stack); k != 0; k = program->instructions[k].nextInstruction) {
+			Instruction *instruction = program->instructions + k;
+			if (instruction->innerInstruction != 0) push(&stack, instruction->innerInstruction);
+			if (instruction->instructionType == ifInstructionEnd || instruction->instructionType == emptyInstruction) continue;
+			if (instruction->instructionType == assignment)
+				reads += instruction->operation != constant && instruction->j == variable;
+			else
+				reads += instruction->i == variable;
+			reads += instruction->treatCAsVariable && instruction->c == variable;
+		}
+	}
+	freeIndexStack(&stack);
+	return reads;
+}
+
+/* Runs after summarizeProgram on the LOOPs it left alone. Only generated C code uses the idioms. */
+void recognizeIdioms(Program *program) {
+	program->idioms = (Idiom **) calloc(program->size, sizeof(Idiom *));
+	if (program->idioms == NULL) systemError();
+	for (uint32_t k = 1; k < program->size; ++k) {
+		if (program->instructions[k].instructionType != loopInstruction || program->summaries[k] != NULL) continue;
+		if (program->instructions[k].innerInstruction == 0) continue;
+		Idiom *idiom = (Idiom *) calloc(1, sizeof(Idiom));
+		if (idiom == NULL) systemError();
+		if (recognizeBitLength(program, k, idiom) || recognizePower(program, k, idiom) || recognizeDivision(program, k, idiom)) {
+			program->idioms[k] = idiom;
+			/* Only x0 is returned, so the temporary matters only if the rest of the program reads it. */
+			if (idiom->copyTemporary && idiom->temporary != 0)
+				idiom->copyTemporary = countReads(program, 1, idiom->temporary) > countReads(program, program->instructions[k].innerInstruction, idiom->temporary);
+		} else
+			free(idiom);
+	}
+}
+
+/*
+ * Fixes the inputs given with --specialize. The remaining inputs move down to x1, x2, ... in their order,
+ * so the function takes only those, and the fixed ones move behind them and get assigned their values
+ * first, which the optimizer then folds like any other constant. Inputs the program never reads are ignored.
+ */
+void specializeProgram(Program *program, ParserOptions *parserOptions) {
+	uint32_t highest = heighestIndex;
+	uint32_t *renamed = (uint32_t *) calloc(highest + 1, sizeof(uint32_t));
+	uint64_t *values = (uint64_t *) calloc(highest + 1, sizeof(uint64_t));
+	uint8_t *fixed = (uint8_t *) calloc(highest + 1, sizeof(uint8_t));
+	if (renamed == NULL || values == NULL || fixed == NULL) systemError();
+	for (uint32_t k = 0; k < parserOptions->specializationCount; ++k) {
+		Specialization *specialization = parserOptions->specializations + k;
+		if (specialization->variable > highest) continue;
+		fixed[specialization->variable] = 1;
+		values[specialization->variable] = specialization->value;
+	}
+	uint32_t next = 1;
+	for (uint32_t v = 1; v <= highest; ++v)
+		if (!fixed[v]) renamed[v] = next++;
+	for (uint32_t v = 1; v <= highest; ++v)
+		if (fixed[v]) renamed[v] = next++;
+	for (uint32_t k = 1; k < program->size; ++k) {
+		Instruction *instruction = program->instructions + k;
+		instruction->i = renamed[instruction->i];
+		instruction->j = renamed[instruction->j];
+		if (instruction->treatCAsVariable) instruction->c = renamed[instruction->c];
+	}
+	uint32_t first = 0;
+	for (uint32_t v = highest; v >= 1; --v) {
+		if (!fixed[v]) continue;
+		uint32_t k = newInstruction(program);
+		Instruction *instruction = program->instructions + k;
+		instruction->instructionType = assignment;
+		instruction->operation = constant;
+		instruction->i = renamed[v];
+		instruction->c = values[v];
+		instruction->nextInstruction = first != 0 ? first : 1;
+		instruction->line = program->instructions[1].line;
+		instruction->column = program->instructions[1].column;
+		first = k;
+	}
+	if (first != 0)
+		compactProgram(program, first);
+	free(renamed);
+	free(values);
+	free(fixed);
+}
+
+/* Everything from the source to a program ready for the writers or the interpreter. */
+Program *prepareProgram(Lexer *lexer, ParserOptions *parserOptions) {
+	Program *program = parseLexer(lexer, parserOptions);
+	if (parserOptions->specializationCount)
+		specializeProgram(program, parserOptions);
+	if (!parserOptions->noOptimize)
+		optimizeProgram(program, parserOptions->keepOverflows);
+	summarizeProgram(program);
+	recognizeIdioms(program);
+	return program;
+}
+
+void reserveOutput(Output *output, size_t size) {
+	if (output->capacity - output->size >= size) return;
+	size_t capacity = output->capacity ? output->capacity : OUTPUT_BUF_SIZE;
+	while (capacity - output->size < size) {
+		if (capacity > SIZE_MAX / 2) error("Generated code too large");
+		capacity *= 2;
+	}
+	output->data = (char *) realloc(output->data, capacity);
+	if (output->data == NULL) systemError();
+	output->capacity = capacity;
+}
+
+void writeBytes(Output *output, const char *bytes, size_t size) {
+	reserveOutput(output, size);
+	memcpy(output->data + output->size, bytes, size);
+	output->size += size;
+}
+
+void writeText(Output *output, const char *text) {
+	writeBytes(output, text, strlen(text));
+}
+
+void writeChar(Output *output, char c) {
+	reserveOutput(output, 1);
+	output->data[output->size++] = c;
+}
+
+/* Produces the digits back to front, two at a time. */
+void writeNumber(Output *output, uint64_t value) {
+	static const char digitPairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	char digits[20];
+	int start = sizeof(digits);
+	while (value >= 100) {
+		unsigned pair = (unsigned) (value % 100) * 2;
+		value /= 100;
+		digits[--start] = digitPairs[pair + 1];
+		digits[--start] = digitPairs[pair];
+	}
+	if (value >= 10) {
+		digits[--start] = digitPairs[value * 2 + 1];
+		digits[--start] = digitPairs[value * 2];
+	} else
+		digits[--start] = '0' + value;
+	writeBytes(output, digits + start, sizeof(digits) - start);
+}
+
+void writeFormat(Output *output, const char *format, ...) {
+	va_list arguments;
+	reserveOutput(output, 256);
+	va_start(arguments, format);
+	int length = vsnprintf(output->data + output->size, output->capacity - output->size, format, arguments);
+	va_end(arguments);
+	if (length < 0) systemError();
+	if ((size_t) length >= output->capacity - output->size) {
+		reserveOutput(output, (size_t) length + 1);
+		va_start(arguments, format);
+		vsnprintf(output->data + output->size, (size_t) length + 1, format, arguments);
+		va_end(arguments);
+	}
+	output->size += length;
+}
+
+/* Pipes may take less than everything at once. */
+void flushOutput(Output *output, int fd) {
+	for (size_t written = 0; written < output->size;) {
+		ssize_t count = write(fd, output->data + written, output->size - written);
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0) systemError();
+		written += count;
+	}
+	output->size = 0;
+}
+
+/* A file name of "-" means stdout. */
+void saveOutput(Output *output, char *fileName) {
+	int toStdout = strcmp(fileName, "-") == 0;
+	int fd = toStdout ? STDOUT_FILENO : open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) systemError();
+	flushOutput(output, fd);
+	if (!toStdout && close(fd) != 0) systemError();
+}
+
+void freeOutput(Output *output) {
+	free(output->data);
+	output->data = NULL;
+	output->size = output->capacity = 0;
+}
+
+void writeBignumType(Output *output) {
+	const char *bignumType =
+		"#ifndef LOOP_BIG_DEFINED\n"
+		"#define LOOP_BIG_DEFINED\n"
+		"/* Values below 2^64 live in small (size == 0), larger ones in size >= 2 little-endian limbs. */\n"
+		"typedef struct big {\n"
+		"\tuint64_t small;\n"
+		"\tuint64_t *limbs;\n"
+		"\tsize_t size;\n"
+		"\tsize_t capacity;\n"
+		"} big;\n"
+		"#endif\n";
+	writeText(output, bignumType);
+}
+
+/*
+ * Natural numbers below 2^64 are kept inline and never touch the heap, so the
+ * common case only costs a branch per operation. Larger values are promoted to
+ * little-endian 64-bit limbs with Karatsuba multiplication and Knuth division.
+ */
+void writeBignumRuntime(Output *output) {
+	const char *bignumRuntime =
+		"\n"
+		"#ifndef __SIZEOF_INT128__\n"
+		"#error \"--bignum output needs a compiler that supports unsigned __int128\"\n"
+		"#endif\n"
+		"\n"
+		"#define BIG_KARATSUBA_THRESHOLD 32\n"
+		"#define BIG_INIT {0, NULL, 0, 0}\n"
+		"#define BIG_FUNCTION static __attribute__((unused))\n"
+		"\n"
+		"typedef unsigned __int128 big_wide;\n"
+		"\n"
+		"BIG_FUNCTION void big_fail(const char *message) {\n"
+		"\tfprintf(stderr, \"%s\\n\", message);\n"
+		"\texit(EXIT_FAILURE);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION uint64_t *big_alloc(size_t n) {\n"
+		"\tuint64_t *limbs = malloc((n ? n : 1) * sizeof(uint64_t));\n"
+		"\tif (limbs == NULL) big_fail(\"Out of memory\");\n"
+		"\treturn limbs;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_free(big *a) {\n"
+		"\tfree(a->limbs);\n"
+		"\ta->limbs = NULL;\n"
+		"\ta->size = a->capacity = 0;\n"
+		"\ta->small = 0;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION size_t big_trim(const uint64_t *a, size_t n) {\n"
+		"\twhile (n > 0 && a[n - 1] == 0)\n"
+		"\t\t--n;\n"
+		"\treturn n;\n"
+		"}\n"
+		"\n"
+		"/* Takes ownership of limbs, which hold n limbs of the new value. */\n"
+		"BIG_FUNCTION void big_take(big *r, uint64_t *limbs, size_t n, size_t capacity) {\n"
+		"\tn = big_trim(limbs, n);\n"
+		"\tif (n <= 1) {\n"
+		"\t\tr->small = n ? limbs[0] : 0;\n"
+		"\t\tr->size = 0;\n"
+		"\t\tfree(limbs);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tfree(r->limbs);\n"
+		"\tr->limbs = limbs;\n"
+		"\tr->size = n;\n"
+		"\tr->capacity = capacity;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION const uint64_t *big_view(const big *a, size_t *n) {\n"
+		"\tif (a->size) {\n"
+		"\t\t*n = a->size;\n"
+		"\t\treturn a->limbs;\n"
+		"\t}\n"
+		"\t*n = a->small != 0;\n"
+		"\treturn &a->small;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_set_u64(big *r, uint64_t value) {\n"
+		"\tr->small = value;\n"
+		"\tr->size = 0;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_copy(big *r, const big *a) {\n"
+		"\tif (r == a) return;\n"
+		"\tif (!a->size) {\n"
+		"\t\tbig_set_u64(r, a->small);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tif (r->capacity < a->size) {\n"
+		"\t\tfree(r->limbs);\n"
+		"\t\tr->limbs = big_alloc(a->size);\n"
+		"\t\tr->capacity = a->size;\n"
+		"\t}\n"
+		"\tmemcpy(r->limbs, a->limbs, a->size * sizeof(uint64_t));\n"
+		"\tr->size = a->size;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION int big_is_zero(const big *a) {\n"
+		"\treturn !a->size && !a->small;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION int big_cmp_limbs(const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {\n"
+		"\tif (na != nb) return na < nb ? -1 : 1;\n"
+		"\twhile (na-- > 0)\n"
+		"\t\tif (a[na] != b[na])\n"
+		"\t\t\treturn a[na] < b[na] ? -1 : 1;\n"
+		"\treturn 0;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION int big_cmp(const big *a, const big *b) {\n"
+		"\tif (!a->size && !b->size) return (a->small > b->small) - (a->small < b->small);\n"
+		"\tsize_t na, nb;\n"
+		"\tconst uint64_t *la = big_view(a, &na), *lb = big_view(b, &nb);\n"
+		"\treturn big_cmp_limbs(la, na, lb, nb);\n"
+		"}\n"
+		"\n"
+		"/* r[0..na) = a + b with na >= nb, returns the carry */\n"
+		"BIG_FUNCTION uint64_t big_add_limbs(uint64_t *r, const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {\n"
+		"\tuint64_t carry = 0;\n"
+		"\tfor (size_t k = 0; k < na; ++k) {\n"
+		"\t\tuint64_t s = a[k] + carry;\n"
+		"\t\tcarry = s < carry;\n"
+		"\t\tif (k < nb) {\n"
+		"\t\t\ts += b[k];\n"
+		"\t\t\tcarry += s < b[k];\n"
+		"\t\t}\n"
+		"\t\tr[k] = s;\n"
+		"\t}\n"
+		"\treturn carry;\n"
+		"}\n"
+		"\n"
+		"/* r[0..na) = a - b with na >= nb, returns the borrow */\n"
+		"BIG_FUNCTION uint64_t big_sub_limbs(uint64_t *r, const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {\n"
+		"\tuint64_t borrow = 0;\n"
+		"\tfor (size_t k = 0; k < na; ++k) {\n"
+		"\t\tuint64_t d = k < nb ? b[k] : 0;\n"
+		"\t\tuint64_t t = a[k] - d;\n"
+		"\t\tuint64_t next = a[k] < d;\n"
+		"\t\tnext |= t < borrow;\n"
+		"\t\tr[k] = t - borrow;\n"
+		"\t\tborrow = next;\n"
+		"\t}\n"
+		"\treturn borrow;\n"
+		"}\n"
+		"\n"
+		"/* r[0..na + nb) = a * b, schoolbook */\n"
+		"BIG_FUNCTION void big_mul_basecase(uint64_t *r, const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {\n"
+		"\tmemset(r, 0, (na + nb) * sizeof(uint64_t));\n"
+		"\tfor (size_t k = 0; k < nb; ++k) {\n"
+		"\t\tuint64_t carry = 0;\n"
+		"\t\tfor (size_t l = 0; l < na; ++l) {\n"
+		"\t\t\tbig_wide p = (big_wide) a[l] * b[k] + r[k + l] + carry;\n"
+		"\t\t\tr[k + l] = (uint64_t) p;\n"
+		"\t\t\tcarry = p >> 64;\n"
+		"\t\t}\n"
+		"\t\tr[k + na] = carry;\n"
+		"\t}\n"
+		"}\n"
+		"\n"
+		"/* r[0..na + nb) = a * b, Karatsuba above the threshold */\n"
+		"BIG_FUNCTION void big_mul_limbs(uint64_t *r, const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {\n"
+		"\tif (na < nb) {\n"
+		"\t\tconst uint64_t *t = a;\n"
+		"\t\ta = b;\n"
+		"\t\tb = t;\n"
+		"\t\tsize_t n = na;\n"
+		"\t\tna = nb;\n"
+		"\t\tnb = n;\n"
+		"\t}\n"
+		"\tif (nb < BIG_KARATSUBA_THRESHOLD) {\n"
+		"\t\tbig_mul_basecase(r, a, na, b, nb);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tif (na >= 2 * nb) {\n"
+		"\t\tuint64_t *t = big_alloc(2 * nb);\n"
+		"\t\tmemset(r, 0, (na + nb) * sizeof(uint64_t));\n"
+		"\t\tfor (size_t k = 0; k < na; k += nb) {\n"
+		"\t\t\tsize_t n = na - k < nb ? na - k : nb;\n"
+		"\t\t\tbig_mul_limbs(t, a + k, n, b, nb);\n"
+		"\t\t\tbig_add_limbs(r + k, r + k, na + nb - k, t, n + nb);\n"
+		"\t\t}\n"
+		"\t\tfree(t);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t m = na / 2, na1 = na - m, nb1 = nb - m;\n"
+		"\tsize_t nsa = na1 + 1, nsb = (nb1 > m ? nb1 : m) + 1;\n"
+		"\tuint64_t *sa = big_alloc(nsa), *sb = big_alloc(nsb), *z1 = big_alloc(nsa + nsb);\n"
+		"\tsa[na1] = big_add_limbs(sa, a + m, na1, a, m);\n"
+		"\tif (nb1 >= m) sb[nb1] = big_add_limbs(sb, b + m, nb1, b, m);\n"
+		"\telse sb[m] = big_add_limbs(sb, b, m, b + m, nb1);\n"
+		"\tbig_mul_limbs(z1, sa, nsa, sb, nsb);\n"
+		"\tbig_mul_limbs(r, a, m, b, m);\n"
+		"\tbig_mul_limbs(r + 2 * m, a + m, na1, b + m, nb1);\n"
+		"\tbig_sub_limbs(z1, z1, nsa + nsb, r, 2 * m);\n"
+		"\tbig_sub_limbs(z1, z1, nsa + nsb, r + 2 * m, na1 + nb1);\n"
+		"\tbig_add_limbs(r + m, r + m, na + nb - m, z1, big_trim(z1, nsa + nsb));\n"
+		"\tfree(sa);\n"
+		"\tfree(sb);\n"
+		"\tfree(z1);\n"
+		"}\n"
+		"\n"
+		"/* q[0..na) = a / d, returns a % d */\n"
+		"BIG_FUNCTION uint64_t big_divmod_1(uint64_t *q, const uint64_t *a, size_t na, uint64_t d) {\n"
+		"\tuint64_t remainder = 0;\n"
+		"\tfor (size_t k = na; k-- > 0;) {\n"
+		"\t\tbig_wide current = ((big_wide) remainder << 64) | a[k];\n"
+		"\t\tq[k] = (uint64_t) (current / d);\n"
+		"\t\tremainder = (uint64_t) (current % d);\n"
+		"\t}\n"
+		"\treturn remainder;\n"
+		"}\n"
+		"\n"
+		"/* Knuth's algorithm D: q[0..na - nb + 1) = a / b, r[0..nb) = a % b for nb >= 2 and na >= nb */\n"
+		"BIG_FUNCTION void big_divmod_limbs(uint64_t *q, uint64_t *r, const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {\n"
+		"\tint shift = __builtin_clzll(b[nb - 1]);\n"
+		"\tuint64_t *u = big_alloc(na + 1), *v = big_alloc(nb);\n"
+		"\tfor (size_t k = nb; k-- > 0;)\n"
+		"\t\tv[k] = (b[k] << shift) | (shift && k ? b[k - 1] >> (64 - shift) : 0);\n"
+		"\tu[na] = shift ? a[na - 1] >> (64 - shift) : 0;\n"
+		"\tfor (size_t k = na; k-- > 0;)\n"
+		"\t\tu[k] = (a[k] << shift) | (shift && k ? a[k - 1] >> (64 - shift) : 0);\n"
+		"\tfor (size_t j = na - nb + 1; j-- > 0;) {\n"
+		"\t\tbig_wide numerator = ((big_wide) u[j + nb] << 64) | u[j + nb - 1];\n"
+		"\t\tbig_wide qhat = numerator / v[nb - 1], rhat = numerator % v[nb - 1];\n"
+		"\t\twhile ((qhat >> 64) || qhat * v[nb - 2] > ((rhat << 64) | u[j + nb - 2])) {\n"
+		"\t\t\t--qhat;\n"
+		"\t\t\trhat += v[nb - 1];\n"
+		"\t\t\tif (rhat >> 64) break;\n"
+		"\t\t}\n"
+		"\t\tuint64_t carry = 0, borrow = 0;\n"
+		"\t\tfor (size_t k = 0; k < nb; ++k) {\n"
+		"\t\t\tbig_wide p = qhat * v[k] + carry;\n"
+		"\t\t\tcarry = p >> 64;\n"
+		"\t\t\tuint64_t low = (uint64_t) p, t = u[j + k] - low;\n"
+		"\t\t\tuint64_t next = u[j + k] < low;\n"
+		"\t\t\tnext |= t < borrow;\n"
+		"\t\t\tu[j + k] = t - borrow;\n"
+		"\t\t\tborrow = next;\n"
+		"\t\t}\n"
+		"\t\tuint64_t t = u[j + nb] - carry;\n"
+		"\t\tuint64_t negative = u[j + nb] < carry;\n"
+		"\t\tnegative |= t < borrow;\n"
+		"\t\tu[j + nb] = t - borrow;\n"
+		"\t\tif (negative) {\n"
+		"\t\t\t--qhat;\n"
+		"\t\t\tcarry = 0;\n"
+		"\t\t\tfor (size_t k = 0; k < nb; ++k) {\n"
+		"\t\t\t\tbig_wide s = (big_wide) u[j + k] + v[k] + carry;\n"
+		"\t\t\t\tu[j + k] = (uint64_t) s;\n"
+		"\t\t\t\tcarry = s >> 64;\n"
+		"\t\t\t}\n"
+		"\t\t\tu[j + nb] += carry;\n"
+		"\t\t}\n"
+		"\t\tq[j] = (uint64_t) qhat;\n"
+		"\t}\n"
+		"\tfor (size_t k = 0; k < nb; ++k)\n"
+		"\t\tr[k] = (u[k] >> shift) | (shift ? u[k + 1] << (64 - shift) : 0);\n"
+		"\tfree(u);\n"
+		"\tfree(v);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_add(big *r, const big *a, const big *b) {\n"
+		"\tif (!a->size && !b->size) {\n"
+		"\t\tuint64_t s = a->small + b->small;\n"
+		"\t\tif (s >= a->small) {\n"
+		"\t\t\tbig_set_u64(r, s);\n"
+		"\t\t\treturn;\n"
+		"\t\t}\n"
+		"\t\tuint64_t *limbs = big_alloc(2);\n"
+		"\t\tlimbs[0] = s;\n"
+		"\t\tlimbs[1] = 1;\n"
+		"\t\tbig_take(r, limbs, 2, 2);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t na, nb;\n"
+		"\tconst uint64_t *la = big_view(a, &na), *lb = big_view(b, &nb);\n"
+		"\tif (na < nb) {\n"
+		"\t\tconst uint64_t *t = la;\n"
+		"\t\tla = lb;\n"
+		"\t\tlb = t;\n"
+		"\t\tsize_t n = na;\n"
+		"\t\tna = nb;\n"
+		"\t\tnb = n;\n"
+		"\t}\n"
+		"\tuint64_t *limbs = big_alloc(na + 1);\n"
+		"\tlimbs[na] = big_add_limbs(limbs, la, na, lb, nb);\n"
+		"\tbig_take(r, limbs, na + 1, na + 1);\n"
+		"}\n"
+		"\n"
+		"/* Saturating: r = a > b ? a - b : 0 */\n"
+		"BIG_FUNCTION void big_sub(big *r, const big *a, const big *b) {\n"
+		"\tif (!a->size && !b->size) {\n"
+		"\t\tbig_set_u64(r, a->small > b->small ? a->small - b->small : 0);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tif (big_cmp(a, b) <= 0) {\n"
+		"\t\tbig_set_u64(r, 0);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t na, nb;\n"
+		"\tconst uint64_t *la = big_view(a, &na), *lb = big_view(b, &nb);\n"
+		"\tuint64_t *limbs = big_alloc(na);\n"
+		"\tbig_sub_limbs(limbs, la, na, lb, nb);\n"
+		"\tbig_take(r, limbs, na, na);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_mul(big *r, const big *a, const big *b) {\n"
+		"\tif (!a->size && !b->size) {\n"
+		"\t\tbig_wide p = (big_wide) a->small * b->small;\n"
+		"\t\tif (!(p >> 64)) {\n"
+		"\t\t\tbig_set_u64(r, (uint64_t) p);\n"
+		"\t\t\treturn;\n"
+		"\t\t}\n"
+		"\t\tuint64_t *limbs = big_alloc(2);\n"
+		"\t\tlimbs[0] = (uint64_t) p;\n"
+		"\t\tlimbs[1] = p >> 64;\n"
+		"\t\tbig_take(r, limbs, 2, 2);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t na, nb;\n"
+		"\tconst uint64_t *la = big_view(a, &na), *lb = big_view(b, &nb);\n"
+		"\tif (na == 0 || nb == 0) {\n"
+		"\t\tbig_set_u64(r, 0);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tuint64_t *limbs = big_alloc(na + nb);\n"
+		"\tbig_mul_limbs(limbs, la, na, lb, nb);\n"
+		"\tbig_take(r, limbs, na + nb, na + nb);\n"
+		"}\n"
+		"\n"
+		"/* Either q or m may be NULL. */\n"
+		"BIG_FUNCTION void big_divmod(big *q, big *m, const big *a, const big *b) {\n"
+		"\tif (big_is_zero(b)) big_fail(\"Division by zero\");\n"
+		"\tif (!a->size && !b->size) {\n"
+		"\t\tuint64_t quotient = a->small / b->small, remainder = a->small % b->small;\n"
+		"\t\tif (q) big_set_u64(q, quotient);\n"
+		"\t\tif (m) big_set_u64(m, remainder);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t na, nb;\n"
+		"\tconst uint64_t *la = big_view(a, &na), *lb = big_view(b, &nb);\n"
+		"\tif (big_cmp_limbs(la, na, lb, nb) < 0) {\n"
+		"\t\tif (m) big_copy(m, a);\n"
+		"\t\tif (q) big_set_u64(q, 0);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tuint64_t *quotient = big_alloc(na), *remainder = big_alloc(nb);\n"
+		"\tif (nb == 1) {\n"
+		"\t\tremainder[0] = big_divmod_1(quotient, la, na, lb[0]);\n"
+		"\t} else {\n"
+		"\t\tmemset(quotient, 0, na * sizeof(uint64_t));\n"
+		"\t\tbig_divmod_limbs(quotient, remainder, la, na, lb, nb);\n"
+		"\t}\n"
+		"\tif (q) big_take(q, quotient, na, na);\n"
+		"\telse free(quotient);\n"
+		"\tif (m) big_take(m, remainder, nb, nb);\n"
+		"\telse free(remainder);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_div(big *r, const big *a, const big *b) {\n"
+		"\tbig_divmod(r, NULL, a, b);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_mod(big *r, const big *a, const big *b) {\n"
+		"\tbig_divmod(NULL, r, a, b);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_add_u64(big *r, const big *a, uint64_t b) {\n"
+		"\tbig c = {b, NULL, 0, 0};\n"
+		"\tbig_add(r, a, &c);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_sub_u64(big *r, const big *a, uint64_t b) {\n"
+		"\tbig c = {b, NULL, 0, 0};\n"
+		"\tbig_sub(r, a, &c);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_mul_u64(big *r, const big *a, uint64_t b) {\n"
+		"\tbig c = {b, NULL, 0, 0};\n"
+		"\tbig_mul(r, a, &c);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_div_u64(big *r, const big *a, uint64_t b) {\n"
+		"\tbig c = {b, NULL, 0, 0};\n"
+		"\tbig_div(r, a, &c);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_mod_u64(big *r, const big *a, uint64_t b) {\n"
+		"\tbig c = {b, NULL, 0, 0};\n"
+		"\tbig_mod(r, a, &c);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION int big_cmp_u64(const big *a, uint64_t b) {\n"
+		"\tif (a->size) return 1;\n"
+		"\treturn (a->small > b) - (a->small < b);\n"
+		"}\n"
+		"\n"
+		"/* LOOP counts that do not fit 64 bits could never finish, so they are clamped. */\n"
+		"BIG_FUNCTION uint64_t big_loop_count(const big *a) {\n"
+		"\treturn a->size ? UINT64_MAX : a->small;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION uint64_t big_bit_length(const big *a) {\n"
+		"\tsize_t n;\n"
+		"\tconst uint64_t *limbs = big_view(a, &n);\n"
+		"\tif (n == 0) return 0;\n"
+		"\tuint64_t length = 64 * (n - 1);\n"
+		"\tfor (uint64_t top = limbs[n - 1]; top; top >>= 1)\n"
+		"\t\t++length;\n"
+		"\treturn length;\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_shift_right(big *r, const big *a, uint64_t count) {\n"
+		"\tsize_t n;\n"
+		"\tconst uint64_t *limbs = big_view(a, &n);\n"
+		"\tif (count / 64 >= n) {\n"
+		"\t\tbig_set_u64(r, 0);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t skip = count / 64, m = n - skip;\n"
+		"\tunsigned shift = count % 64;\n"
+		"\tuint64_t *result = big_alloc(m);\n"
+		"\tfor (size_t k = 0; k < m; ++k)\n"
+		"\t\tresult[k] = shift == 0 ? limbs[skip + k] : limbs[skip + k] >> shift | (skip + k + 1 < n ? limbs[skip + k + 1] << (64 - shift) : 0);\n"
+		"\tbig_take(r, result, m, m);\n"
+		"}\n"
+		"\n"
+		"/* r *= base^exponent by repeated squaring. */\n"
+		"BIG_FUNCTION void big_mul_power(big *r, const big *base, uint64_t exponent) {\n"
+		"\tif (big_is_zero(r) || exponent == 0) return;\n"
+		"\tbig square = BIG_INIT;\n"
+		"\tbig_copy(&square, base);\n"
+		"\twhile (1) {\n"
+		"\t\tif (exponent & 1) big_mul(r, r, &square);\n"
+		"\t\texponent >>= 1;\n"
+		"\t\tif (exponent == 0) break;\n"
+		"\t\tbig_mul(&square, &square, &square);\n"
+		"\t}\n"
+		"\tbig_free(&square);\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_from_string(big *r, const char *string) {\n"
+		"\tbig_set_u64(r, 0);\n"
+		"\twhile (*string) {\n"
+		"\t\tuint64_t chunk = 0, scale = 1;\n"
+		"\t\tfor (int k = 0; k < 19 && *string; ++k, ++string) {\n"
+		"\t\t\tif (*string < '0' || *string > '9') big_fail(\"Inputs must be natural numbers\");\n"
+		"\t\t\tchunk = 10 * chunk + (*string - '0');\n"
+		"\t\t\tscale *= 10;\n"
+		"\t\t}\n"
+		"\t\tbig_mul_u64(r, r, scale);\n"
+		"\t\tbig_add_u64(r, r, chunk);\n"
+		"\t}\n"
+		"}\n"
+		"\n"
+		"BIG_FUNCTION void big_print(const big *a) {\n"
+		"\tif (!a->size) {\n"
+		"\t\tprintf(\"%\" PRIu64 \"\\n\", a->small);\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tsize_t n = a->size, count = 0;\n"
+		"\tuint64_t *limbs = big_alloc(n), *chunks = big_alloc(n * 2 + 1);\n"
+		"\tmemcpy(limbs, a->limbs, n * sizeof(uint64_t));\n"
+		"\twhile (n > 0) {\n"
+		"\t\tchunks[count++] = big_divmod_1(limbs, limbs, n, 10000000000000000000u);\n"
+		"\t\tn = big_trim(limbs, n);\n"
+		"\t}\n"
+		"\tprintf(\"%\" PRIu64, chunks[--count]);\n"
+		"\twhile (count-- > 0)\n"
+		"\t\tprintf(\"%019\" PRIu64, chunks[count]);\n"
+		"\tprintf(\"\\n\");\n"
+		"\tfree(limbs);\n"
+		"\tfree(chunks);\n"
+		"}\n";
+	writeText(output, bignumRuntime);
+}
+
+void writeStringLiteral(const char *string, Output *output) {
+	writeChar(output, '"');
+	for (; *string; ++string) {
+		if (*string == '"' || *string == '\\')
+			writeFormat(output, "\\%c", *string);
+		else if ((unsigned char) *string < ' ')
+			writeFormat(output, "\\%03o", (unsigned char) *string);
+		else
+			writeChar(output, *string);
+	}
+	writeChar(output, '"');
+}
+
+/* Kept out of line and marked cold so the checks stay a single predicted branch. */
+void writeOverflowHandler(Output *output) {
+	const char *handlerStart =
+		"\n"
+		"#ifndef __SIZEOF_INT128__\n"
+		"#error \"--checked output needs a compiler that supports unsigned __int128\"\n"
+		"#endif\n"
+		"\n"
+		"__attribute__((noreturn, cold)) static void loop_overflow(unsigned line, unsigned column) {\n"
+		"\tfprintf(stderr, \"%%s:%%u:%%u: error: Arithmetic overflow\\n\", ";
+	const char *handlerEnd =
+		", line, column);\n"
+		"\texit(EXIT_FAILURE);\n"
+		"}\n";
+	writeFormat(output, handlerStart);
+	writeStringLiteral(sourceFileName, output);
+	writeText(output, handlerEnd);
+}
+
+/*
+ * Divisions by constants and by divisors that do not change inside a LOOP multiply by a
+ * reciprocal instead, following libdivide: n / d is the high word of n * magic shifted
+ * right, with one more halving add when the magic number needs 65 bits.
+ */
+void writeDivisionRuntime(Output *output) {
+	const char *handlerStart =
+		"\n"
+		"__attribute__((noreturn, cold, unused)) static void loop_division_by_zero(unsigned line, unsigned column) {\n"
+		"\tfprintf(stderr, \"%%s:%%u:%%u: error: Division by zero\\n\", ";
+	const char *handlerEnd =
+		", line, column);\n"
+		"\texit(EXIT_FAILURE);\n"
+		"}\n";
+	const char *reciprocals =
+		"\n"
+		"#if defined(__GNUC__)\n"
+		"#define LOOP_INLINE static inline __attribute__((always_inline))\n"
+		"#else\n"
+		"#define LOOP_INLINE static inline\n"
+		"#endif\n"
+		"\n"
+		"typedef struct loop_divider {\n"
+		"\tuint64_t magic;\n"
+		"\tunsigned shift;\n"
+		"\tint add;\n"
+		"} loop_divider;\n"
+		"\n"
+		"LOOP_INLINE uint64_t loop_mulhi(uint64_t a, uint64_t b) {\n"
+		"#ifdef __SIZEOF_INT128__\n"
+		"\treturn (uint64_t) ((unsigned __int128) a * b >> 64);\n"
+		"#else\n"
+		"\tuint64_t low = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);\n"
+		"\tuint64_t middle = (a >> 32) * (b & 0xFFFFFFFF) + (low >> 32);\n"
+		"\tuint64_t carry = (a & 0xFFFFFFFF) * (b >> 32) + (middle & 0xFFFFFFFF);\n"
+		"\treturn (a >> 32) * (b >> 32) + (middle >> 32) + (carry >> 32);\n"
+		"#endif\n"
+		"}\n"
+		"\n"
+		"LOOP_INLINE uint64_t loop_mulhi_add(uint64_t n, uint64_t magic) {\n"
+		"\tuint64_t q = loop_mulhi(n, magic);\n"
+		"\treturn ((n - q) >> 1) + q;\n"
+		"}\n"
+		"\n"
+		"/* Callers check for a zero divisor before they divide, so its divider does not matter. */\n"
+		"static inline loop_divider loop_divider_new(uint64_t d) {\n"
+		"\tloop_divider divider = {0, 0, 0};\n"
+		"\tif (d == 0) return divider;\n"
+		"\twhile (d >> divider.shift >> 1)\n"
+		"\t\t++divider.shift;\n"
+		"\tif ((d & (d - 1)) == 0) return divider;\n"
+		"#ifdef __SIZEOF_INT128__\n"
+		"\tunsigned __int128 power = (unsigned __int128) 1 << (64 + divider.shift);\n"
+		"\tuint64_t quotient = (uint64_t) (power / d), remainder = (uint64_t) (power %% d);\n"
+		"#else\n"
+		"\tuint64_t quotient = 0, remainder = (uint64_t) 1 << divider.shift;\n"
+		"\tfor (int k = 0; k < 64; ++k) {\n"
+		"\t\tuint64_t carry = remainder >> 63;\n"
+		"\t\tremainder <<= 1;\n"
+		"\t\tquotient <<= 1;\n"
+		"\t\tif (carry || remainder >= d) {\n"
+		"\t\t\tremainder -= d;\n"
+		"\t\t\tquotient |= 1;\n"
+		"\t\t}\n"
+		"\t}\n"
+		"#endif\n"
+		"\tdivider.add = d - remainder >= (uint64_t) 1 << divider.shift;\n"
+		"\tif (divider.add) {\n"
+		"\t\tuint64_t twice = remainder + remainder;\n"
+		"\t\tquotient += quotient;\n"
+		"\t\tif (twice >= d || twice < remainder) ++quotient;\n"
+		"\t}\n"
+		"\tdivider.magic = quotient + 1;\n"
+		"\treturn divider;\n"
+		"}\n"
+		"\n"
+		"LOOP_INLINE uint64_t loop_divide(uint64_t n, const loop_divider *divider) {\n"
+		"\tif (divider->magic == 0) return n >> divider->shift;\n"
+		"\treturn (divider->add ? loop_mulhi_add(n, divider->magic) : loop_mulhi(n, divider->magic)) >> divider->shift;\n"
+		"}\n";
+	writeFormat(output, handlerStart);
+	writeStringLiteral(sourceFileName, output);
+	writeText(output, handlerEnd);
+	writeFormat(output, reciprocals);
+}
+
+/* The idioms run once per LOOP, not once per iteration, so these stay plain loops. */
+void writeIdiomRuntime(Output *output) {
+	const char *bitLength =
+		"\n"
+		"static inline %s loop_bit_length(%s value) {\n"
+		"\t%s length = 0;\n"
+		"#if defined(__GNUC__)\n"
+		"\tfor (; value >> 63 >> 1; value = value >> 63 >> 1)\n"
+		"\t\tlength += 64;\n"
+		"\treturn value ? length + 64 - __builtin_clzll((unsigned long long) value) : length;\n"
+		"#else\n"
+		"\tfor (; value; value >>= 1)\n"
+		"\t\t++length;\n"
+		"\treturn length;\n"
+		"#endif\n"
+		"}\n";
+	const char *power =
+		"\n"
+		"static inline %s loop_power(%s base, %s exponent) {\n"
+		"\t%s power = 1;\n"
+		"\tfor (; exponent; exponent >>= 1, base *= base)\n"
+		"\t\tif (exponent & 1) power *= base;\n"
+		"\treturn power;\n"
+		"}\n";
+	const char *checkedPower =
+		"\n"
+		"/* Every step of the LOOP multiplies by base >= 2, so it overflows exactly if the final product does. */\n"
+		"static inline int loop_power_overflow(%s *value, %s base, %s exponent) {\n"
+		"\tif (*value == 0 || exponent == 0 || base == 1) return 0;\n"
+		"\t%s power = 1;\n"
+		"\twhile (1) {\n"
+		"\t\tif ((exponent & 1) && __builtin_mul_overflow(power, base, &power)) return 1;\n"
+		"\t\texponent >>= 1;\n"
+		"\t\tif (exponent == 0) break;\n"
+		"\t\tif (__builtin_mul_overflow(base, base, &base)) return 1;\n"
+		"\t}\n"
+		"\treturn __builtin_mul_overflow(*value, power, value);\n"
+		"}\n";
+	writeFormat(output, bitLength, type, type, type);
+	writeFormat(output, checkedArithmetic ? checkedPower : power, type, type, type, type);
+}
+
+void writeIncludes(Output *output) {
+	const char *includes =
+		"#include <stdlib.h>\n"
+		"#include <stdio.h>\n"
+		"#include <string.h>\n"
+		"#include <errno.h>\n"
+		"#include <inttypes.h>\n";
+	writeText(output, includes);
+	if (checkedArithmetic)
+		writeOverflowHandler(output);
+	if (divisionRuntime && !bignumVariables)
+		writeDivisionRuntime(output);
+	if (idiomRuntime && !bignumVariables)
+		writeIdiomRuntime(output);
+	if (bignumVariables) {
+		writeBignumType(output);
+		writeBignumRuntime(output);
+	}
+}
+
+void markUsedVariables(Program *program, char *used) {
+	for (uint32_t k = 1; k < program->size; ++k) {
+		Instruction *instruction = program->instructions + k;
+		if (instruction->instructionType == ifInstructionEnd || instruction->instructionType == emptyInstruction) continue;
+		used[instruction->i] = 1;
+		if (instruction->instructionType == assignment && instruction->operation != constant)
+			used[instruction->j] = 1;
+		if (instruction->treatCAsVariable)
+			used[instruction->c] = 1;
+	}
+}
+
+void writeScalarStart(Program *program, Output *output, char *functionName) {
+	char *used = (char *) calloc(heighestIndex + 1, sizeof(char));
+	if (used == NULL) systemError();
+	markUsedVariables(program, used);
+	if (bignumVariables) {
+		writeFormat(output, "\nbig %s(size_t argc, const big *argv) {\n", functionName);
+		writeText(output, "\tbig x0 = BIG_INIT;\n");
+		for (int k = 1; k <= heighestIndex; ++k)
+			if (used[k])
+				writeFormat(output, "\tbig x%d = BIG_INIT;\n\tif (argc >= %d) big_copy(&x%d, argv + %d);\n", k, k, k, k - 1);
+		free(used);
+		return;
+	}
+	writeFormat(output, "\n%s %s(%s argc, %s *argv) {\n", type, functionName, type, type);
+	writeFormat(output, "\t%s x0 = 0;\n", type);
+	for (int k = 1; k <= heighestIndex; ++k)
+		if (used[k])
+			writeFormat(output, "\t%s x%d = argc >= %d ? argv[%d] : 0;\n", type, k, k, k - 1);
+	free(used);
+}
+
+void writeStart(Program *program, Output *output, char *functionName) {
+	if (scalarVariables) {
+		writeScalarStart(program, output, functionName);
+		return;
+	}
+	const char *start =
+		"\n"
+		"%s %s(%s argc, %s *argv) {\n"
+		"\t%s *x = calloc(%d, sizeof(%s));\n"
+		"\t%s n = argc < %d ? argc : %d;\n"
+		"\tmemcpy(x + 1, argv, n * sizeof(%s));\n";
+	const char *bignumStart =
+		"\n"
+		"big %s(size_t argc, const big *argv) {\n"
+		"\tbig *x = calloc(%d, sizeof(big));\n"
+		"\tsize_t n = argc < %d ? argc : %d;\n"
+		"\tfor (size_t k = 0; k < n; ++k)\n"
+		"\t\tbig_copy(x + k + 1, argv + k);\n";
+	if (bignumVariables)
+		writeFormat(output, bignumStart, functionName, heighestIndex + 1, heighestIndex, heighestIndex);
+	else
+		writeFormat(output, start, type, functionName, type, type, type, heighestIndex + 1, type, type, heighestIndex, heighestIndex, type);
+}
+
+/* Inner and next instructions are always created after their predecessor, so one forward pass finds every depth. */
+int nestingDepth(Program *program) {
+	int *depths = (int *) calloc(program->size, sizeof(int));
+	if (depths == NULL) systemError();
+	int deepest = 0;
+	for (uint32_t k = 1; k < program->size; ++k) {
+		Instruction *instruction = program->instructions + k;
+		if (depths[k] > deepest) deepest = depths[k];
+		if (instruction->innerInstruction != 0) depths[instruction->innerInstruction] = depths[k] + 1;
+		if (instruction->nextInstruction != 0) depths[instruction->nextInstruction] = depths[k];
+	}
+	free(depths);
+	return deepest;
+}
+
+void writeLanesType(Output *output) {
+	const char *lanesType =
+		"#ifndef LOOP_LANES\n"
+		"#define LOOP_LANES %d\n"
+		"typedef uint64_t loop_lanes __attribute__((vector_size(LOOP_LANES * sizeof(uint64_t))));\n"
+		"#endif\n";
+	writeFormat(output, lanesType, LANE_COUNT);
+}
+
+/*
+ * The lane variant runs every instruction for all lanes at once and keeps one mask
+ * per nesting depth in m, so that assignments only change the lanes that would
+ * have executed them. Compilers that support it get AVX-512, AVX2, and baseline
+ * clones of the function and pick one at load time.
+ */
+void writeLanesStart(Program *program, Output *output, char *functionName) {
+	const char *prelude =
+		"\n"
+		"#if defined(__GNUC__)\n";
+	const char *support =
+		"\n"
+		"#if defined(__x86_64__) && defined(__has_attribute)\n"
+		"#if __has_attribute(target_clones)\n"
+		"#define LOOP_TARGETS __attribute__((target_clones(\"avx512f\", \"avx2\", \"default\")))\n"
+		"#endif\n"
+		"#endif\n"
+		"#ifndef LOOP_TARGETS\n"
+		"#define LOOP_TARGETS\n"
+		"#endif\n"
+		"\n"
+		"static inline int loop_any(const loop_lanes *mask) {\n"
+		"\tuint64_t any = 0;\n"
+		"\tfor (int k = 0; k < LOOP_LANES; ++k)\n"
+		"\t\tany |= (*mask)[k];\n"
+		"\treturn any != 0;\n"
+		"}\n"
+		"\n"
+		"LOOP_TARGETS void %s_lanes(size_t argc, const loop_lanes *argv, loop_lanes *result) {\n"
+		"\tloop_lanes m[%d] = {~(loop_lanes) {0}};\n";
+	const char *heapStart =
+		"\tloop_lanes *x = aligned_alloc(sizeof(loop_lanes), %d * sizeof(loop_lanes));\n"
+		"\tmemset(x, 0, %d * sizeof(loop_lanes));\n"
+		"\tsize_t n = argc < %d ? argc : %d;\n"
+		"\tmemcpy(x + 1, argv, n * sizeof(loop_lanes));\n";
+	writeText(output, prelude);
+	writeLanesType(output);
+	writeFormat(output, support, functionName, nestingDepth(program) + 2);
+	if (!scalarVariables) {
+		writeFormat(output, heapStart, heighestIndex + 1, heighestIndex + 1, heighestIndex, heighestIndex);
+		return;
+	}
+	char *used = (char *) calloc(heighestIndex + 1, sizeof(char));
+	if (used == NULL) systemError();
+	markUsedVariables(program, used);
+	writeText(output, "\tloop_lanes x0 = {0};\n");
+	for (int k = 1; k <= heighestIndex; ++k)
+		if (used[k])
+			writeFormat(output, "\tloop_lanes x%d = argc >= %d ? argv[%d] : (loop_lanes) {0};\n", k, k, k - 1);
+	free(used);
+}
+
+void writeLanesEnd(Output *output) {
+	const char *heapEnd =
+		"\t\n"
+		"\t\n"
+		"\t*result = x[0];\n"
+		"\tfree(x);\n"
+		"}\n"
+		"#endif\n";
+	const char *scalarEnd =
+		"\t\n"
+		"\t\n"
+		"\t*result = x0;\n"
+		"}\n"
+		"#endif\n";
+	writeText(output, scalarVariables ? scalarEnd : heapEnd);
+}
+
+/* The caller owns the returned x0, every other variable is released here. */
+void writeBignumEnd(Program *program, Output *output) {
+	if (scalarVariables) {
+		char *used = (char *) calloc(heighestIndex + 1, sizeof(char));
+		if (used == NULL) systemError();
+		markUsedVariables(program, used);
+		writeText(output, "\t\n\t\n");
+		for (int k = 1; k <= heighestIndex; ++k)
+			if (used[k])
+				writeFormat(output, "\tbig_free(&x%d);\n", k);
+		writeText(output, "\treturn x0;\n}\n");
+		free(used);
+	} else {
+		const char *heapEnd =
+			"\t\n"
+			"\t\n"
+			"\tbig ret = x[0];\n"
+			"\tfor (size_t k = 1; k < %d; ++k)\n"
+			"\t\tbig_free(x + k);\n"
+			"\tfree(x);\n"
+			"\treturn ret;\n"
+			"}\n";
+		writeFormat(output, heapEnd, heighestIndex + 1);
+	}
+}
+
+/* The generated main only handles values through loop_value, loop_parse, loop_print, and loop_release. */
+void writeValueHelpers(Output *output) {
+	const char *wordHelpers =
+		"\n"
+		"typedef %s loop_value;\n"
+		"\n"
+		"static __attribute__((unused)) int loop_parse(loop_value *value, const char *string) {\n"
+		"\tchar *end;\n"
+		"\terrno = 0;\n"
+		"\t*value = strtoull(string, &end, 10);\n"
+		"\treturn string[0] >= '0' && string[0] <= '9' && *end == '\\0' && errno == 0;\n"
+		"}\n"
+		"\n"
+		"static void loop_release(loop_value *value) {\n"
+		"\t(void) value;\n"
+		"}\n"
+		"\n"
+		"static __attribute__((unused)) void loop_print(const loop_value *value) {\n";
+	const char *print =
+		"\tprintf(\"%%\" %s \"\\n\", *value);\n"
+		"}\n";
+	const char *widePrint =
+		"\tloop_value rest = *value;\n"
+		"\tchar digits[40];\n"
+		"\tint n = 0;\n"
+		"\tdo digits[n++] = '0' + rest %% 10; while (rest /= 10);\n"
+		"\twhile (n > 0) putchar(digits[--n]);\n"
+		"\tputchar('\\n');\n"
+		"}\n";
+	const char *bignumHelpers =
+		"\n"
+		"typedef big loop_value;\n"
+		"\n"
+		"static __attribute__((unused)) int loop_parse(loop_value *value, const char *string) {\n"
+		"\tif (!*string) return 0;\n"
+		"\tfor (const char *c = string; *c; ++c)\n"
+		"\t\tif (*c < '0' || *c > '9') return 0;\n"
+		"\tbig_from_string(value, string);\n"
+		"\treturn 1;\n"
+		"}\n"
+		"\n"
+		"static void loop_release(loop_value *value) {\n"
+		"\tbig_free(value);\n"
+		"}\n"
+		"\n"
+		"static __attribute__((unused)) void loop_print(const loop_value *value) {\n"
+		"\tbig_print(value);\n"
+		"}\n";
+	if (bignumVariables) {
+		writeText(output, bignumHelpers);
+		return;
+	}
+	writeFormat(output, wordHelpers, type);
+	writeFormat(output, checkedArithmetic ? widePrint : print, typePrintMacro);
+}
+
+void writeMain(Output *output, char *functionName) {
+	const char *end =
+		"\n"
+		"int main(int argc, char **argv) {\n"
+		"\tloop_value *arr = calloc(argc, sizeof(loop_value));\n"
+		"\tfor (int i = 0; i < argc - 1; ++i) {\n"
+		"\t\tif (!loop_parse(arr + i, argv[i + 1])) {\n"
+		"\t\t\tfprintf(stderr, \"Inputs must be natural numbers\\n\");\n"
+		"\t\t\treturn 1;\n"
+		"\t\t}\n"
+		"\t}\n"
+		"\tloop_value res = %s(argc - 1, arr);\n"
+		"\tfor (int i = 0; i < argc - 1; ++i)\n"
+		"\t\tloop_release(arr + i);\n"
+		"\tfree(arr);\n"
+		"\tloop_print(&res);\n"
+		"\tloop_release(&res);\n"
+		"\treturn 0;\n"
+		"}";
+	writeFormat(output, end, functionName);
+}
+
+/*
+ * Reads one input tuple per line and evaluates them on several threads. Run times
+ * vary wildly between inputs, so every worker starts with an even share of the
+ * tuples and steals the back half of another worker's share once its own runs out.
+ * A share packs its next and end index into one word, which makes taking from the
+ * front and stealing from the back single compare-and-swaps.
+ */
+void writeBatchMain(Output *output, char *functionName) {
+	const char *batch =
+		"\n"
+		"#include <pthread.h>\n"
+		"#include <stdatomic.h>\n"
+		"#include <unistd.h>\n"
+		"\n"
+		"typedef struct loop_batch {\n"
+		"\tloop_value *values;\n"
+		"\tsize_t *starts;\n"
+		"\tloop_value *results;\n"
+		"\tuint32_t count;\n"
+		"\tlong worker_count;\n"
+		"\t_Atomic uint64_t *shares;\n"
+		"} loop_batch;\n"
+		"\n"
+		"typedef struct loop_worker {\n"
+		"\tloop_batch *batch;\n"
+		"\tlong id;\n"
+		"\tpthread_t thread;\n"
+		"} loop_worker;\n"
+		"\n"
+		"static void loop_fail(const char *message) {\n"
+		"\tfprintf(stderr, \"%%s\\n\", message);\n"
+		"\texit(EXIT_FAILURE);\n"
+		"}\n"
+		"\n"
+		"static void *loop_grow(void *pointer, size_t size) {\n"
+		"\tpointer = realloc(pointer, size);\n"
+		"\tif (pointer == NULL) loop_fail(\"Out of memory\");\n"
+		"\treturn pointer;\n"
+		"}\n"
+		"\n"
+		"static void loop_read(FILE *input, loop_batch *batch) {\n"
+		"\tchar *line = NULL;\n"
+		"\tsize_t line_capacity = 0, value_count = 0, value_capacity = 0, start_capacity = 64;\n"
+		"\tbatch->values = NULL;\n"
+		"\tbatch->starts = loop_grow(NULL, start_capacity * sizeof(size_t));\n"
+		"\tbatch->starts[0] = 0;\n"
+		"\tbatch->count = 0;\n"
+		"\twhile (getline(&line, &line_capacity, input) != -1) {\n"
+		"\t\tif (batch->count == UINT32_MAX - 1) loop_fail(\"Too many input lines\");\n"
+		"\t\tfor (char *token = strtok(line, \" \\t\\r\\n\"); token != NULL; token = strtok(NULL, \" \\t\\r\\n\")) {\n"
+		"\t\t\tif (value_count == value_capacity) {\n"
+		"\t\t\t\tvalue_capacity = value_capacity ? 2 * value_capacity : 256;\n"
+		"\t\t\t\tbatch->values = loop_grow(batch->values, value_capacity * sizeof(loop_value));\n"
+		"\t\t\t\tmemset(batch->values + value_count, 0, (value_capacity - value_count) * sizeof(loop_value));\n"
+		"\t\t\t}\n"
+		"\t\t\tif (!loop_parse(batch->values + value_count++, token)) {\n"
+		"\t\t\t\tfprintf(stderr, \"Line %%\" PRIu32 \": inputs must be natural numbers\\n\", batch->count + 1);\n"
+		"\t\t\t\texit(EXIT_FAILURE);\n"
+		"\t\t\t}\n"
+		"\t\t}\n"
+		"\t\tif (batch->count + 1 == start_capacity) {\n"
+		"\t\t\tstart_capacity *= 2;\n"
+		"\t\t\tbatch->starts = loop_grow(batch->starts, start_capacity * sizeof(size_t));\n"
+		"\t\t}\n"
+		"\t\tbatch->starts[++batch->count] = value_count;\n"
+		"\t}\n"
+		"\tfree(line);\n"
+		"}\n"
+		"\n"
+		"static int loop_take(_Atomic uint64_t *share, uint32_t *index) {\n"
+		"\tuint64_t current = atomic_load(share);\n"
+		"\tdo {\n"
+		"\t\tif ((uint32_t) current >= (uint32_t) (current >> 32)) return 0;\n"
+		"\t\t*index = (uint32_t) current;\n"
+		"\t} while (!atomic_compare_exchange_weak(share, &current, current + 1));\n"
+		"\treturn 1;\n"
+		"}\n"
+		"\n"
+		"static int loop_steal(loop_batch *batch, long id) {\n"
+		"\tfor (long k = 1; k < batch->worker_count; ++k) {\n"
+		"\t\t_Atomic uint64_t *victim = batch->shares + (id + k) %% batch->worker_count;\n"
+		"\t\tuint64_t current = atomic_load(victim);\n"
+		"\t\twhile ((uint32_t) current < (uint32_t) (current >> 32)) {\n"
+		"\t\t\tuint32_t next = (uint32_t) current, end = (uint32_t) (current >> 32);\n"
+		"\t\t\tuint32_t middle = end - (end - next + 1) / 2;\n"
+		"\t\t\tif (atomic_compare_exchange_weak(victim, &current, (uint64_t) middle << 32 | next)) {\n"
+		"\t\t\t\tatomic_store(batch->shares + id, (uint64_t) end << 32 | middle);\n"
+		"\t\t\t\treturn 1;\n"
+		"\t\t\t}\n"
+		"\t\t}\n"
+		"\t}\n"
+		"\treturn 0;\n"
+		"}\n";
+	const char *evaluate =
+		"\n"
+		"#define LOOP_GROUP 1\n"
+		"\n"
+		"static void loop_evaluate(loop_batch *batch, uint32_t index) {\n"
+		"\tbatch->results[index] = %s(batch->starts[index + 1] - batch->starts[index], batch->values + batch->starts[index]);\n"
+		"}\n";
+	const char *lanesEvaluate =
+		"\n"
+		"#if defined(LOOP_LANES)\n"
+		"#define LOOP_GROUP LOOP_LANES\n"
+		"\n"
+		"static void loop_evaluate(loop_batch *batch, uint32_t group) {\n"
+		"\tuint32_t first = group * LOOP_LANES, count = batch->count - first < LOOP_LANES ? batch->count - first : LOOP_LANES;\n"
+		"\tsize_t argc = 0;\n"
+		"\tfor (uint32_t l = 0; l < count; ++l)\n"
+		"\t\tif (batch->starts[first + l + 1] - batch->starts[first + l] > argc)\n"
+		"\t\t\targc = batch->starts[first + l + 1] - batch->starts[first + l];\n"
+		"\tloop_lanes *argv = aligned_alloc(sizeof(loop_lanes), (argc + 1) * sizeof(loop_lanes)), result;\n"
+		"\tif (argv == NULL) loop_fail(\"Out of memory\");\n"
+		"\tmemset(argv, 0, (argc + 1) * sizeof(loop_lanes));\n"
+		"\tfor (uint32_t l = 0; l < count; ++l)\n"
+		"\t\tfor (size_t k = batch->starts[first + l]; k < batch->starts[first + l + 1]; ++k)\n"
+		"\t\t\targv[k - batch->starts[first + l]][l] = batch->values[k];\n"
+		"\t%s_lanes(argc, argv, &result);\n"
+		"\tfor (uint32_t l = 0; l < count; ++l)\n"
+		"\t\tbatch->results[first + l] = result[l];\n"
+		"\tfree(argv);\n"
+		"}\n"
+		"#else";
+	const char *work =
+		"\n"
+		"static void *loop_work(void *argument) {\n"
+		"\tloop_worker *worker = argument;\n"
+		"\tloop_batch *batch = worker->batch;\n"
+		"\tuint32_t index;\n"
+		"\tdo {\n"
+		"\t\twhile (loop_take(batch->shares + worker->id, &index))\n"
+		"\t\t\tloop_evaluate(batch, index);\n"
+		"\t} while (loop_steal(batch, worker->id));\n"
+		"\treturn NULL;\n"
+		"}\n"
+		"\n"
+		"int main(int argc, char **argv) {\n"
+		"\tlong worker_count = sysconf(_SC_NPROCESSORS_ONLN);\n"
+		"\tint argument = 1;\n"
+		"\tif (argc > 2 && strcmp(argv[1], \"-t\") == 0) {\n"
+		"\t\tworker_count = atol(argv[2]);\n"
+		"\t\targument = 3;\n"
+		"\t}\n"
+		"\tFILE *input = argument < argc ? fopen(argv[argument], \"r\") : stdin;\n"
+		"\tif (input == NULL) {\n"
+		"\t\tperror(argv[argument]);\n"
+		"\t\treturn 1;\n"
+		"\t}\n"
+		"\tloop_batch batch;\n"
+		"\tloop_read(input, &batch);\n"
+		"\tif (input != stdin) fclose(input);\n"
+		"\tuint32_t groups = batch.count / LOOP_GROUP + (batch.count %% LOOP_GROUP != 0);\n"
+		"\tif (worker_count > (long) groups) worker_count = groups;\n"
+		"\tif (worker_count < 1) worker_count = 1;\n"
+		"\tbatch.worker_count = worker_count;\n"
+		"\tbatch.results = loop_grow(NULL, (batch.count + 1) * sizeof(loop_value));\n"
+		"\tbatch.shares = loop_grow(NULL, worker_count * sizeof(*batch.shares));\n"
+		"\tloop_worker *workers = loop_grow(NULL, worker_count * sizeof(loop_worker));\n"
+		"\tfor (long k = 0; k < worker_count; ++k) {\n"
+		"\t\tuint64_t begin = (uint64_t) groups * k / worker_count, end = (uint64_t) groups * (k + 1) / worker_count;\n"
+		"\t\tatomic_init(batch.shares + k, end << 32 | begin);\n"
+		"\t\tworkers[k].batch = &batch;\n"
+		"\t\tworkers[k].id = k;\n"
+		"\t}\n"
+		"\tfor (long k = 1; k < worker_count; ++k)\n"
+		"\t\tif (pthread_create(&workers[k].thread, NULL, loop_work, workers + k) != 0) loop_fail(\"Could not create thread\");\n"
+		"\tloop_work(workers);\n"
+		"\tfor (long k = 1; k < worker_count; ++k)\n"
+		"\t\tpthread_join(workers[k].thread, NULL);\n"
+		"\tfor (uint32_t k = 0; k < batch.count; ++k) {\n"
+		"\t\tloop_print(batch.results + k);\n"
+		"\t\tloop_release(batch.results + k);\n"
+		"\t}\n"
+		"\tfor (size_t k = 0; k < batch.starts[batch.count]; ++k)\n"
+		"\t\tloop_release(batch.values + k);\n"
+		"\tfree(batch.values);\n"
+		"\tfree(batch.starts);\n"
+		"\tfree(batch.results);\n"
+		"\tfree((void *) batch.shares);\n"
+		"\tfree(workers);\n"
+		"\treturn 0;\n"
+		"}";
+	writeFormat(output, batch);
+	if (laneBatch) {
+		writeFormat(output, lanesEvaluate, functionName);
+		writeFormat(output, evaluate, functionName);
+		writeText(output, "#endif\n");
+	} else
+		writeFormat(output, evaluate, functionName);
+	writeFormat(output, work);
+}
+
+/*
+ * Calls the function for every point of the input grid until the time budget is
+ * spent. The first pass is untimed: it warms up caches and branch predictors and
+ * sums up the results, so that every optimization level has to agree on the checksum.
+ */
+void writeBenchMain(Output *output, char *functionName) {
+	const char *wordHelpers =
+		"\n"
+		"static void loop_set(loop_value *value, uint64_t n) {\n"
+		"\t*value = n;\n"
+		"}\n"
+		"\n"
+		"static uint64_t loop_low(const loop_value *value) {\n"
+		"\treturn (uint64_t) *value;\n"
+		"}\n";
+	const char *bignumHelpers =
+		"\n"
+		"static void loop_set(loop_value *value, uint64_t n) {\n"
+		"\tbig_set_u64(value, n);\n"
+		"}\n"
+		"\n"
+		"static uint64_t loop_low(const loop_value *value) {\n"
+		"\treturn value->size ? value->limbs[0] : value->small;\n"
+		"}\n";
+	const char *bench =
+		"\n"
+		"#include <time.h>\n"
+		"#include <sys/resource.h>\n"
+		"\n"
+		"static double loop_now(void) {\n"
+		"\tstruct timespec t;\n"
+		"\tclock_gettime(CLOCK_MONOTONIC, &t);\n"
+		"\treturn t.tv_sec + t.tv_nsec * 1e-9;\n"
+		"}\n"
+		"\n"
+		"static uint64_t loop_pass(int n, const uint64_t *low, const uint64_t *high, loop_value *arguments) {\n"
+		"\tuint64_t checksum = 0;\n"
+		"\tfor (int k = 0; k < n; ++k)\n"
+		"\t\tloop_set(arguments + k, low[k]);\n"
+		"\twhile (1) {\n"
+		"\t\tloop_value result = %s(n, arguments);\n"
+		"\t\tchecksum = checksum * 0x100000001b3u ^ loop_low(&result);\n"
+		"\t\tloop_release(&result);\n"
+		"\t\tint k = n - 1;\n"
+		"\t\twhile (k >= 0 && loop_low(arguments + k) == high[k]) {\n"
+		"\t\t\tloop_set(arguments + k, low[k]);\n"
+		"\t\t\t--k;\n"
+		"\t\t}\n"
+		"\t\tif (k < 0) return checksum;\n"
+		"\t\tloop_set(arguments + k, loop_low(arguments + k) + 1);\n"
+		"\t}\n"
+		"}\n"
+		"\n"
+		"int main(int argc, char **argv) {\n"
+		"\tdouble budget = 0.5;\n"
+		"\tif (argc > 2 && strcmp(argv[1], \"-s\") == 0) {\n"
+		"\t\tbudget = strtod(argv[2], NULL);\n"
+		"\t\targc -= 2;\n"
+		"\t\targv += 2;\n"
+		"\t}\n"
+		"\tint n = argc - 1;\n"
+		"\tuint64_t *low = calloc(n + 1, sizeof(uint64_t)), *high = calloc(n + 1, sizeof(uint64_t));\n"
+		"\tloop_value *arguments = calloc(n + 1, sizeof(loop_value));\n"
+		"\tif (low == NULL || high == NULL || arguments == NULL) {\n"
+		"\t\tfprintf(stderr, \"%%s\\n\", strerror(errno));\n"
+		"\t\treturn 1;\n"
+		"\t}\n"
+		"\tuint64_t points = 1;\n"
+		"\tfor (int k = 0; k < n; ++k) {\n"
+		"\t\tchar *end;\n"
+		"\t\tlow[k] = high[k] = strtoull(argv[k + 1], &end, 10);\n"
+		"\t\tif (*end == ':') high[k] = strtoull(end + 1, &end, 10);\n"
+		"\t\tif (*end != '\\0' || argv[k + 1][0] < '0' || argv[k + 1][0] > '9' || high[k] < low[k]) {\n"
+		"\t\t\tfprintf(stderr, \"Inputs must be natural numbers or lo:hi ranges\\n\");\n"
+		"\t\t\treturn 1;\n"
+		"\t\t}\n"
+		"\t\tpoints *= high[k] - low[k] + 1;\n"
+		"\t}\n"
+		"\tuint64_t checksum = loop_pass(n, low, high, arguments);\n"
+		"\tuint64_t passes = 0;\n"
+		"\tdouble start = loop_now(), elapsed;\n"
+		"\tdo {\n"
+		"\t\tloop_pass(n, low, high, arguments);\n"
+		"\t\t++passes;\n"
+		"\t\telapsed = loop_now() - start;\n"
+		"\t} while (elapsed < budget);\n"
+		"\tstruct rusage usage;\n"
+		"\tgetrusage(RUSAGE_SELF, &usage);\n"
+		"\tdouble calls = (double) passes * points;\n"
+		"\tprintf(\"{\\\"function\\\": \\\"%s\\\", \\\"points\\\": %%\" PRIu64 \", \\\"calls\\\": %%.0f, \\\"seconds\\\": %%.6f, \"\n"
+		"\t\t\"\\\"ns_per_call\\\": %%.3f, \\\"calls_per_second\\\": %%.1f, \\\"peak_rss_kb\\\": %%ld, \\\"checksum\\\": \\\"%%016\" PRIx64 \"\\\"}\\n\",\n"
+		"\t\tpoints, calls, elapsed, elapsed * 1e9 / calls, calls / elapsed, usage.ru_maxrss, checksum);\n"
+		"\tfor (int k = 0; k < n; ++k)\n"
+		"\t\tloop_release(arguments + k);\n"
+		"\tfree(arguments);\n"
+		"\tfree(low);\n"
+		"\tfree(high);\n"
+		"\treturn 0;\n"
+		"}";
+	writeText(output, bignumVariables ? bignumHelpers : wordHelpers);
+	writeFormat(output, bench, functionName, functionName);
+}
+
+void writeReturn(Program *program, Output *output) {
+	const char *heapEnd =
+		"\t\n"
+		"\t\n"
+		"\t%s ret = x[0];\n"
+		"\tfree(x);\n"
+		"\treturn ret;\n"
+		"}\n";
+	const char *scalarEnd =
+		"\t\n"
+		"\t\n"
+		"\treturn x0;\n"
+		"}\n";
+	if (bignumVariables)
+		writeBignumEnd(program, output);
+	else
+		writeFormat(output, scalarVariables ? scalarEnd : heapEnd, type);
+}
+
+/* Seqlock slots: an odd version marks a slot being written, version 0 an empty one. Readers copy a slot and
+ * then check that its version did not change, writers claim a slot by making its version odd first. */
+void writeMemo(Output *output, char *functionName) {
+	const char *memo =
+		"\n"
+		"#define LOOP_MEMO_CAPACITY %u\n"
+		"#define LOOP_MEMO_WAYS %d\n"
+		"#define LOOP_MEMO_INPUTS %d\n"
+		"#define LOOP_MEMO_KEY_WORDS ((LOOP_MEMO_INPUTS * sizeof(%s) + 7) / 8)\n"
+		"#define LOOP_MEMO_VALUE_WORDS ((sizeof(%s) + 7) / 8)\n"
+		"#if defined(LOOP_MEMO_THREAD_SAFE)\n"
+		"#define LOOP_MEMO_LOAD(p, order) __atomic_load_n(p, order)\n"
+		"#define LOOP_MEMO_STORE(p, v, order) __atomic_store_n(p, v, order)\n"
+		"#define LOOP_MEMO_CLAIM(p, expected) __atomic_compare_exchange_n(p, &(expected), (expected) + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)\n"
+		"#define LOOP_MEMO_FENCE(order) __atomic_thread_fence(order)\n"
+		"#define LOOP_MEMO_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)\n"
+		"#else\n"
+		"#define LOOP_MEMO_LOAD(p, order) (*(p))\n"
+		"#define LOOP_MEMO_STORE(p, v, order) (*(p) = (v))\n"
+		"#define LOOP_MEMO_CLAIM(p, expected) (*(p) == (expected) ? (*(p) = (expected) + 1, 1) : 0)\n"
+		"#define LOOP_MEMO_FENCE(order) ((void) 0)\n"
+		"#define LOOP_MEMO_ADD(p, v) ((*(p) += (v)) - (v))\n"
+		"#endif\n"
+		"\n"
+		"typedef struct loop_memo_slot {\n"
+		"\t_Alignas(64) uint64_t version;\n"
+		"\tuint64_t stamp;\n"
+		"\tuint64_t key[LOOP_MEMO_KEY_WORDS];\n"
+		"\tuint64_t value[LOOP_MEMO_VALUE_WORDS];\n"
+		"} loop_memo_slot;\n"
+		"\n"
+		"static loop_memo_slot loop_memo_table[LOOP_MEMO_CAPACITY];\n"
+		"static _Alignas(64) uint64_t loop_memo_clock;\n"
+		"static _Alignas(64) uint64_t loop_memo_hits;\n"
+		"\n"
+		"static uint64_t loop_memo_hash(const uint64_t *key) {\n"
+		"\tuint64_t h = 0x9e3779b97f4a7c15u;\n"
+		"\tfor (size_t k = 0; k < LOOP_MEMO_KEY_WORDS; ++k) {\n"
+		"\t\th = (h ^ key[k]) * 0xbf58476d1ce4e5b9u;\n"
+		"\t\th ^= h >> 31;\n"
+		"\t}\n"
+		"\treturn h;\n"
+		"}\n"
+		"\n"
+		"%s %s(%s argc, %s *argv) {\n"
+		"\tuint64_t key[LOOP_MEMO_KEY_WORDS] = {0};\n"
+		"\tsize_t n = argc < LOOP_MEMO_INPUTS ? argc : LOOP_MEMO_INPUTS;\n"
+		"\tmemcpy(key, argv, n * sizeof(%s));\n"
+		"\tuint64_t stamp = LOOP_MEMO_ADD(&loop_memo_clock, 1) + 1;\n"
+		"\tloop_memo_slot *set = loop_memo_table + (loop_memo_hash(key) & (LOOP_MEMO_CAPACITY - LOOP_MEMO_WAYS));\n"
+		"\tloop_memo_slot *victim = set;\n"
+		"\tuint64_t oldest = UINT64_MAX;\n"
+		"\tfor (int w = 0; w < LOOP_MEMO_WAYS; ++w) {\n"
+		"\t\tloop_memo_slot *slot = set + w;\n"
+		"\t\tuint64_t version = LOOP_MEMO_LOAD(&slot->version, __ATOMIC_ACQUIRE);\n"
+		"\t\tif (version & 1) continue;\n"
+		"\t\tif (version == 0) {\n"
+		"\t\t\tif (oldest != 0) victim = slot;\n"
+		"\t\t\toldest = 0;\n"
+		"\t\t\tcontinue;\n"
+		"\t\t}\n"
+		"\t\tint same = 1;\n"
+		"\t\tfor (size_t k = 0; k < LOOP_MEMO_KEY_WORDS; ++k)\n"
+		"\t\t\tsame &= LOOP_MEMO_LOAD(slot->key + k, __ATOMIC_RELAXED) == key[k];\n"
+		"\t\tuint64_t value[LOOP_MEMO_VALUE_WORDS];\n"
+		"\t\tfor (size_t k = 0; k < LOOP_MEMO_VALUE_WORDS; ++k)\n"
+		"\t\t\tvalue[k] = LOOP_MEMO_LOAD(slot->value + k, __ATOMIC_RELAXED);\n"
+		"\t\tuint64_t used = LOOP_MEMO_LOAD(&slot->stamp, __ATOMIC_RELAXED);\n"
+		"\t\tLOOP_MEMO_FENCE(__ATOMIC_ACQUIRE);\n"
+		"\t\tif (LOOP_MEMO_LOAD(&slot->version, __ATOMIC_RELAXED) != version) continue;\n"
+		"\t\tif (same) {\n"
+		"\t\t\tLOOP_MEMO_STORE(&slot->stamp, stamp, __ATOMIC_RELAXED);\n"
+		"\t\t\t(void) LOOP_MEMO_ADD(&loop_memo_hits, 1);\n"
+		"\t\t\t%s ret;\n"
+		"\t\t\tmemcpy(&ret, value, sizeof(ret));\n"
+		"\t\t\treturn ret;\n"
+		"\t\t}\n"
+		"\t\tif (used < oldest) {\n"
+		"\t\t\tvictim = slot;\n"
+		"\t\t\toldest = used;\n"
+		"\t\t}\n"
+		"\t}\n"
+		"\t%s ret = %s_uncached(argc, argv);\n"
+		"\tuint64_t value[LOOP_MEMO_VALUE_WORDS] = {0};\n"
+		"\tmemcpy(value, &ret, sizeof(ret));\n"
+		"\tuint64_t version = LOOP_MEMO_LOAD(&victim->version, __ATOMIC_RELAXED);\n"
+		"\tif (!(version & 1) && LOOP_MEMO_CLAIM(&victim->version, version)) {\n"
+		"\t\tLOOP_MEMO_FENCE(__ATOMIC_RELEASE);\n"
+		"\t\tfor (size_t k = 0; k < LOOP_MEMO_KEY_WORDS; ++k)\n"
+		"\t\t\tLOOP_MEMO_STORE(victim->key + k, key[k], __ATOMIC_RELAXED);\n"
+		"\t\tfor (size_t k = 0; k < LOOP_MEMO_VALUE_WORDS; ++k)\n"
+		"\t\t\tLOOP_MEMO_STORE(victim->value + k, value[k], __ATOMIC_RELAXED);\n"
+		"\t\tLOOP_MEMO_STORE(&victim->stamp, stamp, __ATOMIC_RELAXED);\n"
+		"\t\tLOOP_MEMO_STORE(&victim->version, version + 2, __ATOMIC_RELEASE);\n"
+		"\t}\n"
+		"\treturn ret;\n"
+		"}\n"
+		"\n"
+		"void %s_memo_stats(uint64_t *hits, uint64_t *misses) {\n"
+		"\tuint64_t found = LOOP_MEMO_LOAD(&loop_memo_hits, __ATOMIC_RELAXED);\n"
+		"\tuint64_t calls = LOOP_MEMO_LOAD(&loop_memo_clock, __ATOMIC_RELAXED);\n"
+		"\tif (hits != NULL) *hits = found;\n"
+		"\tif (misses != NULL) *misses = calls - found;\n"
+		"}\n";
+	if (batchMain)
+		writeText(output, "\n#define LOOP_MEMO_THREAD_SAFE\n");
+	writeFormat(output, memo, memoCapacity, MEMO_WAYS, heighestIndex > 0 ? heighestIndex : 1, type, type, type, functionName, type, type, type, type, type, functionName, functionName);
+}
+
+void writeEnd(Output *output, char *functionName) {
+	writeValueHelpers(output);
+	if (batchMain)
+		writeBatchMain(output, functionName);
+	else if (benchMain)
+		writeBenchMain(output, functionName);
+	else
+		writeMain(output, functionName);
+}
+
+void writeIndentation(int indentation, Output *output) {
+	reserveOutput(output, indentation + 1);
+	output->data[output->size++] = '\n';
+	memset(output->data + output->size, '\t', indentation);
+	output->size += indentation;
+}
+
+void writeVariable(uint32_t index, Output *output) {
+	writeText(output, scalarVariables ? "x" : "x[");
+	writeNumber(output, index);
+	if (!scalarVariables) writeChar(output, ']');
+}
+
+void writeReference(uint32_t index, Output *output) {
+	writeChar(output, '&');
+	writeVariable(index, output);
+}
+
+/* Literals beyond INT64_MAX need a suffix to stay unsigned. */
+void writeConstant(uint64_t value, Output *output) {
+	writeNumber(output, value);
+	if (value > INT64_MAX) writeChar(output, 'u');
+}
+
+void writeOperand(Instruction *instruction, Output *output) {
+	if (bignumVariables && instruction->treatCAsVariable)
+		writeReference(instruction->c, output);
+	else if (instruction->treatCAsVariable)
+		writeVariable(instruction->c, output);
+	else
+		writeConstant(instruction->c, output);
+}
+
+void writeOverflowCall(Instruction *instruction, Output *output) {
+	writeFormat(output, "loop_overflow(%" PRIu32 ", %" PRIu32 ");", instruction->line, instruction->column);
+}
+
+void writeCheckedAssignment(Instruction *instruction, Output *output) {
+	writeText(output, instruction->operation == plus ? "if (__builtin_add_overflow(" : "if (__builtin_mul_overflow(");
+	writeVariable(instruction->j, output);
+	writeText(output, ", ");
+	writeOperand(instruction, output);
+	writeText(output, ", ");
+	writeReference(instruction->i, output);
+	writeText(output, ")) ");
+	writeOverflowCall(instruction, output);
+}
+
+void writeBignumAssignment(Instruction *instruction, Output *output) {
+	char *function;
+	switch (instruction->operation) {
+	case constant:
+		writeText(output, "big_set_u64(");
+		writeReference(instruction->i, output);
+		writeText(output, ", ");
+		writeConstant(instruction->c, output);
+		writeText(output, ");");
+		return;
+	case variable:
+		writeText(output, "big_copy(");
+		writeReference(instruction->i, output);
+		writeText(output, ", ");
+		writeReference(instruction->j, output);
+		writeText(output, ");");
+		return;
+	case plus:
+		function = "big_add";
+		break;
+	case minus:
+		function = "big_sub";
+		break;
+	case times:
+		function = "big_mul";
+		break;
+	case dividedBy:
+		function = "big_div";
+		break;
+	case modulo:
+		function = "big_mod";
+		break;
+	default:
+		error("Encountered assignment with undefined operation");
+	}
+	writeFormat(output, instruction->treatCAsVariable ? "%s(" : "%s_u64(", function);
+	writeReference(instruction->i, output);
+	writeText(output, ", ");
+	writeReference(instruction->j, output);
+	writeText(output, ", ");
+	writeOperand(instruction, output);
+	writeText(output, ");");
+}
+
+/* Inactive lanes keep their value, and get a divisor of 1 where a zero could trap. */
+/* Active lanes that divide by zero stop the program like the scalar function does, inactive ones divide by 1 instead. */
+void writeLanesAssignment(Instruction *instruction, Output *output) {
+	int checked = (instruction->operation == dividedBy || instruction->operation == modulo) && (instruction->treatCAsVariable || instruction->c == 0);
+	if (checked) {
+		writeFormat(output, "if (m[%d] = m[%d]", laneMask + 1, laneMask);
+		if (instruction->treatCAsVariable) {
+			writeText(output, " & (loop_lanes) (");
+			writeOperand(instruction, output);
+			writeText(output, " == 0)");
+		}
+		writeFormat(output, ", loop_any(&m[%d])) loop_division_by_zero(%" PRIu32 ", %" PRIu32 ");", laneMask + 1, instruction->line, instruction->column);
+		writeIndentation(laneMask + 1, output);
+	}
+	writeVariable(instruction->i, output);
+	writeFormat(output, " = (m[%d] & ", laneMask);
+	switch (instruction->operation) {
+	case constant:
+		writeConstant(instruction->c, output);
+		break;
+	case variable:
+		writeVariable(instruction->j, output);
+		break;
+	case plus:
+	case times:
+		writeText(output, "(");
+		writeVariable(instruction->j, output);
+		writeText(output, instruction->operation == plus ? " + " : " * ");
+		writeOperand(instruction, output);
+		writeText(output, ")");
+		break;
+	case minus:
+		writeText(output, "((");
+		writeVariable(instruction->j, output);
+		writeText(output, " - ");
+		writeOperand(instruction, output);
+		writeText(output, ") & (loop_lanes) (");
+		writeVariable(instruction->j, output);
+		writeText(output, " > ");
+		writeOperand(instruction, output);
+		writeText(output, "))");
+		break;
+	case dividedBy:
+	case modulo:
+		writeText(output, "(");
+		writeVariable(instruction->j, output);
+		writeText(output, instruction->operation == dividedBy ? " / " : " % ");
+		if (checked) {
+			writeText(output, "(");
+			writeOperand(instruction, output);
+			writeFormat(output, " | (~m[%d] & 1))", laneMask);
+		} else
+			writeOperand(instruction, output);
+		writeText(output, ")");
+		break;
+	default:
+		error("Encountered assignment with undefined operation");
+	}
+	writeFormat(output, ") | (~m[%d] & ", laneMask);
+	writeVariable(instruction->i, output);
+	writeText(output, ");");
+}
+
+/* Returns k for a constant 2^k and -1 for anything else. */
+int powerOfTwo(uint64_t value) {
+	if (value == 0 || (value & (value - 1)) != 0) return -1;
+	int shift = 0;
+	while (value >>= 1)
+		++shift;
+	return shift;
+}
+
+/* Computes the same divider as loop_divider_new in the generated code, for divisors that are not powers of two. */
+void divisionMagic(uint64_t divisor, uint64_t *magic, int *shift, int *add) {
+	*shift = 0;
+	while (divisor >> *shift >> 1)
+		++*shift;
+	uint64_t quotient = 0, remainder = (uint64_t) 1 << *shift;
+	for (int k = 0; k < 64; ++k) {
+		uint64_t carry = remainder >> 63;
+		remainder <<= 1;
+		quotient <<= 1;
+		if (carry || remainder >= divisor) {
+			remainder -= divisor;
+			quotient |= 1;
+		}
+	}
+	*add = divisor - remainder >= (uint64_t) 1 << *shift;
+	if (*add) {
+		uint64_t twice = remainder + remainder;
+		quotient += quotient;
+		if (twice >= divisor || twice < remainder) ++quotient;
+	}
+	*magic = quotient + 1;
+}
+
+void writeDivisionByZeroCall(Instruction *instruction, Output *output) {
+	writeFormat(output, "(loop_division_by_zero(%" PRIu32 ", %" PRIu32 "), 0)", instruction->line, instruction->column);
+}
+
+void writeConstantQuotient(Instruction *instruction, Output *output) {
+	uint64_t magic;
+	int shift, add;
+	divisionMagic(instruction->c, &magic, &shift, &add);
+	writeText(output, add ? "(loop_mulhi_add(" : "(loop_mulhi(");
+	writeVariable(instruction->j, output);
+	writeText(output, ", ");
+	writeConstant(magic, output);
+	writeFormat(output, ") >> %d)", shift);
+}
+
+/*
+ * Constant powers of two become shifts and masks and other constants a multiplication by
+ * their reciprocal, except in --checked where values may not fit 64 bits. A variable
+ * divisor is checked for zero first, and divides by the reciprocal d<reciprocal> when
+ * writeBody declared one before the enclosing LOOP.
+ */
+void writeDivision(Instruction *instruction, uint32_t reciprocal, Output *output) {
+	int modulus = instruction->operation == modulo;
+	writeVariable(instruction->i, output);
+	writeText(output, " = ");
+	if (!instruction->treatCAsVariable) {
+		int shift = powerOfTwo(instruction->c);
+		if (instruction->c == 0) {
+			writeDivisionByZeroCall(instruction, output);
+		} else if (shift >= 0) {
+			writeVariable(instruction->j, output);
+			if (modulus) {
+				writeText(output, " & ");
+				writeConstant(instruction->c - 1, output);
+			} else
+				writeFormat(output, " >> %d", shift);
+		} else if (checkedArithmetic) {
+			writeVariable(instruction->j, output);
+			writeText(output, modulus ? " % " : " / ");
+			writeConstant(instruction->c, output);
+		} else if (modulus) {
+			writeVariable(instruction->j, output);
+			writeText(output, " - ");
+			writeConstantQuotient(instruction, output);
+			writeText(output, " * ");
+			writeConstant(instruction->c, output);
+		} else
+			writeConstantQuotient(instruction, output);
+		writeText(output, ";");
+		return;
+	}
+	writeVariable(instruction->c, output);
+	writeText(output, " ? ");
+	if (reciprocal != 0) {
+		if (modulus) {
+			writeVariable(instruction->j, output);
+			writeText(output, " - ");
+		}
+		writeText(output, "loop_divide(");
+		writeVariable(instruction->j, output);
+		writeFormat(output, ", &d%" PRIu32 ")", reciprocal);
+		if (modulus) {
+			writeText(output, " * ");
+			writeVariable(instruction->c, output);
+		}
+	} else {
+		writeVariable(instruction->j, output);
+		writeText(output, modulus ? " % " : " / ");
+		writeVariable(instruction->c, output);
+	}
+	writeText(output, " : ");
+	writeDivisionByZeroCall(instruction, output);
+	writeText(output, ";");
+}
+
+void writeAssignment(Instruction *instruction, Output *output) {
+	char *operator;
+	if (bignumVariables) {
+		writeBignumAssignment(instruction, output);
+		return;
+	}
+	if (laneVariables) {
+		writeLanesAssignment(instruction, output);
+		return;
+	}
+	if (checkedArithmetic && (instruction->operation == plus || instruction->operation == times)) {
+		writeCheckedAssignment(instruction, output);
+		return;
+	}
+	if (instruction->operation == dividedBy || instruction->operation == modulo) {
+		writeDivision(instruction, 0, output);
+		return;
+	}
+	writeVariable(instruction->i, output);
+	writeText(output, " = ");
+	switch (instruction->operation) {
+	case constant:
+		writeConstant(instruction->c, output);
+		writeText(output, ";");
+		return;
+	case variable:
+		writeVariable(instruction->j, output);
+		writeText(output, ";");
+		return;
+	case plus:
+		operator = "+";
+		break;
+	case minus:
+		writeVariable(instruction->j, output);
+		writeText(output, " > ");
+		writeOperand(instruction, output);
+		writeText(output, " ? ");
+		writeVariable(instruction->j, output);
+		writeText(output, " - ");
+		writeOperand(instruction, output);
+		writeText(output, " : 0;");
+		return;
+	case times:
+		if (!instruction->treatCAsVariable && powerOfTwo(instruction->c) >= 0) {
+			writeVariable(instruction->j, output);
+			writeFormat(output, " << %d;", powerOfTwo(instruction->c));
+			return;
+		}
+		operator = "*";
+		break;
+	default:
+		error("Encountered assignment with undefined operation");
+	}
+	writeVariable(instruction->j, output);
+	writeFormat(output, " %s ", operator);
+	writeOperand(instruction, output);
+	writeText(output, ";");
+}
+
+void writeLoop(Instruction *instruction, Output *output) {
+	if (bignumVariables) {
+		writeText(output, "for (uint64_t i = big_loop_count(");
+		writeReference(instruction->i, output);
+		writeText(output, "); i; --i) {");
+		return;
+	}
+	if (laneVariables) {
+		writeText(output, "for (loop_lanes i = ");
+		writeVariable(instruction->i, output);
+		writeFormat(output, "; m[%d] = m[%d] & (loop_lanes) (i != 0), loop_any(&m[%d]); i -= m[%d] & 1) {", laneMask + 1, laneMask, laneMask + 1, laneMask + 1);
+		return;
+	}
+	writeFormat(output, "for (%s i = ", type);
+	writeVariable(instruction->i, output);
+	writeText(output, "; i; --i) {");
+}
+
+void writeComparison(Instruction *instruction, char *relation, Output *output) {
+	if (bignumVariables) {
+		writeText(output, instruction->treatCAsVariable ? "big_cmp(" : "big_cmp_u64(");
+		writeReference(instruction->i, output);
+		writeText(output, ", ");
+		writeOperand(instruction, output);
+		writeFormat(output, ") %s 0", relation);
+		return;
+	}
+	writeVariable(instruction->i, output);
+	writeFormat(output, " %s ", relation);
+	writeOperand(instruction, output);
+}
+
+void writeWhile(Instruction *instruction, Output *output) {
+	char *relation;
+	switch (instruction->operation) {
+	case equal:
+		relation = "==";
+		break;
+	case notEqual:
+		relation = "!=";
+		break;
+	case greater:
+		relation = ">";
+		break;
+	case greaterEqual:
+		relation = ">=";
+		break;
+	case less:
+		relation = "<";
+		break;
+	case lessEqual:
+		relation = "<=";
+		break;
+	default:
+		error("Encountered WHILE with undefined relation");
+	}
+	if (laneVariables) {
+		writeFormat(output, "for (m[%d] = m[%d]; m[%d] &= (loop_lanes) (", laneMask + 1, laneMask, laneMask + 1);
+		writeComparison(instruction, relation, output);
+		writeFormat(output, "), loop_any(&m[%d]);) {", laneMask + 1);
+		return;
+	}
+	writeText(output, "while (");
+	writeComparison(instruction, relation, output);
+	writeText(output, ") {");
+}
+
+void writeIfStart(Instruction *instruction, Output *output) {
+	char *relation;
+	switch (instruction->operation) {
+	case equal:
+		relation = "==";
+		break;
+	case notEqual:
+		relation = "!=";
+		break;
+	case greater:
+		relation = ">";
+		break;
+	case greaterEqual:
+		relation = ">=";
+		break;
+	case less:
+		relation = "<";
+		break;
+	case lessEqual:
+		relation = "<=";
+		break;
+	default:
+		error("Encountered IF with undefined relation");
+	}
+	if (laneVariables) {
+		writeFormat(output, "if (m[%d] = m[%d] & (loop_lanes) (", laneMask + 1, laneMask);
+		writeComparison(instruction, relation, output);
+		writeFormat(output, "), loop_any(&m[%d])) {", laneMask + 1);
+		return;
+	}
+	writeText(output, "if (");
+	writeComparison(instruction, relation, output);
+	writeText(output, ") {");
+}
+
+void writeIfEnd(Output *output) {
+	if (laneVariables)
+		writeFormat(output, "if (m[%d] = m[%d] & ~m[%d], loop_any(&m[%d])) {", laneMask + 1, laneMask, laneMask + 1, laneMask + 1);
+	else
+		writeText(output, "else {");
+}
+
+void writeInstruction(Instruction *instruction, Output *output) {
+	switch (instruction->instructionType) {
+	case assignment:
+		writeAssignment(instruction, output);
+		break;
+	case loopInstruction:
+		writeLoop(instruction, output);
+		break;
+	case whileInstruction:
+		writeWhile(instruction, output);
+		break;
+	case ifInstructionStart:
+		writeIfStart(instruction, output);
+		break;
+	case ifInstructionEnd:
+		writeIfEnd(output);
+		break;
+	case emptyInstruction:
+		break;
+	default:
+		error("Encountered Instruction of undefined type");
+	}
+}
+
+void writeLoopEnd(Output *output) {
+	writeText(output, "}");
+}
+
+void writeTerm(Term *term, Output *output) {
+	if (term->coefficient != 1 || term->factorCount == 0) {
+		writeConstant(term->coefficient, output);
+		if (term->factorCount) writeText(output, " * ");
+	}
+	for (int k = 0; k < term->factorCount; ++k) {
+		if (k) writeText(output, " * ");
+		writeVariable(term->factors[k], output);
+	}
+}
+
+/* Leaves the sum of the terms in the temporary sum, using term as scratch space. */
+void writeBignumTerms(Effect *effect, int indentation, Output *output) {
+	writeIndentation(indentation, output);
+	writeText(output, "big_set_u64(&sum, 0);");
+	for (int k = 0; k < effect->termCount; ++k) {
+		Term *term = effect->terms + k;
+		writeIndentation(indentation, output);
+		if (term->factorCount == 0) {
+			writeText(output, "big_set_u64(&term, ");
+			writeConstant(term->coefficient, output);
+			writeText(output, ");");
+		} else {
+			writeText(output, "big_copy(&term, ");
+			writeReference(term->factors[0], output);
+			writeText(output, ");");
+			for (int l = 1; l < term->factorCount; ++l) {
+				writeText(output, " big_mul(&term, &term, ");
+				writeReference(term->factors[l], output);
+				writeText(output, ");");
+			}
+			if (term->coefficient != 1) {
+				writeText(output, " big_mul_u64(&term, &term, ");
+				writeConstant(term->coefficient, output);
+				writeText(output, ");");
+			}
+		}
+		writeText(output, " big_add(&sum, &sum, &term);");
+	}
+	writeIndentation(indentation, output);
+	writeText(output, "big_mul(&sum, &sum, &iterations);");
+}
+
+/* Saturating subtraction is exact here, so increments and decrements take the same shape. */
+void writeBignumSummary(Program *program, uint32_t index, int indentation, Output *output) {
+	LoopSummary *summary = program->summaries[index];
+	writeText(output, "{");
+	writeIndentation(indentation + 1, output);
+	writeText(output, "big iterations = BIG_INIT, sum = BIG_INIT, term = BIG_INIT;");
+	writeIndentation(indentation + 1, output);
+	writeText(output, "big_copy(&iterations, ");
+	writeReference(program->instructions[index].i, output);
+	writeText(output, ");");
+	for (int k = 0; k < summary->effectCount; ++k) {
+		Effect *effect = summary->effects + k;
+		if (effect->effectType == setEffect) {
+			writeIndentation(indentation + 1, output);
+			writeText(output, "if (!big_is_zero(&iterations)) ");
+			writeAssignment(program->instructions + effect->assignment, output);
+		} else if (effect->termCount > 0) {
+			writeBignumTerms(effect, indentation + 1, output);
+			writeIndentation(indentation + 1, output);
+			writeText(output, effect->effectType == incrementEffect ? "big_add(" : "big_sub(");
+			writeReference(effect->variable, output);
+			writeText(output, ", ");
+			writeReference(effect->variable, output);
+			writeText(output, ", &sum);");
+		}
+	}
+	writeIndentation(indentation + 1, output);
+	writeText(output, "big_free(&iterations);");
+	writeIndentation(indentation + 1, output);
+	writeText(output, "big_free(&sum);");
+	writeIndentation(indentation + 1, output);
+	writeText(output, "big_free(&term);");
+	writeIndentation(indentation, output);
+	writeLoopEnd(output);
+}
+
+/*
+ * The increments only ever grow the variable, so one of them overflows exactly if
+ * the LOOP would have overflowed somewhere. The LOOP itself is reported in that case.
+ * A zero factor is checked first because it makes the whole term vanish.
+ */
+void writeCheckedIncrement(Program *program, uint32_t index, Effect *effect, int indentation, Output *output) {
+	for (int k = 0; k < effect->termCount; ++k) {
+		Term *term = effect->terms + k;
+		writeIndentation(indentation, output);
+		writeText(output, "if (");
+		for (int l = 0; l < term->factorCount; ++l) {
+			writeVariable(term->factors[l], output);
+			writeText(output, " && ");
+		}
+		writeText(output, "(__builtin_mul_overflow(iterations, ");
+		writeConstant(term->coefficient, output);
+		writeText(output, ", &term)");
+		for (int l = 0; l < term->factorCount; ++l) {
+			writeText(output, " || __builtin_mul_overflow(term, ");
+			writeVariable(term->factors[l], output);
+			writeText(output, ", &term)");
+		}
+		writeText(output, " || __builtin_add_overflow(");
+		writeVariable(effect->variable, output);
+		writeText(output, ", term, ");
+		writeReference(effect->variable, output);
+		writeText(output, "))) ");
+		writeOverflowCall(program->instructions + index, output);
+	}
+}
+
+/* Lanes that skip the LOOP get no iterations, so only the SET effects need a mask. */
+void writeLanesSummary(Program *program, uint32_t index, int indentation, Output *output) {
+	LoopSummary *summary = program->summaries[index];
+	writeText(output, "{");
+	writeIndentation(indentation + 1, output);
+	writeText(output, "loop_lanes iterations = ");
+	writeVariable(program->instructions[index].i, output);
+	writeFormat(output, " & m[%d];", laneMask);
+	for (int k = 0; k < summary->effectCount; ++k) {
+		if (summary->effects[k].effectType == setEffect) {
+			writeIndentation(indentation + 1, output);
+			writeFormat(output, "m[%d] = m[%d] & (loop_lanes) (iterations != 0);", laneMask + 1, laneMask);
+			break;
+		}
+	}
+	for (int k = 0; k < summary->effectCount; ++k) {
+		Effect *effect = summary->effects + k;
+		writeIndentation(indentation + 1, output);
+		if (effect->effectType == setEffect) {
+			++laneMask;
+			writeAssignment(program->instructions + effect->assignment, output);
+			--laneMask;
+		} else if (effect->effectType == incrementEffect && effect->termCount > 0) {
+			writeVariable(effect->variable, output);
+			writeText(output, " = ");
+			writeVariable(effect->variable, output);
+			writeText(output, " + iterations * (");
+			for (int l = 0; l < effect->termCount; ++l) {
+				if (l) writeText(output, " + ");
+				writeTerm(effect->terms + l, output);
+			}
+			writeText(output, ");");
+		}
+	}
+	writeIndentation(indentation, output);
+	writeLoopEnd(output);
+}
+
+void writeSummary(Program *program, uint32_t index, int indentation, Output *output) {
+	LoopSummary *summary = program->summaries[index];
+	if (bignumVariables) {
+		writeBignumSummary(program, index, indentation, output);
+		return;
+	}
+	if (laneVariables) {
+		writeLanesSummary(program, index, indentation, output);
+		return;
+	}
+	writeText(output, "{");
+	writeIndentation(indentation + 1, output);
+	writeFormat(output, "%s iterations = ", type);
+	writeVariable(program->instructions[index].i, output);
+	writeText(output, ";");
+	for (int k = 0; checkedArithmetic && k < summary->effectCount; ++k) {
+		if (summary->effects[k].effectType == incrementEffect && summary->effects[k].termCount > 0) {
+			writeIndentation(indentation + 1, output);
+			writeFormat(output, "%s term;", type);
+			break;
+		}
+	}
+	for (int k = 0; k < summary->effectCount; ++k) {
+		Effect *effect = summary->effects + k;
+		uint32_t v = effect->variable;
+		if (effect->effectType == setEffect) {
+			writeIndentation(indentation + 1, output);
+			writeText(output, "if (iterations) ");
+			writeAssignment(program->instructions + effect->assignment, output);
+		} else if (effect->effectType == incrementEffect && effect->termCount > 0 && checkedArithmetic) {
+			writeCheckedIncrement(program, index, effect, indentation + 1, output);
+		} else if (effect->effectType == incrementEffect && effect->termCount > 0) {
+			writeIndentation(indentation + 1, output);
+			writeVariable(v, output);
+			writeText(output, " = ");
+			writeVariable(v, output);
+			writeText(output, " + iterations * (");
+			for (int l = 0; l < effect->termCount; ++l) {
+				if (l) writeText(output, " + ");
+				writeTerm(effect->terms + l, output);
+			}
+			writeText(output, ");");
+		} else if (effect->effectType == decrementEffect && effect->termCount > 0) {
+			Term *term = effect->terms;
+			writeIndentation(indentation + 1, output);
+			for (int l = 0; l < term->factorCount; ++l) {
+				writeText(output, l ? " && " : "if (");
+				writeVariable(term->factors[l], output);
+			}
+			if (term->factorCount) writeText(output, ") ");
+			writeVariable(v, output);
+			writeText(output, " = iterations <= ");
+			writeVariable(v, output);
+			if (term->coefficient != 1) {
+				writeText(output, " / ");
+				writeConstant(term->coefficient, output);
+			}
+			for (int l = 0; l < term->factorCount; ++l) {
+				writeText(output, " / ");
+				writeVariable(term->factors[l], output);
+			}
+			writeText(output, " ? ");
+			writeVariable(v, output);
+			writeText(output, " - iterations * ");
+			writeTerm(term, output);
+			writeText(output, " : 0;");
+		}
+	}
+	writeIndentation(indentation, output);
+	writeLoopEnd(output);
+}
+
+void writeIdiomBase(Idiom *idiom, Output *output) {
+	if (idiom->treatBaseAsVariable)
+		writeVariable(idiom->base, output);
+	else
+		writeConstant(idiom->base, output);
+}
+
+void writeBignumIdiom(Program *program, uint32_t index, int indentation, Output *output) {
+	Idiom *idiom = program->idioms[index];
+	writeText(output, "{");
+	writeIndentation(indentation + 1, output);
+	writeText(output, "uint64_t iterations = big_loop_count(");
+	writeReference(program->instructions[index].i, output);
+	writeText(output, ");");
+	writeIndentation(indentation + 1, output);
+	if (idiom->idiomType == bitLengthIdiom) {
+		writeText(output, "uint64_t length = big_bit_length(");
+		writeReference(idiom->variable, output);
+		writeText(output, ");");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "uint64_t steps = iterations < length ? iterations : length;");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_shift_right(");
+		writeReference(idiom->variable, output);
+		writeText(output, ", ");
+		writeReference(idiom->variable, output);
+		writeText(output, ", steps);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_add_u64(");
+		writeReference(idiom->counter, output);
+		writeText(output, ", ");
+		writeReference(idiom->counter, output);
+		writeText(output, ", steps);");
+	} else if (idiom->idiomType == divisionIdiom) {
+		writeText(output, "big divisor = BIG_INIT, steps = BIG_INIT, product = BIG_INIT;");
+		writeIndentation(indentation + 1, output);
+		if (idiom->treatBaseAsVariable) {
+			writeText(output, "big_copy(&divisor, ");
+			writeReference(idiom->base, output);
+		} else {
+			writeText(output, "big_set_u64(&divisor, ");
+			writeConstant(idiom->base, output);
+		}
+		writeText(output, ");");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "if (big_is_zero(&divisor)) big_set_u64(&steps, iterations);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "else big_div(&steps, ");
+		writeReference(idiom->variable, output);
+		writeText(output, ", &divisor);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "if (big_cmp_u64(&steps, iterations) > 0) big_set_u64(&steps, iterations);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_mul(&product, &steps, &divisor);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_sub(");
+		writeReference(idiom->variable, output);
+		writeText(output, ", ");
+		writeReference(idiom->variable, output);
+		writeText(output, ", &product);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_add(");
+		writeReference(idiom->counter, output);
+		writeText(output, ", ");
+		writeReference(idiom->counter, output);
+		writeText(output, ", &steps);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_free(&divisor);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_free(&steps);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_free(&product);");
+	} else {
+		writeText(output, "big base = BIG_INIT;");
+		writeIndentation(indentation + 1, output);
+		if (idiom->treatBaseAsVariable) {
+			writeText(output, "big_copy(&base, ");
+			writeReference(idiom->base, output);
+		} else {
+			writeText(output, "big_set_u64(&base, ");
+			writeConstant(idiom->base, output);
+		}
+		writeText(output, ");");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_mul_power(");
+		writeReference(idiom->variable, output);
+		writeText(output, ", &base, iterations);");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "big_free(&base);");
+		if (idiom->copyTemporary) {
+			writeIndentation(indentation + 1, output);
+			writeText(output, "if (iterations) big_copy(");
+			writeReference(idiom->temporary, output);
+			writeText(output, ", ");
+			writeReference(idiom->variable, output);
+			writeText(output, ");");
+		}
+	}
+	writeIndentation(indentation, output);
+	writeLoopEnd(output);
+}
+
+/* Like a summary, an idiom reads the iteration count once and reports an overflow at the LOOP. */
+void writeIdiom(Program *program, uint32_t index, int indentation, Output *output) {
+	Idiom *idiom = program->idioms[index];
+	if (bignumVariables) {
+		writeBignumIdiom(program, index, indentation, output);
+		return;
+	}
+	writeText(output, "{");
+	writeIndentation(indentation + 1, output);
+	writeFormat(output, "%s iterations = ", type);
+	writeVariable(program->instructions[index].i, output);
+	writeText(output, ";");
+	writeIndentation(indentation + 1, output);
+	if (idiom->idiomType == bitLengthIdiom) {
+		writeFormat(output, "%s length = loop_bit_length(", type);
+		writeVariable(idiom->variable, output);
+		writeText(output, ");");
+		writeIndentation(indentation + 1, output);
+		writeFormat(output, "%s steps = iterations < length ? iterations : length;", type);
+		writeIndentation(indentation + 1, output);
+		writeVariable(idiom->variable, output);
+		writeText(output, " = steps == length ? 0 : ");
+		writeVariable(idiom->variable, output);
+		writeText(output, " >> steps;");
+		writeIndentation(indentation + 1, output);
+		if (checkedArithmetic) {
+			writeText(output, "if (__builtin_add_overflow(");
+			writeVariable(idiom->counter, output);
+			writeText(output, ", steps, ");
+			writeReference(idiom->counter, output);
+			writeText(output, ")) ");
+			writeOverflowCall(program->instructions + index, output);
+		} else {
+			writeVariable(idiom->counter, output);
+			writeText(output, " = ");
+			writeVariable(idiom->counter, output);
+			writeText(output, " + steps;");
+		}
+	} else if (idiom->idiomType == divisionIdiom) {
+		writeFormat(output, "%s divisor = ", type);
+		writeIdiomBase(idiom, output);
+		writeText(output, ";");
+		writeIndentation(indentation + 1, output);
+		writeFormat(output, "%s steps = divisor ? ", type);
+		writeVariable(idiom->variable, output);
+		writeText(output, " / divisor : iterations;");
+		writeIndentation(indentation + 1, output);
+		writeText(output, "if (steps > iterations) steps = iterations;");
+		writeIndentation(indentation + 1, output);
+		writeVariable(idiom->variable, output);
+		writeText(output, " = ");
+		writeVariable(idiom->variable, output);
+		writeText(output, " - steps * divisor;");
+		writeIndentation(indentation + 1, output);
+		if (checkedArithmetic) {
+			writeText(output, "if (__builtin_add_overflow(");
+			writeVariable(idiom->counter, output);
+			writeText(output, ", steps, ");
+			writeReference(idiom->counter, output);
+			writeText(output, ")) ");
+			writeOverflowCall(program->instructions + index, output);
+		} else {
+			writeVariable(idiom->counter, output);
+			writeText(output, " = ");
+			writeVariable(idiom->counter, output);
+			writeText(output, " + steps;");
+		}
+	} else {
+		if (checkedArithmetic) {
+			writeText(output, "if (loop_power_overflow(");
+			writeReference(idiom->variable, output);
+			writeText(output, ", ");
+			writeIdiomBase(idiom, output);
+			writeText(output, ", iterations)) ");
+			writeOverflowCall(program->instructions + index, output);
+		} else {
+			writeVariable(idiom->variable, output);
+			writeText(output, " = ");
+			writeVariable(idiom->variable, output);
+			writeText(output, " * loop_power(");
+			writeIdiomBase(idiom, output);
+			writeText(output, ", iterations);");
+		}
+		if (idiom->copyTemporary) {
+			writeIndentation(indentation + 1, output);
+			writeText(output, "if (iterations) ");
+			writeVariable(idiom->temporary, output);
+			writeText(output, " = ");
+			writeVariable(idiom->variable, output);
+			writeText(output, ";");
+		}
+	}
+	writeIndentation(indentation, output);
+	writeLoopEnd(output);
+}
+
+char *relationText(uint8_t operation) {
+	switch (operation) {
+	case equal:
+		return "=";
+	case notEqual:
+		return "!=";
+	case greater:
+		return ">";
+	case greaterEqual:
+		return ">=";
+	case less:
+		return "<";
+	case lessEqual:
+		return "<=";
+	default:
+		error("Encountered comparison with undefined relation");
+	}
+	return NULL;
+}
+
+void writeProfileOperand(Instruction *instruction, Output *output) {
+	if (instruction->treatCAsVariable)
+		writeFormat(output, "x%" PRIu64, instruction->c);
+	else
+		writeFormat(output, "%" PRIu64, instruction->c);
+}
+
+/* Prints an instruction the way it looks in LOOP source, which never needs escaping inside a string literal. */
+void writeProfileLabel(Instruction *instruction, Output *output) {
+	char *operators[] = {[plus] = "+", [minus] = "-", [times] = "*", [dividedBy] = "DIV", [modulo] = "MOD"};
+	switch (instruction->instructionType) {
+	case assignment:
+		writeFormat(output, "x%" PRIu32 " := ", instruction->i);
+		if (instruction->operation == constant) {
+			writeFormat(output, "%" PRIu64, instruction->c);
+		} else if (instruction->operation == variable) {
+			writeFormat(output, "x%" PRIu32, instruction->j);
+		} else {
+			writeFormat(output, "x%" PRIu32 " %s ", instruction->j, operators[instruction->operation]);
+			writeProfileOperand(instruction, output);
+		}
+		break;
+	case loopInstruction:
+		writeFormat(output, "LOOP x%" PRIu32, instruction->i);
+		break;
+	case whileInstruction:
+	case ifInstructionStart:
+		writeFormat(output, "%s x%" PRIu32 " %s ", instruction->instructionType == whileInstruction ? "WHILE" : "IF", instruction->i, relationText(instruction->operation));
+		writeProfileOperand(instruction, output);
+		break;
+	case ifInstructionEnd:
+		writeText(output, "ELSE");
+		break;
+	case emptyInstruction:
+		break;
+	default:
+		error("Encountered Instruction of undefined type");
+	}
+}
+
+/*
+ * Every instruction gets a counter slot indexed by its IR index and a site entry
+ * with its parent, source position, and source text. Parents always have smaller
+ * indices than their children, so the report sums up costs in one backward pass.
+ * An ELSE hangs below its IF, so that both branches show up as parts of the IF.
+ */
+void writeProfile(Program *program, Output *output, char *functionName) {
+	const char *runtime =
+		"\n"
+		"#if defined(LOOP_PROFILE_CYCLES)\n"
+		"#if defined(__x86_64__) || defined(__i386__)\n"
+		"#include <x86intrin.h>\n"
+		"#define loop_profile_clock() __rdtsc()\n"
+		"#else\n"
+		"#include <time.h>\n"
+		"static uint64_t loop_profile_clock(void) {\n"
+		"\tstruct timespec t;\n"
+		"\tclock_gettime(CLOCK_MONOTONIC, &t);\n"
+		"\treturn t.tv_sec * 1000000000u + t.tv_nsec;\n"
+		"}\n"
+		"#endif\n"
+		"#define LOOP_PROFILE_START(k) uint64_t loop_profile_start_##k = loop_profile_clock()\n"
+		"#define LOOP_PROFILE_STOP(k) (loop_profile[k].cycles += loop_profile_clock() - loop_profile_start_##k)\n"
+		"#else\n"
+		"#define LOOP_PROFILE_START(k) ((void) 0)\n"
+		"#define LOOP_PROFILE_STOP(k) ((void) 0)\n"
+		"#endif\n"
+		"#define LOOP_PROFILE_COUNT(k) (++loop_profile[k].count)\n"
+		"#define LOOP_PROFILE_ITERATION(k) (++loop_profile[k].iterations)\n"
+		"#define LOOP_PROFILE_ITERATIONS(k, n) (loop_profile[k].iterations += (n))\n"
+		"#define LOOP_PROFILE_SITES %" PRIu32 "\n"
+		"\n"
+		"typedef struct loop_profile_entry {\n"
+		"\tuint64_t count;\n"
+		"\tuint64_t iterations;\n"
+		"\tuint64_t cycles;\n"
+		"\tuint64_t cost;\n"
+		"} loop_profile_entry;\n"
+		"\n"
+		"typedef struct loop_profile_site {\n"
+		"\tuint32_t parent;\n"
+		"\tuint32_t line;\n"
+		"\tuint32_t column;\n"
+		"\tconst char *label;\n"
+		"} loop_profile_site;\n"
+		"\n"
+		"static loop_profile_entry loop_profile[LOOP_PROFILE_SITES];\n"
+		"static uint32_t loop_profile_order[LOOP_PROFILE_SITES];\n"
+		"static const char loop_profile_file[] = ";
+	const char *sitesStart =
+		";\n"
+		"static const loop_profile_site loop_profile_sites[LOOP_PROFILE_SITES] = {\n"
+		"\t{0, 0, 0, \"\"}";
+	const char *report =
+		"\n"
+		"};\n"
+		"\n"
+		"static int loop_profile_compare(const void *a, const void *b) {\n"
+		"\tuint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;\n"
+		"\tif (loop_profile[x].cost != loop_profile[y].cost) return loop_profile[x].cost < loop_profile[y].cost ? 1 : -1;\n"
+		"\treturn x < y ? -1 : 1;\n"
+		"}\n"
+		"\n"
+		"static void loop_profile_frames(FILE *file, uint32_t k) {\n"
+		"\tconst loop_profile_site *site = loop_profile_sites + k;\n"
+		"\tif (site->parent != 0) {\n"
+		"\t\tloop_profile_frames(file, site->parent);\n"
+		"\t\tfputc(';', file);\n"
+		"\t}\n"
+		"\tfprintf(file, \"%%s (%%s:%%\" PRIu32 \":%%\" PRIu32 \")\", site->label, loop_profile_file, site->line, site->column);\n"
+		"}\n"
+		"\n"
+		"/* Cost is the number of executed instructions including nested ones, the folded stacks count every instruction by itself. */\n"
+		"__attribute__((destructor)) static void loop_profile_report(void) {\n"
+		"\tuint32_t n = 0;\n"
+		"\tfor (uint32_t k = LOOP_PROFILE_SITES - 1; k > 0; --k) {\n"
+		"\t\tloop_profile[k].cost += loop_profile[k].count;\n"
+		"\t\tloop_profile[loop_profile_sites[k].parent].cost += loop_profile[k].cost;\n"
+		"\t\tif (loop_profile[k].count != 0) loop_profile_order[n++] = k;\n"
+		"\t}\n"
+		"\tqsort(loop_profile_order, n, sizeof(uint32_t), loop_profile_compare);\n"
+		"\tfprintf(stderr, \"Profile of %s (%%s), sorted by cost:\\n\", loop_profile_file);\n"
+		"\tfprintf(stderr, \"%%16s %%16s %%16s %%16s  %%s\\n\", \"cost\", \"count\", \"iterations\", \"cycles\", \"instruction\");\n"
+		"\tfor (uint32_t k = 0; k < n; ++k) {\n"
+		"\t\tconst loop_profile_entry *entry = loop_profile + loop_profile_order[k];\n"
+		"\t\tconst loop_profile_site *site = loop_profile_sites + loop_profile_order[k];\n"
+		"\t\tfprintf(stderr, \"%%16\" PRIu64 \" %%16\" PRIu64 \" %%16\" PRIu64 \" %%16\" PRIu64 \"  %%s:%%\" PRIu32 \":%%\" PRIu32 \" %%s\\n\",\n"
+		"\t\t\tentry->cost, entry->count, entry->iterations, entry->cycles, loop_profile_file, site->line, site->column, site->label);\n"
+		"\t}\n"
+		"\tconst char *folded = getenv(\"LOOP_PROFILE_FOLDED\");\n"
+		"\tif (folded == NULL) return;\n"
+		"\tFILE *file = fopen(folded, \"w\");\n"
+		"\tif (file == NULL) {\n"
+		"\t\tfprintf(stderr, \"%%s: %%s\\n\", folded, strerror(errno));\n"
+		"\t\treturn;\n"
+		"\t}\n"
+		"\tfor (uint32_t k = 1; k < LOOP_PROFILE_SITES; ++k) {\n"
+		"\t\tif (loop_profile[k].count == 0) continue;\n"
+		"\t\tloop_profile_frames(file, k);\n"
+		"\t\tfprintf(file, \" %%\" PRIu64 \"\\n\", loop_profile[k].count);\n"
+		"\t}\n"
+		"\tfclose(file);\n"
+		"}\n";
+	uint32_t *parents = (uint32_t *) calloc(program->size, sizeof(uint32_t));
+	if (parents == NULL) systemError();
+	for (uint32_t k = 1; k < program->size; ++k) {
+		Instruction *instruction = program->instructions + k;
+		if (instruction->innerInstruction != 0) parents[instruction->innerInstruction] = k;
+		if (instruction->nextInstruction != 0)
+			parents[instruction->nextInstruction] = program->instructions[instruction->nextInstruction].instructionType == ifInstructionEnd ? k : parents[k];
+	}
+	writeFormat(output, runtime, program->size);
+	writeStringLiteral(sourceFileName, output);
+	writeText(output, sitesStart);
+	for (uint32_t k = 1; k < program->size; ++k) {
+		Instruction *instruction = program->instructions + k;
+		writeFormat(output, ",\n\t{%" PRIu32 ", %" PRIu32 ", %" PRIu32 ", \"", parents[k], instruction->line, instruction->column);
+		writeProfileLabel(instruction, output);
+		writeText(output, "\"}");
+	}
+	writeFormat(output, report, functionName);
+	free(parents);
+}
+
+/* Counts the instruction before it runs; LOOPs and WHILEs also start their timer, collapsed LOOPs add their count at once. */
+void writeProfileEntry(Program *program, uint32_t index, int collapsed, int indentation, Output *output) {
+	Instruction *instruction = program->instructions + index;
+	writeFormat(output, "LOOP_PROFILE_COUNT(%" PRIu32 ");", index);
+	if (instruction->instructionType != loopInstruction && instruction->instructionType != whileInstruction) {
+		writeIndentation(indentation, output);
+		return;
+	}
+	writeIndentation(indentation, output);
+	writeFormat(output, "LOOP_PROFILE_START(%" PRIu32 ");", index);
+	writeIndentation(indentation, output);
+	if (!collapsed) return;
+	writeFormat(output, "LOOP_PROFILE_ITERATIONS(%" PRIu32 ", ", index);
+	if (bignumVariables) {
+		writeText(output, "big_loop_count(");
+		writeReference(instruction->i, output);
+		writeText(output, ")");
+	} else {
+		writeText(output, "(uint64_t) ");
+		writeVariable(instruction->i, output);
+	}
+	writeText(output, ");");
+	writeIndentation(indentation, output);
+}
+
+/* Decrements need divisions to stay exact, which the lane variant does not summarize. */
+LoopSummary *writtenSummary(Program *program, uint32_t index) {
+	LoopSummary *summary = program->summaries != NULL ? program->summaries[index] : NULL;
+	if (summary == NULL || !laneVariables) return summary;
+	for (int k = 0; k < summary->effectCount; ++k)
+		if (summary->effects[k].effectType == decrementEffect && summary->effects[k].termCount > 0)
+			return NULL;
+	return summary;
+}
+
+Idiom *writtenIdiom(Program *program, uint32_t index) {
+	return program->idioms != NULL && !laneVariables ? program->idioms[index] : NULL;
+}
+
+int assignsVariable(Program *program, uint32_t first, uint32_t variable) {
+	IndexStack stack = {NULL, 0, 0};
+	int assigned = 0;
+	push(&stack, first);
+	while (stack.size > 0 && !assigned) {
+		for (uint32_t k = pop(&stack); k != 0; k = program->instructions[k].nextInstruction) {
+			Instruction *instruction = program->instructions + k;
+			if (instruction->innerInstruction != 0) push(&stack, instruction->innerInstruction);
+			if (instruction->instructionType == assignment && instruction->i == variable) {
+				assigned = 1;
+				break;
+			}
+		}
+	}
+	freeIndexStack(&stack);
+	return assigned;
+}
+
+/*
+ * Maps every division by a variable to the outermost LOOP around it that leaves the divisor
+ * alone, where writeBody computes its reciprocal once. Summarized LOOPs and idioms do not
+ * write their body as is, so divisions inside them keep dividing. Returns NULL if there is none.
+ */
+uint32_t *findReciprocals(Program *program) {
+	uint32_t *parents = (uint32_t *) calloc(program->size, sizeof(uint32_t));
+	uint32_t *loops = (uint32_t *) calloc(program->size, sizeof(uint32_t));
+	if (parents == NULL || loops == NULL) systemError();
+	int found = 0;
+	for (uint32_t k = 1; k < program->size; ++k) {
+		Instruction *instruction = program->instructions + k;
+		if (instruction->innerInstruction != 0) parents[instruction->innerInstruction] = k;
+		if (instruction->nextInstruction != 0) parents[instruction->nextInstruction] = parents[k];
+		if (instruction->instructionType != assignment || !instruction->treatCAsVariable) continue;
+		if (instruction->operation != dividedBy && instruction->operation != modulo) continue;
+		uint32_t target = 0;
+		for (uint32_t parent = parents[k]; parent != 0; parent = parents[parent]) {
+			Instruction *enclosing = program->instructions + parent;
+			if (writtenSummary(program, parent) != NULL || writtenIdiom(program, parent) != NULL) {
+				target = 0;
+				break;
+			}
+			if (enclosing->instructionType != loopInstruction && enclosing->instructionType != whileInstruction) continue;
+			if (assignsVariable(program, enclosing->innerInstruction, instruction->c)) break;
+			if (enclosing->instructionType == loopInstruction) target = parent;
+		}
+		loops[k] = target;
+		found |= target != 0;
+	}
+	free(parents);
+	if (!found) {
+		free(loops);
+		return NULL;
+	}
+	return loops;
+}
+
+void writeReciprocals(Program *program, uint32_t loop, int indentation, Output *output) {
+	IndexStack stack = {NULL, 0, 0};
+	push(&stack, program->instructions[loop].innerInstruction);
+	while (stack.size > 0) {
+		for (uint32_t k = pop(&stack); k != 0; k = program->instructions[k].nextInstruction) {
+			Instruction *instruction = program->instructions + k;
+			if (instruction->innerInstruction != 0) push(&stack, instruction->innerInstruction);
+			if (reciprocalLoops[k] != loop) continue;
+			writeFormat(output, "loop_divider d%" PRIu32 " = loop_divider_new(", k);
+			writeVariable(instruction->c, output);
+			writeText(output, ");");
+			writeIndentation(indentation, output);
+		}
+	}
+	freeIndexStack(&stack);
+}
+
+/* Whether the instruction reads a variable marked 1, i.e. one that still holds its value from the previous iteration. */
+int readsStale(Instruction *instruction, uint8_t *written) {
+	if (instruction->instructionType == ifInstructionEnd || instruction->instructionType == emptyInstruction) return 0;
+	if (instruction->treatCAsVariable && written[instruction->c] == 1) return 1;
+	if (instruction->instructionType == assignment)
+		return instruction->operation != constant && written[instruction->j] == 1;
+	return written[instruction->i] == 1;
+}
+
+/*
+ * Marks the LOOPs that stop changing anything at some point. A LOOP around a lone IF without ELSE
+ * does nothing once the condition fails, so that IF gets a guardExit and breaks there. A LOOP whose
+ * body only reads variables it does not write, or that an earlier unconditional assignment of the
+ * same iteration already set, ends up in the same state after every iteration, so it gets a
+ * fixedPointExit and breaks after the first one. Returns NULL if there is none.
+ */
+uint8_t *findEarlyExits(Program *program) {
+	uint8_t *exits = (uint8_t *) calloc(program->size, sizeof(uint8_t));
+	uint8_t *written = (uint8_t *) calloc(heighestIndex + 1, sizeof(uint8_t));
+	if (exits == NULL || written == NULL) systemError();
+	IndexStack stack = {NULL, 0, 0};
+	IndexStack writes = {NULL, 0, 0};
+	int found = 0;
+	for (uint32_t loop = 1; loop < program->size; ++loop) {
+		Instruction *instruction = program->instructions + loop;
+		if (instruction->instructionType != loopInstruction || instruction->innerInstruction == 0) continue;
+		if (program->summaries[loop] != NULL || program->idioms[loop] != NULL) continue;
+		Instruction *first = program->instructions + instruction->innerInstruction;
+		if (first->instructionType == ifInstructionStart && first->nextInstruction == 0) {
+			exits[instruction->innerInstruction] = guardExit;
+			found = 1;
+			continue;
+		}
+		push(&stack, instruction->innerInstruction);
+		while (stack.size > 0) {
+			for (uint32_t k = pop(&stack); k != 0; k = program->instructions[k].nextInstruction) {
+				Instruction *inner = program->instructions + k;
+				if (inner->innerInstruction != 0) push(&stack, inner->innerInstruction);
+				if (inner->instructionType == assignment && !written[inner->i]) {
+					written[inner->i] = 1;
+					push(&writes, inner->i);
+				}
+			}
+		}
+		int stale = 0;
+		for (uint32_t k = instruction->innerInstruction; k != 0 && !stale; k = program->instructions[k].nextInstruction) {
+			Instruction *statement = program->instructions + k;
+			stale = readsStale(statement, written);
+			if (statement->innerInstruction != 0) push(&stack, statement->innerInstruction);
+			while (stack.size > 0)
+				for (uint32_t n = pop(&stack); n != 0; n = program->instructions[n].nextInstruction) {
+					if (program->instructions[n].innerInstruction != 0) push(&stack, program->instructions[n].innerInstruction);
+					stale |= readsStale(program->instructions + n, written);
+				}
+			if (statement->instructionType == assignment) written[statement->i] = 2;
+		}
+		if (!stale) {
+			exits[loop] = fixedPointExit;
+			found = 1;
+		}
+		while (writes.size > 0)
+			written[pop(&writes)] = 0;
+	}
+	freeIndexStack(&stack);
+	freeIndexStack(&writes);
+	free(written);
+	if (!found) {
+		free(exits);
+		return NULL;
+	}
+	return exits;
+}
+
+void writeBody(Program *program, Output *output) {
+	int indentation = 1;
+	uint32_t index = 1;
+	IndexStack stack = {NULL, 0, 0};
+	
+	while (1) {
+		Instruction *instruction = program->instructions + index;
+		LoopSummary *summary = writtenSummary(program, index);
+		Idiom *idiom = writtenIdiom(program, index);
+		int collapsed = summary != NULL || idiom != NULL;
+		if (instruction->instructionType == ifInstructionEnd)
+			writeText(output, " ");
+		else if (instruction->instructionType != emptyInstruction)
+			writeIndentation(indentation, output);
+		laneMask = indentation - 1;
+		int profiled = profileCounters && !laneVariables;
+		if (profiled && instruction->instructionType != ifInstructionEnd && instruction->instructionType != emptyInstruction)
+			writeProfileEntry(program, index, collapsed, indentation, output);
+		int reciprocals = reciprocalLoops != NULL && !laneVariables;
+		if (reciprocals && !collapsed && instruction->instructionType == loopInstruction)
+			writeReciprocals(program, index, indentation, output);
+		if (summary != NULL)
+			writeSummary(program, index, indentation, output);
+		else if (idiom != NULL)
+			writeIdiom(program, index, indentation, output);
+		else if (reciprocals && reciprocalLoops[index] != 0)
+			writeDivision(instruction, index, output);
+		else
+			writeInstruction(instruction, output);
+		if (profiled && collapsed) {
+			writeIndentation(indentation, output);
+			writeFormat(output, "LOOP_PROFILE_STOP(%" PRIu32 ");", index);
+		}
+		if (instruction->innerInstruction != 0 && !collapsed) {
+			push(&stack, index);
+			++indentation;
+			if (profiled) {
+				writeIndentation(indentation, output);
+				writeFormat(output, instruction->instructionType == ifInstructionEnd ? "LOOP_PROFILE_COUNT(%" PRIu32 ");" : "LOOP_PROFILE_ITERATION(%" PRIu32 ");", index);
+			}
+			index = instruction->innerInstruction;
+		} else {
+			while (program->instructions[index].nextInstruction == 0) {
+				index = pop(&stack);
+				if (index == 0) break;
+				uint8_t exit = earlyExits != NULL && !laneVariables ? earlyExits[index] : undefinedExit;
+				if (exit == fixedPointExit) {
+					writeIndentation(indentation, output);
+					writeText(output, "break;");
+				}
+				--indentation;
+				writeIndentation(indentation, output);
+				writeLoopEnd(output);
+				if (exit == guardExit)
+					writeText(output, " else break;");
+				uint8_t closedType = program->instructions[index].instructionType;
+				if (profiled && (closedType == loopInstruction || closedType == whileInstruction)) {
+					writeIndentation(indentation, output);
+					writeFormat(output, "LOOP_PROFILE_STOP(%" PRIu32 ");", index);
+				}
+			}
+			if (index == 0) break;
+			index = program->instructions[index].nextInstruction;
+		}
+	}
+	
+	freeIndexStack(&stack);
+}
+
+void writeHeader(WriteOptions *writeOptions, Output *source) {
+	char *name = writeOptions->outputFileName;
+	int length = strlen(name);
+	name[length - 1] = 'h';
+	writeFormat(source, "#include \"%s\"\n", name);
+	Output header = {NULL, 0, 0};
+	Output *output = &header;
+	char *functionName = writeOptions->functionName;
+	
+	const char *headerStart =
+		"#ifndef LOOP_%s_H\n"
+		"#define LOOP_%s_H\n"
+		"\n";
+	const char *includes =
+		"#include <stddef.h>\n"
+		"#include <stdint.h>\n"
+		"\n";
+	const char *prototype = "%s %s(%s argc, %s *argv);\n";
+	const char *bignumPrototype = "\nbig %s(size_t argc, const big *argv);\n";
+	const char *memoPrototype = "void %s_memo_stats(uint64_t *hits, uint64_t *misses);\n";
+	const char *lanesStart =
+		"\n"
+		"#if defined(__GNUC__)\n";
+	const char *lanesPrototype =
+		"void %s_lanes(size_t argc, const loop_lanes *argv, loop_lanes *result);\n"
+		"#endif\n";
+	writeFormat(output, headerStart, functionName, functionName);
+	if (bignumVariables || writeOptions->extensionLanes || writeOptions->memoCapacity)
+		writeText(output, includes);
+	if (bignumVariables) {
+		writeBignumType(output);
+		writeFormat(output, bignumPrototype, functionName);
+	} else
+		writeFormat(output, prototype, type, functionName, type, type);
+	if (writeOptions->memoCapacity)
+		writeFormat(output, memoPrototype, functionName);
+	if (writeOptions->extensionLanes) {
+		writeText(output, lanesStart);
+		writeLanesType(output);
+		writeFormat(output, lanesPrototype, functionName);
+	}
+	writeText(output, "\n#endif");
+	
+	saveOutput(output, name);
+	name[length - 1] = 'c';
+	freeOutput(output);
+}
+
+void explainTerm(Term *term, Output *output) {
+	if (term->coefficient != 1 || term->factorCount == 0)
+		writeFormat(output, term->factorCount ? "%" PRIu64 " * " : "%" PRIu64, term->coefficient);
+	for (int k = 0; k < term->factorCount; ++k)
+		writeFormat(output, k ? " * x%" PRIu32 : "x%" PRIu32, term->factors[k]);
+}
+
+/* A summary of nothing but assignments made when the LOOP runs at all tests its counter against 0, so it is listed as a comparison. */
+void explainSummary(Program *program, uint32_t index, Output *output) {
+	LoopSummary *summary = program->summaries[index];
+	uint32_t n = program->instructions[index].i;
+	int increments = 0, decrements = 0, products = 0, written = 0;
+	for (int k = 0; k < summary->effectCount; ++k) {
+		Effect *effect = summary->effects + k;
+		increments |= effect->effectType == incrementEffect && effect->termCount > 0;
+		decrements |= effect->effectType == decrementEffect && effect->termCount > 0;
+		for (int l = 0; l < effect->termCount; ++l)
+			products |= effect->terms[l].factorCount > 0;
+	}
+	writeFormat(output, "%s:", decrements ? "saturating subtraction" : products ? "multiplication" : increments ? "addition" : "comparison");
+	for (int k = 0; k < summary->effectCount; ++k) {
+		Effect *effect = summary->effects + k;
+		if (effect->effectType != setEffect && effect->termCount == 0) continue;
+		writeText(output, written++ ? "; " : " ");
+		if (effect->effectType == setEffect) {
+			writeProfileLabel(program->instructions + effect->assignment, output);
+			writeFormat(output, " if x%" PRIu32 " > 0", n);
+			continue;
+		}
+		writeFormat(output, "x%" PRIu32 " := x%" PRIu32 " %s x%" PRIu32 " * ", effect->variable, effect->variable, effect->effectType == incrementEffect ? "+" : "-", n);
+		if (effect->termCount > 1) writeText(output, "(");
+		for (int l = 0; l < effect->termCount; ++l) {
+			if (l) writeText(output, " + ");
+			explainTerm(effect->terms + l, output);
+		}
+		if (effect->termCount > 1) writeText(output, ")");
+	}
+	if (written == 0) writeText(output, " nothing");
+}
+
+void explainIdiom(Program *program, uint32_t index, Output *output) {
+	Idiom *idiom = program->idioms[index];
+	uint32_t n = program->instructions[index].i;
+	if (idiom->idiomType == bitLengthIdiom) {
+		writeFormat(output, "bit length: x%" PRIu32 " := x%" PRIu32 " + min(x%" PRIu32 ", bitlength(x%" PRIu32 ")); ", idiom->counter, idiom->counter, n, idiom->variable);
+		writeFormat(output, "x%" PRIu32 " := x%" PRIu32 " >> min(x%" PRIu32 ", bitlength(x%" PRIu32 "))", idiom->variable, idiom->variable, n, idiom->variable);
+		return;
+	}
+	if (idiom->idiomType == divisionIdiom) {
+		char divisor[24];
+		snprintf(divisor, sizeof(divisor), idiom->treatBaseAsVariable ? "x%" PRIu64 : "%" PRIu64, idiom->base);
+		writeFormat(output, "division: x%" PRIu32 " := x%" PRIu32 " + min(x%" PRIu32 ", x%" PRIu32 " DIV %s); ", idiom->counter, idiom->counter, n, idiom->variable, divisor);
+		writeFormat(output, "x%" PRIu32 " := x%" PRIu32 " - %s * min(x%" PRIu32 ", x%" PRIu32 " DIV %s)", idiom->variable, idiom->variable, divisor, n, idiom->variable, divisor);
+		return;
+	}
+	writeFormat(output, idiom->treatBaseAsVariable ? "power: x%" PRIu32 " := x%" PRIu32 " * x%" PRIu64 " ^ x%" PRIu32 : "power: x%" PRIu32 " := x%" PRIu32 " * %" PRIu64 " ^ x%" PRIu32, idiom->variable, idiom->variable, idiom->base, n);
+	if (idiom->copyTemporary)
+		writeFormat(output, "; x%" PRIu32 " := x%" PRIu32 " if x%" PRIu32 " > 0", idiom->temporary, idiom->variable, n);
+}
+
+/*
+ * Lists the outermost LOOPs that generated code replaces, whether by a summary or an idiom,
+ * in source order as "file:line:column: kind: effect", with the effect spelled in LOOP syntax.
+ */
+void explainIdioms(Program *program, char *inputFileName) {
+	IndexStack stack = {NULL, 0, 0};
+	Output explanation = {NULL, 0, 0};
+	push(&stack, 1);
+	while (stack.size > 0) {
+		uint32_t k = pop(&stack);
+		if (k == 0) continue;
+		Instruction *instruction = program->instructions + k;
+		int summarized = program->summaries[k] != NULL, idiom = program->idioms[k] != NULL;
+		push(&stack, instruction->nextInstruction);
+		if (!summarized && !idiom) {
+			push(&stack, instruction->innerInstruction);
+			continue;
+		}
+		writeFormat(&explanation, "%s:%" PRIu32 ":%" PRIu32 ": ", inputFileName, instruction->line, instruction->column);
+		if (summarized)
+			explainSummary(program, k, &explanation);
+		else
+			explainIdiom(program, k, &explanation);
+		writeChar(&explanation, '\n');
+	}
+	flushOutput(&explanation, STDERR_FILENO);
+	freeOutput(&explanation);
+	freeIndexStack(&stack);
+}
+
+/* Only reads the program, so that several threads can write the same one. */
+void setWriteOptions(WriteOptions *writeOptions) {
+	laneVariables = 0;
+	scalarVariables = writeOptions->extensionScalar;
+	bignumVariables = writeOptions->extensionBignum;
+	checkedArithmetic = writeOptions->extensionChecked;
+	batchMain = writeOptions->extensionBatch;
+	benchMain = writeOptions->extensionBench;
+	profileCounters = writeOptions->extensionProfile;
+	laneBatch = writeOptions->extensionLanes;
+	memoCapacity = writeOptions->memoCapacity;
+	sourceFileName = writeOptions->inputFileName;
+	type = checkedArithmetic ? "unsigned __int128" : "uint_fast64_t";
+	typePrintMacro = checkedArithmetic ? NULL : "PRIuFAST64";
+}
+
+void writeSource(Program *program, WriteOptions *writeOptions, Output *output) {
+	if (program == NULL) error("Encountered empty program");
+	heighestIndex = program->heighestIndex;
+	setWriteOptions(writeOptions);
+	if (writeOptions->explainIdioms)
+		explainIdioms(program, writeOptions->inputFileName);
+	divisionRuntime = idiomRuntime = 0;
+	for (uint32_t k = 1; k < program->size; ++k)
+		idiomRuntime |= program->idioms[k] != NULL;
+	for (uint32_t k = 1; k < program->size; ++k)
+		if (program->instructions[k].instructionType == assignment)
+			divisionRuntime |= program->instructions[k].operation == dividedBy || program->instructions[k].operation == modulo;
+	reciprocalLoops = divisionRuntime && !checkedArithmetic && !bignumVariables ? findReciprocals(program) : NULL;
+	earlyExits = findEarlyExits(program);
+	writeIncludes(output);
+	if (writeOptions->extensionHeader)
+		writeHeader(writeOptions, output);
+	if (profileCounters)
+		writeProfile(program, output, writeOptions->functionName);
+	if (memoCapacity) {
+		char *uncachedName = (char *) malloc(strlen(writeOptions->functionName) + sizeof("_uncached"));
+		if (uncachedName == NULL) systemError();
+		sprintf(uncachedName, "%s_uncached", writeOptions->functionName);
+		writeFormat(output, "\nstatic %s %s(%s argc, %s *argv);\n", type, uncachedName, type, type);
+		writeStart(program, output, uncachedName);
+		free(uncachedName);
+	} else
+		writeStart(program, output, writeOptions->functionName);
+	writeBody(program, output);
+	writeReturn(program, output);
+	if (memoCapacity)
+		writeMemo(output, writeOptions->functionName);
+	if (writeOptions->extensionLanes) {
+		laneVariables = 1;
+		writeLanesStart(program, output, writeOptions->functionName);
+		writeBody(program, output);
+		writeLanesEnd(output);
+		laneVariables = 0;
+	}
+	writeEnd(output, writeOptions->functionName);
+	free(reciprocalLoops);
+	reciprocalLoops = NULL;
+	free(earlyExits);
+	earlyExits = NULL;
+}
+
+/*
+ * Writes every instruction as soon as it is parsed, so that only the open blocks stay in memory, and
+ * hands the output over in pieces. Nothing gets optimized. The variable count is only known at the
+ * end, so the function asks a helper defined behind it. Pages of a mapped input that the parser is
+ * done with get dropped as well, a syntax error reads them in again.
+ */
+void streamSource(Lexer *lexer, ParserOptions *parserOptions, WriteOptions *writeOptions, Output *output, int fd) {
+	const char *start =
+		"\n"
+		"static size_t loop_variables(void);\n"
+		"\n"
+		"%s %s(%s argc, %s *argv) {\n"
+		"\t%s *x = calloc(loop_variables() + 1, sizeof(%s));\n"
+		"\t%s n = argc < loop_variables() ? argc : loop_variables();\n"
+		"\tmemcpy(x + 1, argv, n * sizeof(%s));\n";
+	const char *variables =
+		"\n"
+		"static size_t loop_variables(void) {\n"
+		"\treturn %d;\n"
+		"}\n";
+	IndexStack *stack = &lexer->blocks;
+	size_t pageSize = sysconf(_SC_PAGESIZE), released = 0;
+	Instruction instruction;
+	int count;
+	heighestIndex = 0;
+	setWriteOptions(writeOptions);
+	divisionRuntime = parserOptions->extensionOperations;
+	idiomRuntime = 0;
+	writeIncludes(output);
+	if (writeOptions->extensionHeader)
+		writeHeader(writeOptions, output);
+	writeFormat(output, start, type, writeOptions->functionName, type, type, type, type, type, type);
+	
+	while (1) {
+		if (output->size >= OUTPUT_BUF_SIZE) {
+			flushOutput(output, fd);
+			size_t done = lexer->position / pageSize * pageSize;
+			if (lexer->mapped && done > released) {
+				madvise((void *) (lexer->data + released), done - released, MADV_DONTNEED);
+				released = done;
+			}
+		}
+		consumeWhitespace(lexer, 0, parserOptions);
+		char c = getChar(lexer);
+		memset(&instruction, 0, sizeof(Instruction));
+		if (c == EOF) parserError(lexer, "Unexpected end of file");
+		locateInstruction(lexer, &instruction, lexer->position - 1);
+		if (c == 'x')
+			parseAssignment(&instruction, lexer, parserOptions, &count);
+		else if (c == 'L')
+			parseLoop(&instruction, lexer, parserOptions);
+		else if (c == 'W' && parserOptions->extensionWhile)
+			parseWhile(&instruction, lexer, parserOptions);
+		else if (c == 'I' && parserOptions->extensionIf)
+			parseIf(&instruction, lexer, parserOptions);
+		else parserError(lexer, "Expected beginning of instruction");
+		writeIndentation(stack->size + 1, output);
+		writeInstruction(&instruction, output);
+		if (instruction.instructionType != assignment) {
+			push(stack, instruction.instructionType);
+			continue;
+		}
+		
+		end_of_instruction:
+		c = getChar(lexer);
+		if (c == ';') {
+			continue;
+		} else if (c == 'E') {
+			if (count == 0 && !parserOptions->noWhitespace) parserError(lexer, "Expected whitespace");
+			c = getChar(lexer);
+			if (c == 'N') {
+				consumeString(lexer, "D");
+				if (pop(stack) == 0) parserError(lexer, "Unexpected END token");
+				writeIndentation(stack->size + 1, output);
+				writeLoopEnd(output);
+				count = consumeWhitespace(lexer, 0, parserOptions);
+				goto end_of_instruction;
+			} else if (parserOptions->extensionIfExtended) {
+				if (c == 'L') {
+					consumeString(lexer, "SE");
+					if (pop(stack) != ifInstructionStart) parserError(lexer, "Unexpected ELSE token");
+					consumeWhitespace(lexer, 1, parserOptions);
+					writeIndentation(stack->size + 1, output);
+					writeLoopEnd(output);
+					instruction.instructionType = ifInstructionEnd;
+					writeText(output, " ");
+					writeInstruction(&instruction, output);
+					push(stack, ifInstructionEnd);
+					continue;
+				} else parserError(lexer, "Expected 'N' or 'L'");
+			} else parserError(lexer, "Expected 'N'");
+		} else if (c == EOF) {
+			if (pop(stack) != 0) parserError(lexer, "Unexpected end of file");
+			break;
+		} else {
+			if (pop(stack) == 0) parserError(lexer, "Expected ';' or end of file");
+			else parserError(lexer, "Expected ';' or \"END\"");
+		}
+	}
+	
+	writeReturn(NULL, output);
+	writeFormat(output, variables, heighestIndex);
+	writeEnd(output, writeOptions->functionName);
+	flushOutput(output, fd);
+}
+
+uint32_t emit(Bytecode *bytecode, uint32_t opcode, uint32_t a, uint32_t b, uint64_t c) {
+	if (bytecode->size == bytecode->capacity) {
+		if (bytecode->capacity > UINT32_MAX / 2) error("Program too large");
+		bytecode->capacity = bytecode->capacity ? 2 * bytecode->capacity : 1024;
+		bytecode->instructions = (BytecodeInstruction *) realloc(bytecode->instructions, bytecode->capacity * sizeof(BytecodeInstruction));
+		if (bytecode->instructions == NULL) systemError();
+	}
+	BytecodeInstruction *instruction = bytecode->instructions + bytecode->size;
+	instruction->opcode = opcode;
+	instruction->a = a;
+	instruction->b = b;
+	instruction->c = c;
+	return bytecode->size++;
+}
+
+void freeBytecode(Bytecode *bytecode) {
+	if (bytecode == NULL) return;
+	free(bytecode->instructions);
+	free(bytecode);
+}
+
+void lowerAssignment(Bytecode *bytecode, Instruction *instruction) {
+	switch (instruction->operation) {
+	case constant:
+		emit(bytecode, opConstant, instruction->i, 0, instruction->c);
+		break;
+	case variable:
+		emit(bytecode, opCopy, instruction->i, instruction->j, 0);
+		break;
+	case plus:
+	case minus:
+	case times:
+	case dividedBy:
+	case modulo:
+		emit(bytecode, opAddConstant + 2 * (instruction->operation - plus) + instruction->treatCAsVariable, instruction->i, instruction->j, instruction->c);
+		break;
+	default:
+		error("Encountered assignment with undefined operation");
+	}
+}
+
+/* Emits a jump, to be patched later, that is taken when the WHILE or IF condition does not hold. */
+uint32_t lowerCondition(Bytecode *bytecode, Instruction *instruction) {
+	static const uint32_t negations[] = {
+		[equal] = notEqual, [notEqual] = equal,
+		[greater] = lessEqual, [greaterEqual] = less,
+		[less] = greaterEqual, [lessEqual] = greater
+	};
+	if (instruction->operation < equal || instruction->operation > lessEqual) error("Encountered condition with undefined relation");
+	uint32_t opcode = opJumpEqualConstant + 2 * (negations[instruction->operation] - equal) + instruction->treatCAsVariable;
+	return emit(bytecode, opcode, instruction->i, 0, instruction->c);
+}
+
+/* Mirrors writeSummary using the temporary registers iterations, accumulator and scratch. */
+void lowerSummary(Bytecode *bytecode, Program *program, uint32_t index, uint32_t temporaries) {
+	LoopSummary *summary = program->summaries[index];
+	uint32_t iterations = temporaries, accumulator = temporaries + 1, scratch = temporaries + 2;
+	uint32_t skips[MAX_TERM_FACTORS + 1];
+	emit(bytecode, opCopy, iterations, program->instructions[index].i, 0);
+	for (int k = 0; k < summary->effectCount; ++k) {
+		Effect *effect = summary->effects + k;
+		uint32_t v = effect->variable;
+		if (effect->effectType == setEffect) {
+			skips[0] = emit(bytecode, opJumpEqualConstant, iterations, 0, 0);
+			lowerAssignment(bytecode, program->instructions + effect->assignment);
+			bytecode->instructions[skips[0]].b = bytecode->size;
+		} else if (effect->effectType == incrementEffect && effect->termCount > 0) {
+			emit(bytecode, opConstant, accumulator, 0, 0);
+			for (int l = 0; l < effect->termCount; ++l) {
+				Term *term = effect->terms + l;
+				emit(bytecode, opConstant, scratch, 0, term->coefficient);
+				for (int m = 0; m < term->factorCount; ++m)
+					emit(bytecode, opMultiplyVariable, scratch, scratch, term->factors[m]);
+				emit(bytecode, opAddVariable, accumulator, accumulator, scratch);
+			}
+			emit(bytecode, opMultiplyVariable, accumulator, accumulator, iterations);
+			emit(bytecode, opAddVariable, v, v, accumulator);
+		} else if (effect->effectType == decrementEffect && effect->termCount > 0) {
+			Term *term = effect->terms;
+			for (int m = 0; m < term->factorCount; ++m)
+				skips[m] = emit(bytecode, opJumpEqualConstant, term->factors[m], 0, 0);
+			emit(bytecode, opDivideConstant, accumulator, v, term->coefficient);
+			for (int m = 0; m < term->factorCount; ++m)
+				emit(bytecode, opDivideVariable, accumulator, accumulator, term->factors[m]);
+			uint32_t fits = emit(bytecode, opJumpLessEqualVariable, iterations, 0, accumulator);
+			emit(bytecode, opConstant, v, 0, 0);
+			skips[term->factorCount] = emit(bytecode, opJump, 0, 0, 0);
+			bytecode->instructions[fits].b = bytecode->size;
+			emit(bytecode, opConstant, scratch, 0, term->coefficient);
+			for (int m = 0; m < term->factorCount; ++m)
+				emit(bytecode, opMultiplyVariable, scratch, scratch, term->factors[m]);
+			emit(bytecode, opMultiplyVariable, scratch, scratch, iterations);
+			emit(bytecode, opSubtractVariable, v, v, scratch);
+			for (int m = 0; m < term->factorCount; ++m)
+				bytecode->instructions[skips[m]].b = bytecode->size;
+			bytecode->instructions[skips[term->factorCount]].c = bytecode->size;
+		}
+	}
+}
+
+/*
+ * Registers 0 to heighestIndex hold the variables, followed by three temporaries
+ * for LOOP summaries and one counter per LOOP nesting level.
+ */
+Bytecode *lowerProgram(Program *program) {
+	Bytecode *bytecode = (Bytecode *) calloc(1, sizeof(Bytecode));
+	if (bytecode == NULL) systemError();
+	uint32_t temporaries = heighestIndex + 1, counters = temporaries + 3;
+	uint32_t depth = 0, maximumDepth = 0;
+	uint32_t index = 1;
+	IndexStack stack = {NULL, 0, 0};
+	IndexStack starts = {NULL, 0, 0};
+	
+	while (1) {
+		Instruction *instruction = program->instructions + index;
+		LoopSummary *summary = program->summaries != NULL ? program->summaries[index] : NULL;
+		uint32_t start = bytecode->size;
+		if (summary != NULL) {
+			lowerSummary(bytecode, program, index, temporaries);
+		} else {
+			switch (instruction->instructionType) {
+			case assignment:
+				lowerAssignment(bytecode, instruction);
+				break;
+			case loopInstruction:
+				emit(bytecode, opLoopStart, counters + depth, instruction->i, 0);
+				if (++depth > maximumDepth) maximumDepth = depth;
+				break;
+			case whileInstruction:
+			case ifInstructionStart:
+				lowerCondition(bytecode, instruction);
+				break;
+			case ifInstructionEnd:
+			case emptyInstruction:
+				break;
+			default:
+				error("Encountered Instruction of undefined type");
+			}
+		}
+		if (instruction->innerInstruction != 0 && summary == NULL) {
+			push(&stack, index);
+			push(&starts, start);
+			index = instruction->innerInstruction;
+			continue;
+		}
+		while (program->instructions[index].nextInstruction == 0) {
+			index = pop(&stack);
+			if (index == 0) break;
+			start = pop(&starts);
+			instruction = program->instructions + index;
+			switch (instruction->instructionType) {
+			case loopInstruction:
+				--depth;
+				emit(bytecode, opLoopNext, counters + depth, 0, start + 1);
+				bytecode->instructions[start].c = bytecode->size;
+				break;
+			case whileInstruction:
+				emit(bytecode, opJump, 0, 0, start);
+				bytecode->instructions[start].b = bytecode->size;
+				break;
+			case ifInstructionStart:
+				if (instruction->nextInstruction != 0 && program->instructions[instruction->nextInstruction].instructionType == ifInstructionEnd)
+					emit(bytecode, opJump, 0, 0, 0);
+				bytecode->instructions[start].b = bytecode->size;
+				break;
+			case ifInstructionEnd:
+				/* the ELSE branch starts right behind the jump over it */
+				bytecode->instructions[start - 1].c = bytecode->size;
+				break;
+			}
+		}
+		if (index == 0) break;
+		index = program->instructions[index].nextInstruction;
+	}
+	
+	freeIndexStack(&stack);
+	freeIndexStack(&starts);
+	emit(bytecode, opHalt, 0, 0, 0);
+	bytecode->registerCount = counters + maximumDepth;
+	bytecode->inputCount = heighestIndex;
+	return bytecode;
+}
+
+#if defined(__GNUC__)
+#define DISPATCH() goto *targets[ip->opcode]
+#define TARGET(opcode) opcode##Target:
+#else
+#define DISPATCH() goto dispatch
+#define TARGET(opcode) case opcode:
+#endif
+#define NEXT() ++ip; DISPATCH()
+#define JUMP(condition) ip = (condition) ? code + ip->b : ip + 1; DISPATCH()
+
+/* Returns 0 on success and 1 on division by zero, like the code from compileNative. */
+int execute(Bytecode *bytecode, uint64_t *inputs, int inputCount, uint64_t *result) {
+	uint64_t *r = (uint64_t *) calloc(bytecode->registerCount, sizeof(uint64_t));
+	if (r == NULL) systemError();
+	for (int k = 0; k < inputCount && (uint32_t) k < bytecode->inputCount; ++k)
+		r[k + 1] = inputs[k];
+	BytecodeInstruction *code = bytecode->instructions, *ip = code;
+#if defined(__GNUC__)
+	static void *targets[] = {
+		&&opHaltTarget, &&opConstantTarget, &&opCopyTarget,
+		&&opAddConstantTarget, &&opAddVariableTarget, &&opSubtractConstantTarget, &&opSubtractVariableTarget,
+		&&opMultiplyConstantTarget, &&opMultiplyVariableTarget, &&opDivideConstantTarget, &&opDivideVariableTarget,
+		&&opModuloConstantTarget, &&opModuloVariableTarget,
+		&&opJumpEqualConstantTarget, &&opJumpEqualVariableTarget, &&opJumpNotEqualConstantTarget, &&opJumpNotEqualVariableTarget,
+		&&opJumpGreaterConstantTarget, &&opJumpGreaterVariableTarget, &&opJumpGreaterEqualConstantTarget, &&opJumpGreaterEqualVariableTarget,
+		&&opJumpLessConstantTarget, &&opJumpLessVariableTarget, &&opJumpLessEqualConstantTarget, &&opJumpLessEqualVariableTarget,
+		&&opJumpTarget, &&opLoopStartTarget, &&opLoopNextTarget
+	};
+#endif
+	uint64_t divisor;
+	int status = 0;
+	
+	DISPATCH();
+#if !defined(__GNUC__)
+	dispatch:
+	switch (ip->opcode) {
+#endif
+	TARGET(opConstant) r[ip->a] = ip->c; NEXT();
+	TARGET(opCopy) r[ip->a] = r[ip->b]; NEXT();
+	TARGET(opAddConstant) r[ip->a] = r[ip->b] + ip->c; NEXT();
+	TARGET(opAddVariable) r[ip->a] = r[ip->b] + r[ip->c]; NEXT();
+	TARGET(opSubtractConstant) r[ip->a] = r[ip->b] > ip->c ? r[ip->b] - ip->c : 0; NEXT();
+	TARGET(opSubtractVariable) r[ip->a] = r[ip->b] > r[ip->c] ? r[ip->b] - r[ip->c] : 0; NEXT();
+	TARGET(opMultiplyConstant) r[ip->a] = r[ip->b] * ip->c; NEXT();
+	TARGET(opMultiplyVariable) r[ip->a] = r[ip->b] * r[ip->c]; NEXT();
+	TARGET(opDivideConstant) divisor = ip->c; goto divide;
+	TARGET(opDivideVariable) divisor = r[ip->c]; goto divide;
+	TARGET(opModuloConstant) divisor = ip->c; goto modulo;
+	TARGET(opModuloVariable) divisor = r[ip->c]; goto modulo;
+	TARGET(opJumpEqualConstant) JUMP(r[ip->a] == ip->c);
+	TARGET(opJumpEqualVariable) JUMP(r[ip->a] == r[ip->c]);
+	TARGET(opJumpNotEqualConstant) JUMP(r[ip->a] != ip->c);
+	TARGET(opJumpNotEqualVariable) JUMP(r[ip->a] != r[ip->c]);
+	TARGET(opJumpGreaterConstant) JUMP(r[ip->a] > ip->c);
+	TARGET(opJumpGreaterVariable) JUMP(r[ip->a] > r[ip->c]);
+	TARGET(opJumpGreaterEqualConstant) JUMP(r[ip->a] >= ip->c);
+	TARGET(opJumpGreaterEqualVariable) JUMP(r[ip->a] >= r[ip->c]);
+	TARGET(opJumpLessConstant) JUMP(r[ip->a] < ip->c);
+	TARGET(opJumpLessVariable) JUMP(r[ip->a] < r[ip->c]);
+	TARGET(opJumpLessEqualConstant) JUMP(r[ip->a] <= ip->c);
+	TARGET(opJumpLessEqualVariable) JUMP(r[ip->a] <= r[ip->c]);
+	TARGET(opJump) ip = code + ip->c; DISPATCH();
+	TARGET(opLoopStart) r[ip->a] = r[ip->b]; ip = r[ip->a] ? ip + 1 : code + ip->c; DISPATCH();
+	TARGET(opLoopNext) ip = --r[ip->a] ? code + ip->c : ip + 1; DISPATCH();
+	TARGET(opHalt) goto halt;
+#if !defined(__GNUC__)
+	default:
+		error("Encountered undefined opcode");
+	}
+#endif
+	
+	divide:
+	if (divisor == 0) goto divisionByZero;
+	r[ip->a] = r[ip->b] / divisor;
+	NEXT();
+	modulo:
+	if (divisor == 0) goto divisionByZero;
+	r[ip->a] = r[ip->b] % divisor;
+	NEXT();
+	
+	divisionByZero:
+	status = 1;
+	halt:
+	*result = r[0];
+	free(r);
+	return status;
+}
+
+#undef DISPATCH
+#undef TARGET
+#undef NEXT
+#undef JUMP
+
+#if defined(__x86_64__) && defined(__unix__)
+
+enum NativeRegister {
+	rax = 0, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+	r8, r9, r10, r11, r12, r13, r14, r15
+};
+
+enum ConditionCode {
+	below = 0x2,
+	aboveEqual = 0x3,
+	zero = 0x4,
+	notZero = 0x5,
+	belowEqual = 0x6,
+	above = 0x7
+};
+
+/* rax, rcx and rdx are scratch registers and rdi points to the register file. */
+static const int pinnableRegisters[] = {rbx, rbp, r12, r13, r14, r15, rsi, r8, r9, r10, r11};
+static const int calleeSavedRegisters[] = {rbx, rbp, r12, r13, r14, r15};
+
+typedef struct Relocation {
+	size_t position;
+	uint32_t target;
+} Relocation;
+
+typedef struct NativeCode {
+	unsigned char *bytes;
+	size_t size;
+	size_t capacity;
+	Relocation *relocations;
+	uint32_t relocationCount;
+	uint32_t relocationCapacity;
+	int *pinned;
+} NativeCode;
+
+void emitByte(NativeCode *native, unsigned char byte) {
+	if (native->size == native->capacity) {
+		native->capacity = native->capacity ? 2 * native->capacity : 4096;
+		native->bytes = (unsigned char *) realloc(native->bytes, native->capacity);
+		if (native->bytes == NULL) systemError();
+	}
+	native->bytes[native->size++] = byte;
+}
+
+void emitImmediate(NativeCode *native, uint64_t value, int size) {
+	for (int k = 0; k < size; ++k)
+		emitByte(native, value >> (8 * k));
+}
+
+void emitRex(NativeCode *native, int wide, int reg, int rm) {
+	unsigned char rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if (rex != 0x40) emitByte(native, rex);
+}
+
+/* <opcode> reg, rm for two registers */
+void emitRegisters(NativeCode *native, int wide, unsigned char opcode, int reg, int rm) {
+	emitRex(native, wide, reg, rm);
+	emitByte(native, opcode);
+	emitByte(native, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* 0F <opcode> reg, rm for two registers */
+void emitExtendedRegisters(NativeCode *native, unsigned char opcode, int reg, int rm) {
+	emitRex(native, 1, reg, rm);
+	emitByte(native, 0x0F);
+	emitByte(native, opcode);
+	emitByte(native, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* <opcode> reg, [rdi + 8 * index] */
+void emitMemory(NativeCode *native, unsigned char opcode, int reg, uint32_t index) {
+	emitRex(native, 1, reg, rdi);
+	emitByte(native, opcode);
+	emitByte(native, 0x80 | ((reg & 7) << 3) | rdi);
+	emitImmediate(native, 8 * (uint64_t) index, 4);
+}
+
+void emitLoad(NativeCode *native, int destination, uint32_t index) {
+	if (native->pinned[index] >= 0)
+		emitRegisters(native, 1, 0x89, native->pinned[index], destination);
+	else
+		emitMemory(native, 0x8B, destination, index);
+}
+
+void emitStore(NativeCode *native, uint32_t index, int source) {
+	if (native->pinned[index] >= 0)
+		emitRegisters(native, 1, 0x89, source, native->pinned[index]);
+	else
+		emitMemory(native, 0x89, source, index);
+}
+
+void emitLoadConstant(NativeCode *native, int destination, uint64_t value) {
+	emitRex(native, value > UINT32_MAX, 0, destination);
+	emitByte(native, 0xB8 + (destination & 7));
+	emitImmediate(native, value, value > UINT32_MAX ? 8 : 4);
+}
+
+void emitJump(NativeCode *native, int condition, uint32_t target) {
+	if (condition < 0) {
+		emitByte(native, 0xE9);
+	} else {
+		emitByte(native, 0x0F);
+		emitByte(native, 0x80 | condition);
+	}
+	if (native->relocationCount == native->relocationCapacity) {
+		native->relocationCapacity = native->relocationCapacity ? 2 * native->relocationCapacity : 256;
+		native->relocations = (Relocation *) realloc(native->relocations, native->relocationCapacity * sizeof(Relocation));
+		if (native->relocations == NULL) systemError();
+	}
+	native->relocations[native->relocationCount].position = native->size;
+	native->relocations[native->relocationCount++].target = target;
+	emitImmediate(native, 0, 4);
+}
+
+/* Pins the registers used most often, weighting every enclosing loop by a factor of 8. */
+void pinRegisters(Bytecode *bytecode, int *pinned) {
+	int64_t *depths = (int64_t *) calloc(bytecode->size + 1, sizeof(int64_t));
+	uint64_t *weights = (uint64_t *) calloc(bytecode->registerCount, sizeof(uint64_t));
+	if (depths == NULL || weights == NULL) systemError();
+	for (uint32_t k = 0; k < bytecode->size; ++k) {
+		BytecodeInstruction *instruction = bytecode->instructions + k;
+		if ((instruction->opcode == opJump || instruction->opcode == opLoopNext) && instruction->c <= k) {
+			++depths[instruction->c];
+			--depths[k + 1];
+		}
+	}
+	int64_t depth = 0;
+	for (uint32_t k = 0; k < bytecode->size; ++k) {
+		BytecodeInstruction *instruction = bytecode->instructions + k;
+		depth += depths[k];
+		uint64_t weight = (uint64_t) 1 << (3 * (depth < MAX_JIT_DEPTH_WEIGHT ? depth : MAX_JIT_DEPTH_WEIGHT));
+		if (instruction->opcode == opHalt || instruction->opcode == opJump) continue;
+		weights[instruction->a] += weight;
+		if (instruction->opcode == opCopy || (instruction->opcode >= opAddConstant && instruction->opcode <= opModuloVariable) || instruction->opcode == opLoopStart)
+			weights[instruction->b] += weight;
+		if (instruction->opcode >= opAddConstant && instruction->opcode <= opJumpLessEqualVariable && (instruction->opcode - opAddConstant) % 2 == 1)
+			weights[instruction->c] += weight;
+	}
+	for (uint32_t k = 0; k < bytecode->registerCount; ++k)
+		pinned[k] = -1;
+	for (size_t p = 0; p < sizeof(pinnableRegisters) / sizeof(int); ++p) {
+		uint32_t best = 0;
+		for (uint32_t k = 1; k < bytecode->registerCount; ++k)
+			if (pinned[k] < 0 && weights[k] > weights[best])
+				best = k;
+		if (pinned[best] >= 0 || weights[best] == 0) break;
+		pinned[best] = pinnableRegisters[p];
+	}
+	free(depths);
+	free(weights);
+}
+
+void compileInstruction(NativeCode *native, BytecodeInstruction *instruction, uint32_t divisionByZero) {
+	static const int conditions[] = {zero, notZero, above, aboveEqual, below, belowEqual};
+	uint32_t opcode = instruction->opcode;
+	if (opcode >= opAddConstant && opcode <= opJumpLessEqualVariable) {
+		int isVariable = (opcode - opAddConstant) % 2 == 1;
+		if (opcode <= opModuloVariable) emitLoad(native, rax, instruction->b);
+		else emitLoad(native, rax, instruction->a);
+		if (isVariable) emitLoad(native, rcx, instruction->c);
+		else emitLoadConstant(native, rcx, instruction->c);
+	}
+	switch (opcode) {
+	case opConstant:
+		emitLoadConstant(native, rax, instruction->c);
+		emitStore(native, instruction->a, rax);
+		break;
+	case opCopy:
+		emitLoad(native, rax, instruction->b);
+		emitStore(native, instruction->a, rax);
+		break;
+	case opAddConstant:
+	case opAddVariable:
+		emitRegisters(native, 1, 0x01, rcx, rax);
+		emitStore(native, instruction->a, rax);
+		break;
+	case opSubtractConstant:
+	case opSubtractVariable:
+		/* xor edx, edx; sub rax, rcx; cmovb rax, rdx */
+		emitRegisters(native, 0, 0x31, rdx, rdx);
+		emitRegisters(native, 1, 0x29, rcx, rax);
+		emitExtendedRegisters(native, 0x40 | below, rax, rdx);
+		emitStore(native, instruction->a, rax);
+		break;
+	case opMultiplyConstant:
+	case opMultiplyVariable:
+		emitExtendedRegisters(native, 0xAF, rax, rcx);
+		emitStore(native, instruction->a, rax);
+		break;
+	case opDivideConstant:
+	case opDivideVariable:
+	case opModuloConstant:
+	case opModuloVariable:
+		emitRegisters(native, 1, 0x85, rcx, rcx);
+		emitJump(native, zero, divisionByZero);
+		emitRegisters(native, 0, 0x31, rdx, rdx);
+		emitRegisters(native, 1, 0xF7, 6, rcx);
+		emitStore(native, instruction->a, opcode <= opDivideVariable ? rax : rdx);
+		break;
+	case opJump:
+		emitJump(native, -1, instruction->c);
+		break;
+	case opLoopStart:
+		emitLoad(native, rax, instruction->b);
+		emitStore(native, instruction->a, rax);
+		emitRegisters(native, 1, 0x85, rax, rax);
+		emitJump(native, zero, instruction->c);
+		break;
+	case opLoopNext:
+		emitLoad(native, rax, instruction->a);
+		/* sub rax, 1 */
+		emitRegisters(native, 1, 0x83, 5, rax);
+		emitByte(native, 1);
+		emitStore(native, instruction->a, rax);
+		emitJump(native, notZero, instruction->c);
+		break;
+	default:
+		if (opcode < opJumpEqualConstant || opcode > opJumpLessEqualVariable) error("Encountered undefined opcode");
+		emitRegisters(native, 1, 0x39, rcx, rax);
+		emitJump(native, conditions[(opcode - opJumpEqualConstant) / 2], instruction->b);
+	}
+}
+
+/*
+ * Compiles the bytecode into a function int (*)(uint64_t *registers) that
+ * returns 0 on success and 1 on division by zero.
+ */
+void *compileNative(Bytecode *bytecode, size_t *size) {
+	NativeCode native = {NULL, 0, 0, NULL, 0, 0, NULL};
+	native.pinned = (int *) malloc(bytecode->registerCount * sizeof(int));
+	size_t *offsets = (size_t *) malloc((bytecode->size + 2) * sizeof(size_t));
+	if (native.pinned == NULL || offsets == NULL) systemError();
+	pinRegisters(bytecode, native.pinned);
+	uint32_t epilogue = bytecode->size, divisionByZero = bytecode->size + 1;
 	
-	freeProgramStack(programStack);
-	writeEnd(output, writeOptions->functionName);
-	fclose(output);
+	for (size_t k = 0; k < sizeof(calleeSavedRegisters) / sizeof(int); ++k) {
+		emitRex(&native, 0, 0, calleeSavedRegisters[k]);
+		emitByte(&native, 0x50 + (calleeSavedRegisters[k] & 7));
+	}
+	for (uint32_t k = 0; k < bytecode->registerCount; ++k)
+		if (native.pinned[k] >= 0)
+			emitMemory(&native, 0x8B, native.pinned[k], k);
+	for (uint32_t k = 0; k < bytecode->size; ++k) {
+		offsets[k] = native.size;
+		if (bytecode->instructions[k].opcode == opHalt)
+			emitRegisters(&native, 0, 0x31, rax, rax);
+		else
+			compileInstruction(&native, bytecode->instructions + k, divisionByZero);
+	}
+	offsets[epilogue] = native.size;
+	for (uint32_t k = 0; k < bytecode->registerCount; ++k)
+		if (native.pinned[k] >= 0)
+			emitMemory(&native, 0x89, native.pinned[k], k);
+	for (int k = sizeof(calleeSavedRegisters) / sizeof(int) - 1; k >= 0; --k) {
+		emitRex(&native, 0, 0, calleeSavedRegisters[k]);
+		emitByte(&native, 0x58 + (calleeSavedRegisters[k] & 7));
+	}
+	emitByte(&native, 0xC3);
+	offsets[divisionByZero] = native.size;
+	emitLoadConstant(&native, rax, 1);
+	emitJump(&native, -1, epilogue);
+	
+	for (uint32_t k = 0; k < native.relocationCount; ++k) {
+		Relocation *relocation = native.relocations + k;
+		int64_t displacement = (int64_t) offsets[relocation->target] - (int64_t) (relocation->position + 4);
+		for (int l = 0; l < 4; ++l)
+			native.bytes[relocation->position + l] = (uint64_t) displacement >> (8 * l);
+	}
+	void *function = mmap(NULL, native.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (function == MAP_FAILED) systemError();
+	memcpy(function, native.bytes, native.size);
+	if (mprotect(function, native.size, PROT_READ | PROT_EXEC) != 0) systemError();
+	*size = native.size;
+	free(native.bytes);
+	free(native.relocations);
+	free(native.pinned);
+	free(offsets);
+	return function;
 }
 
-int main(int argc, char **argv) {
-	ParserOptions parserOptions = {NULL, 0, 0, 0, 0, 0, 0, 0};
-	WriteOptions writeOptions = {file, name, 0};
-	handleArguments(argc, argv, &parserOptions, &writeOptions);
-	Program *program = parse(&parserOptions);
-	writeProgram(program, &writeOptions);
+/* Runs a function from compileNative, which a caller may keep around for many calls. */
+int executeNative(Bytecode *bytecode, void *function, uint64_t *inputs, int inputCount, uint64_t *result) {
+	uint64_t *r = (uint64_t *) calloc(bytecode->registerCount, sizeof(uint64_t));
+	if (r == NULL) systemError();
+	for (int k = 0; k < inputCount && (uint32_t) k < bytecode->inputCount; ++k)
+		r[k + 1] = inputs[k];
+	int (*entry)(uint64_t *);
+	*(void **) &entry = function;
+	int status = entry(r);
+	*result = r[0];
+	free(r);
+	return status;
+}
+
+void freeNative(void *function, size_t size) {
+	munmap(function, size);
+}
+
+#else
+
+/* Other platforms fall back to the interpreter, which has the same semantics. */
+void *compileNative(Bytecode *bytecode, size_t *size) {
+	*size = 0;
+	return bytecode;
+}
+
+int executeNative(Bytecode *bytecode, void *function, uint64_t *inputs, int inputCount, uint64_t *result) {
+	return execute(bytecode, inputs, inputCount, result);
+}
+
+void freeNative(void *function, size_t size) {
+}
+
+#endif
+
+/* Returns 0 if an input is not a natural number. */
+int parseInput(char *argument, uint64_t *input) {
+	char *end;
+	errno = 0;
+	*input = strtoull(argument, &end, 10);
+	return errno == 0 && *end == '\0' && end != argument;
+}
+
+uint64_t *parseInputs(RunOptions *runOptions) {
+	uint64_t *inputs = (uint64_t *) calloc(runOptions->inputCount + 1, sizeof(uint64_t));
+	if (inputs == NULL) systemError();
+	for (int k = 0; k < runOptions->inputCount; ++k)
+		if (!parseInput(runOptions->inputs[k], inputs + k)) error("Inputs must be natural numbers");
+	return inputs;
+}
+
+void runProgram(Program *program, RunOptions *runOptions) {
+	uint64_t *inputs = parseInputs(runOptions);
+	Bytecode *bytecode = lowerProgram(program);
+	uint64_t result;
+	int status;
+	if (runOptions->extensionJit) {
+		size_t size;
+		void *function = compileNative(bytecode, &size);
+		status = executeNative(bytecode, function, inputs, runOptions->inputCount, &result);
+		freeNative(function, size);
+	} else
+		status = execute(bytecode, inputs, runOptions->inputCount, &result);
+	if (status != 0) error("Division by zero");
+	printf("%" PRIu64 "\n", result);
+	freeBytecode(bytecode);
+	free(inputs);
+}
+
+/*
+ * Cache entries are named after a 128-bit hash of the transpiler build, the options, and the
+ * source with every run of whitespace counted as one space, so reformatting a program still hits.
+ * Generated code that reports errors names the input file, and where it reports source positions
+ * (--checked, --profile, DIV or MOD by a variable or 0) the source counts byte by byte instead.
+ */
+typedef struct CacheHash {
+	uint64_t a;
+	uint64_t b;
+} CacheHash;
+
+void hashCacheBytes(CacheHash *hash, const char *bytes, size_t size) {
+	for (size_t k = 0; k < size; ++k) {
+		unsigned char c = bytes[k];
+		hash->a = (hash->a ^ c) * 0x100000001b3u;
+		hash->b = (hash->b + c + 1) * 0x9e3779b97f4a7c15u;
+		hash->b ^= hash->b >> 29;
+	}
+}
+
+/* Returns 0 if there is no DIV or MOD, 1 if all of them divide by constants other than 0, and 2 otherwise. */
+int findDivisions(const char *data, size_t size) {
+	int found = 0;
+	for (size_t k = 0; k + 3 <= size; ++k) {
+		if (memcmp(data + k, "DIV", 3) != 0 && memcmp(data + k, "MOD", 3) != 0) continue;
+		size_t position = k + 3;
+		while (position < size && characterClasses[(unsigned char) data[position]] == whitespaceCharacter)
+			++position;
+		int constant = 0;
+		for (; position < size && characterClasses[(unsigned char) data[position]] == digitCharacter; ++position)
+			constant |= data[position] != '0';
+		if (!constant) return 2;
+		found = 1;
+	}
+	return found;
+}
+
+char *cacheEntryName(Lexer *lexer, ParserOptions *parserOptions, WriteOptions *writeOptions) {
+	CacheHash hash = {0xcbf29ce484222325u, 0};
+	int divisions = findDivisions(lexer->data, lexer->size);
+	int exact = writeOptions->extensionChecked || writeOptions->extensionProfile || divisions == 2;
+	Output options = {NULL, 0, 0};
+	writeFormat(&options, "%d\n%d %d %d %d %d %d %d %d\n%d %d %d %d %d %d %d %" PRIu32 "\n%s\n%s\n",
+		CACHE_FORMAT_VERSION,
+		parserOptions->extensionWhile, parserOptions->extensionWhileExtended, parserOptions->extensionOperations,
+		parserOptions->extensionAssignment, parserOptions->extensionIf, parserOptions->extensionIfExtended,
+		parserOptions->noWhitespace, parserOptions->noOptimize,
+		writeOptions->extensionScalar, writeOptions->extensionBignum, writeOptions->extensionChecked, writeOptions->extensionBatch,
+		writeOptions->extensionBench, writeOptions->extensionProfile, writeOptions->extensionLanes, writeOptions->memoCapacity,
+		writeOptions->functionName, exact || divisions ? writeOptions->inputFileName : "");
+	for (uint32_t k = 0; k < parserOptions->specializationCount; ++k)
+		writeFormat(&options, "x%" PRIu32 "=%" PRIu64 "\n", parserOptions->specializations[k].variable, parserOptions->specializations[k].value);
+	hashCacheBytes(&hash, options.data, options.size);
+	freeOutput(&options);
+	if (exact)
+		hashCacheBytes(&hash, lexer->data, lexer->size);
+	else {
+		for (size_t k = 0, tokens = 0; k < lexer->size; ++tokens) {
+			while (k < lexer->size && characterClasses[(unsigned char) lexer->data[k]] == whitespaceCharacter)
+				++k;
+			size_t start = k;
+			while (k < lexer->size && characterClasses[(unsigned char) lexer->data[k]] != whitespaceCharacter)
+				++k;
+			if (tokens > 0 && k > start) hashCacheBytes(&hash, " ", 1);
+			hashCacheBytes(&hash, lexer->data + start, k - start);
+		}
+	}
+	char *entryName = (char *) malloc(strlen(writeOptions->cacheDirectory) + 36);
+	if (entryName == NULL) systemError();
+	sprintf(entryName, "%s/%016" PRIx64 "%016" PRIx64 ".c", writeOptions->cacheDirectory, hash.a, hash.b);
+	return entryName;
+}
+
+/* Returns 0 on a miss. A hit counts as a use for the eviction order. */
+int loadCacheEntry(char *entryName, Output *output) {
+	int fd = open(entryName, O_RDONLY);
+	if (fd < 0 && errno == ENOENT) return 0;
+	if (fd < 0) systemError();
+	output->data = readAll(fd, &output->size);
+	output->capacity = output->size;
+	futimens(fd, NULL);
+	close(fd);
+	return 1;
+}
+
+typedef struct CacheEntry {
+	char *name;
+	off_t size;
+	struct timespec used;
+} CacheEntry;
+
+int compareCacheEntries(const void *a, const void *b) {
+	const struct timespec *x = &((const CacheEntry *) a)->used, *y = &((const CacheEntry *) b)->used;
+	if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+	return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/* Lists the entries, skipping whatever other processes are still writing. */
+CacheEntry *listCacheEntries(char *cacheDirectory, size_t *count) {
+	DIR *directory = opendir(cacheDirectory);
+	if (directory == NULL) systemError();
+	size_t capacity = 64;
+	CacheEntry *entries = (CacheEntry *) malloc(capacity * sizeof(CacheEntry));
+	if (entries == NULL) systemError();
+	*count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(directory)) != NULL) {
+		struct stat status;
+		size_t length = strlen(entry->d_name);
+		if ((length != 34 || strcmp(entry->d_name + 32, ".c") != 0) && (length != 35 || strcmp(entry->d_name + 32, ".so") != 0)) continue;
+		char *path = joinPath(cacheDirectory, entry->d_name);
+		if (stat(path, &status) != 0) {
+			free(path);
+			continue;
+		}
+		if (*count == capacity) {
+			capacity *= 2;
+			entries = (CacheEntry *) realloc(entries, capacity * sizeof(CacheEntry));
+			if (entries == NULL) systemError();
+		}
+		entries[*count].name = path;
+		entries[*count].size = status.st_size;
+		entries[*count].used = status.st_mtim;
+		++*count;
+	}
+	closedir(directory);
+	return entries;
+}
+
+/* Least recently used entries go first. Entries another process removes in the meantime count as gone. */
+void evictCacheEntries(WriteOptions *writeOptions) {
+	size_t count;
+	CacheEntry *entries = listCacheEntries(writeOptions->cacheDirectory, &count);
+	uint64_t total = 0;
+	for (size_t k = 0; k < count; ++k)
+		total += entries[k].size;
+	qsort(entries, count, sizeof(CacheEntry), compareCacheEntries);
+	for (size_t k = 0; k < count && total > writeOptions->cacheCapacity; ++k)
+		if (unlink(entries[k].name) == 0 || errno == ENOENT)
+			total -= entries[k].size;
+	for (size_t k = 0; k < count; ++k)
+		free(entries[k].name);
+	free(entries);
+}
+
+/* Writes a temporary file first and renames it, so that readers only ever see complete entries. */
+void storeCacheEntry(WriteOptions *writeOptions, char *entryName, Output *output) {
+	char *temporaryName = joinPath(writeOptions->cacheDirectory, ".tmp.XXXXXX");
+	int fd = mkstemp(temporaryName);
+	if (fd < 0) systemError();
+	size_t size = output->size;
+	fchmod(fd, 0644);
+	flushOutput(output, fd);
+	output->size = size;
+	if (close(fd) != 0 || rename(temporaryName, entryName) != 0) systemError();
+	free(temporaryName);
+	evictCacheEntries(writeOptions);
+}
+
+/* Leaves an output file with the same contents untouched, so that build tools do not compile it again. */
+void saveChangedOutput(Output *output, char *fileName) {
+	int fd = strcmp(fileName, "-") != 0 ? open(fileName, O_RDONLY) : -1;
+	struct stat status;
+	if (fd >= 0 && fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && (size_t) status.st_size == output->size) {
+		size_t size;
+		char *data = readAll(fd, &size);
+		int unchanged = size == output->size && memcmp(data, output->data, size) == 0;
+		free(data);
+		if (unchanged) {
+			close(fd);
+			return;
+		}
+	}
+	if (fd >= 0) close(fd);
+	saveOutput(output, fileName);
+}
+
+/* Takes over the lexer. Output with --header or --explainIdioms has more to it than the C file and never gets cached. */
+void generateSource(Lexer *lexer, ParserOptions *parserOptions, WriteOptions *writeOptions, Output *output) {
+	char *entryName = NULL;
+	if (writeOptions->cacheDirectory != NULL && !writeOptions->extensionHeader && !writeOptions->explainIdioms) {
+		entryName = cacheEntryName(lexer, parserOptions, writeOptions);
+		if (loadCacheEntry(entryName, output)) {
+			__atomic_fetch_add(&cacheHits, 1, __ATOMIC_RELAXED);
+			freeLexer(lexer);
+			free(entryName);
+			return;
+		}
+		__atomic_fetch_add(&cacheMisses, 1, __ATOMIC_RELAXED);
+	}
+	Program *program = prepareProgram(lexer, parserOptions);
+	freeLexer(lexer);
+	writeSource(program, writeOptions, output);
 	freeProgram(program);
+	if (entryName != NULL) storeCacheEntry(writeOptions, entryName, output);
+	free(entryName);
+}
+
+void transpileSource(Lexer *lexer, ParserOptions *parserOptions, WriteOptions *writeOptions) {
+	Output output = {NULL, 0, 0};
+	if (writeOptions->extensionStream) {
+		int toStdout = strcmp(writeOptions->outputFileName, "-") == 0;
+		int fd = toStdout ? STDOUT_FILENO : open(writeOptions->outputFileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) systemError();
+		streamSource(lexer, parserOptions, writeOptions, &output, fd);
+		if (!toStdout && close(fd) != 0) systemError();
+		freeLexer(lexer);
+		freeOutput(&output);
+		return;
+	}
+	generateSource(lexer, parserOptions, writeOptions, &output);
+	if (writeOptions->cacheDirectory != NULL)
+		saveChangedOutput(&output, writeOptions->outputFileName);
+	else
+		saveOutput(&output, writeOptions->outputFileName);
+	freeOutput(&output);
+}
+
+/* The shell splits the compiler command into words, the file names get passed as they are. Returns 0 if it fails. */
+int compileObject(char *compiler, char *sourceName, char *objectName) {
+	Output command = {NULL, 0, 0};
+	writeFormat(&command, "%s -fPIC -shared -o \"$1\" \"$2\"", compiler);
+	writeChar(&command, '\0');
+	fflush(stdout);
+	pid_t child = fork();
+	if (child < 0) systemError();
+	if (child == 0) {
+		execl("/bin/sh", "sh", "-c", command.data, "sh", objectName, sourceName, (char *) NULL);
+		_exit(127);
+	}
+	int status;
+	while (waitpid(child, &status, 0) < 0)
+		if (errno != EINTR) systemError();
+	freeOutput(&command);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+typedef uint_fast64_t (*LoopFunction)(uint_fast64_t argc, uint_fast64_t *argv);
+
+/*
+ * Objects are named after the generated code and the compiler command. With --cache they stay in the
+ * cache directory for later runs, otherwise they get built in a temporary directory for this run only.
+ */
+void execProgram(Lexer *lexer, ParserOptions *parserOptions, WriteOptions *writeOptions, RunOptions *runOptions) {
+	uint64_t *inputs = parseInputs(runOptions);
+	Output source = {NULL, 0, 0};
+	generateSource(lexer, parserOptions, writeOptions, &source);
+	CacheHash hash = {0xcbf29ce484222325u, 0};
+	hashCacheBytes(&hash, runOptions->compiler, strlen(runOptions->compiler) + 1);
+	hashCacheBytes(&hash, source.data, source.size);
+	char objectName[36], *directory = writeOptions->cacheDirectory, *temporaryDirectory = NULL;
+	sprintf(objectName, "%016" PRIx64 "%016" PRIx64 ".so", hash.a, hash.b);
+	if (directory == NULL) {
+		char *base = getenv("TMPDIR");
+		directory = temporaryDirectory = joinPath(base != NULL && *base != '\0' ? base : "/tmp", "loop.XXXXXX");
+		if (mkdtemp(temporaryDirectory) == NULL) systemError();
+	}
+	char *objectPath = joinPath(directory, objectName);
+	if (temporaryDirectory == NULL && utimensat(AT_FDCWD, objectPath, NULL, 0) == 0) {
+		__atomic_fetch_add(&cacheHits, 1, __ATOMIC_RELAXED);
+	} else {
+		char *buildDirectory = temporaryDirectory;
+		if (buildDirectory == NULL) {
+			__atomic_fetch_add(&cacheMisses, 1, __ATOMIC_RELAXED);
+			buildDirectory = joinPath(directory, ".tmp.XXXXXX");
+			if (mkdtemp(buildDirectory) == NULL) systemError();
+		}
+		char *sourcePath = joinPath(buildDirectory, "program.c");
+		char *builtPath = joinPath(buildDirectory, "program.so");
+		saveOutput(&source, sourcePath);
+		int compiled = compileObject(runOptions->compiler, sourcePath, builtPath);
+		unlink(sourcePath);
+		if (compiled && rename(builtPath, objectPath) != 0) systemError();
+		unlink(builtPath);
+		if (buildDirectory != temporaryDirectory) rmdir(buildDirectory);
+		if (!compiled && temporaryDirectory != NULL) rmdir(temporaryDirectory);
+		if (!compiled) error("The C compiler failed");
+		if (buildDirectory != temporaryDirectory) free(buildDirectory);
+		free(sourcePath);
+		free(builtPath);
+	}
+	void *object = dlopen(objectPath, RTLD_NOW | RTLD_LOCAL);
+	if (temporaryDirectory != NULL) {
+		unlink(objectPath);
+		rmdir(temporaryDirectory);
+	} else
+		evictCacheEntries(writeOptions);
+	if (object == NULL) error(dlerror());
+	LoopFunction function;
+	*(void **) &function = dlsym(object, writeOptions->functionName);
+	if (function == NULL) error(dlerror());
+	uint_fast64_t *arguments = (uint_fast64_t *) calloc(runOptions->inputCount + 1, sizeof(uint_fast64_t));
+	if (arguments == NULL) systemError();
+	for (int k = 0; k < runOptions->inputCount; ++k)
+		arguments[k] = inputs[k];
+	printf("%" PRIu64 "\n", (uint64_t) function(runOptions->inputCount, arguments));
+	dlclose(object);
+	free(arguments);
+	free(objectPath);
+	free(temporaryDirectory);
+	freeOutput(&source);
+	free(inputs);
+}
+
+/* The counters of all runs add up in one file, which a lock keeps consistent under concurrent runs. */
+void recordCacheStatistics(WriteOptions *writeOptions, int show) {
+	char *statisticsName = joinPath(writeOptions->cacheDirectory, "stats");
+	int fd = open(statisticsName, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || flock(fd, LOCK_EX) != 0) systemError();
+	size_t size;
+	char *data = readAll(fd, &size);
+	uint64_t hits = 0, misses = 0;
+	data = (char *) realloc(data, size + 1);
+	if (data == NULL) systemError();
+	data[size] = '\0';
+	sscanf(data, "%" SCNu64 " %" SCNu64, &hits, &misses);
+	hits += cacheHits;
+	misses += cacheMisses;
+	if (cacheHits + cacheMisses > 0) {
+		Output output = {NULL, 0, 0};
+		writeFormat(&output, "%" PRIu64 " %" PRIu64 "\n", hits, misses);
+		if (lseek(fd, 0, SEEK_SET) != 0 || ftruncate(fd, 0) != 0) systemError();
+		flushOutput(&output, fd);
+		freeOutput(&output);
+	}
+	close(fd);
+	free(data);
+	free(statisticsName);
+	if (!show) return;
+	size_t count;
+	uint64_t total = 0;
+	CacheEntry *entries = listCacheEntries(writeOptions->cacheDirectory, &count);
+	for (size_t k = 0; k < count; ++k) {
+		total += entries[k].size;
+		free(entries[k].name);
+	}
+	free(entries);
+	printf("hits: %" PRIu64 "\nmisses: %" PRIu64 "\nentries: %zu\nbytes: %" PRIu64 " of %" PRIu64 "\n", hits, misses, count, total, writeOptions->cacheCapacity);
+}
+
+/* x.loop becomes x.c next to the input or inside the output directory, with a function named after x. */
+void deriveJob(Job *job, char *inputFileName, char *outputDirectory) {
+	if (strcmp(inputFileName, "-") == 0) error("Reading from stdin only works with a single input file");
+	char *base = strrchr(inputFileName, '/');
+	base = base == NULL ? inputFileName : base + 1;
+	size_t length = strlen(base);
+	if (length > 5 && strcmp(base + length - 5, ".loop") == 0) length -= 5;
+	size_t prefix = outputDirectory != NULL ? strlen(outputDirectory) + 1 : (size_t) (base - inputFileName);
+	job->inputFileName = inputFileName;
+	job->outputFileName = (char *) malloc(prefix + length + 3);
+	job->functionName = (char *) malloc(length + 2);
+	if (job->outputFileName == NULL || job->functionName == NULL) systemError();
+	if (outputDirectory != NULL)
+		sprintf(job->outputFileName, "%s/", outputDirectory);
+	else
+		memcpy(job->outputFileName, inputFileName, prefix);
+	memcpy(job->outputFileName + prefix, base, length);
+	strcpy(job->outputFileName + prefix + length, ".c");
+	char *identifier = job->functionName;
+	if (length == 0 || (base[0] >= '0' && base[0] <= '9'))
+		*identifier++ = '_';
+	for (size_t k = 0; k < length; ++k) {
+		char c = base[k];
+		int valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+		*identifier++ = valid ? c : '_';
+	}
+	*identifier = '\0';
+}
+
+int compareOutputFileNames(const void *a, const void *b) {
+	return strcmp(((const Job *) a)->outputFileName, ((const Job *) b)->outputFileName);
+}
+
+void transpileJob(Job *job, ParserOptions *parserOptions, WriteOptions *writeOptions) {
+	ParserOptions jobParserOptions = *parserOptions;
+	WriteOptions jobWriteOptions = *writeOptions;
+	jobParserOptions.inputFileName = job->inputFileName;
+	jobWriteOptions.inputFileName = job->inputFileName;
+	jobWriteOptions.outputFileName = job->outputFileName;
+	jobWriteOptions.functionName = job->functionName;
+	jobFileName = job->inputFileName;
+	transpileSource(newLexer(job->inputFileName, jobWriteOptions.extensionStream), &jobParserOptions, &jobWriteOptions);
+	jobFileName = NULL;
+}
+
+/* Files differ a lot in size, so every worker takes the next file from a shared counter instead of a fixed share. */
+void *transpileWorker(void *argument) {
+	JobQueue *queue = (JobQueue *) argument;
+	while (1) {
+		size_t k = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+		if (k >= queue->count) return NULL;
+		transpileJob(queue->jobs + k, queue->parserOptions, queue->writeOptions);
+	}
+}
+
+void transpileAll(JobOptions *jobOptions, ParserOptions *parserOptions, WriteOptions *writeOptions) {
+	JobQueue queue = {NULL, jobOptions->inputCount, 0, parserOptions, writeOptions};
+	queue.jobs = (Job *) malloc(queue.count * sizeof(Job));
+	if (queue.jobs == NULL) systemError();
+	for (size_t k = 0; k < queue.count; ++k)
+		deriveJob(queue.jobs + k, jobOptions->inputFileNames[k], jobOptions->outputDirectory);
+	qsort(queue.jobs, queue.count, sizeof(Job), compareOutputFileNames);
+	for (size_t k = 1; k < queue.count; ++k)
+		if (strcmp(queue.jobs[k - 1].outputFileName, queue.jobs[k].outputFileName) == 0) {
+			jobFileName = queue.jobs[k].inputFileName;
+			error("Output file name already used by another input file");
+		}
+	if (jobOptions->outputDirectory != NULL && mkdir(jobOptions->outputDirectory, 0777) != 0 && errno != EEXIST)
+		systemError();
+	long threadCount = jobOptions->threadCount > 0 ? jobOptions->threadCount : sysconf(_SC_NPROCESSORS_ONLN);
+	if (threadCount < 1) threadCount = 1;
+	if ((size_t) threadCount > queue.count) threadCount = queue.count;
+	pthread_t *threads = (pthread_t *) malloc(threadCount * sizeof(pthread_t));
+	if (threads == NULL) systemError();
+	for (long k = 1; k < threadCount; ++k)
+		if (pthread_create(threads + k, NULL, transpileWorker, &queue) != 0) error("Could not create thread");
+	transpileWorker(&queue);
+	for (long k = 1; k < threadCount; ++k)
+		pthread_join(threads[k], NULL);
+	for (size_t k = 0; k < queue.count; ++k) {
+		free(queue.jobs[k].outputFileName);
+		free(queue.jobs[k].functionName);
+	}
+	free(queue.jobs);
+	free(threads);
+}
+
+void enterLibrary(loop_context *context) {
+	context->error.code = LOOP_OK;
+	context->error.line = context->error.column = 0;
+	context->error.message[0] = '\0';
+	context->lexer = NULL;
+	context->program = NULL;
+	context->output = (Output) {NULL, 0, 0};
+	errorContext = context;
+}
+
+/* Whatever is still registered when a call ends belongs to a call that failed. */
+int leaveLibrary(loop_context *context) {
+	freeLexer(context->lexer);
+	freeProgram(context->program);
+	freeOutput(&context->output);
+	context->lexer = NULL;
+	context->program = NULL;
+	free(reciprocalLoops);
+	reciprocalLoops = NULL;
+	free(earlyExits);
+	earlyExits = NULL;
+	errorContext = NULL;
+	return context->error.code;
+}
+
+Program *parseSource(loop_context *context, const char *source, size_t size, const char *fileName) {
+	context->lexer = newMemoryLexer(source, size, (char *) fileName);
+	prepareProgram(context->lexer, &context->parserOptions);
+	freeLexer(context->lexer);
+	context->lexer = NULL;
+	return context->program;
+}
+
+void writeCode(loop_context *context, Program *program, const char *fileName, char **code, size_t *size) {
+	WriteOptions writeOptions = context->writeOptions;
+	writeOptions.inputFileName = (char *) fileName;
+	writeSource(program, &writeOptions, &context->output);
+	writeChar(&context->output, '\0');
+	*code = context->output.data;
+	*size = context->output.size - 1;
+	context->output = (Output) {NULL, 0, 0};
+}
+
+LOOP_API loop_context *loop_context_new(void) {
+	loop_context *context = (loop_context *) calloc(1, sizeof(loop_context));
+	if (context == NULL) return NULL;
+	context->writeOptions.outputFileName = "-";
+	context->writeOptions.functionName = name;
+	return context;
+}
+
+LOOP_API void loop_context_free(loop_context *context) {
+	if (context == NULL) return;
+	free(context->functionName);
+	free(context);
+}
+
+LOOP_API const loop_error *loop_last_error(const loop_context *context) {
+	return &context->error;
+}
+
+LOOP_API int loop_configure(loop_context *context, const loop_options *options) {
+	if (setjmp(context->jump) != 0) return leaveLibrary(context);
+	enterLibrary(context);
+	ParserOptions *parserOptions = &context->parserOptions;
+	WriteOptions writeOptions = context->writeOptions;
+	writeOptions.extensionScalar = options->scalar;
+	writeOptions.extensionBignum = options->bignum;
+	writeOptions.extensionChecked = options->checked;
+	writeOptions.extensionBatch = options->batch;
+	writeOptions.extensionBench = options->bench;
+	writeOptions.extensionProfile = options->profile;
+	writeOptions.extensionLanes = options->simd;
+	writeOptions.memoCapacity = options->memo ? roundMemoCapacity(options->memo) : 0;
+	checkWriteOptions(&writeOptions);
+	char *functionName = NULL;
+	if (options->name != NULL && (functionName = strdup(options->name)) == NULL) systemError();
+	free(context->functionName);
+	context->functionName = functionName;
+	writeOptions.functionName = functionName != NULL ? functionName : name;
+	context->writeOptions = writeOptions;
+	parserOptions->extensionWhile = options->while_programs || options->while_extended;
+	parserOptions->extensionWhileExtended = options->while_extended;
+	parserOptions->extensionOperations = options->operations;
+	parserOptions->extensionAssignment = options->assignment;
+	parserOptions->extensionIf = options->if_programs || options->if_extended;
+	parserOptions->extensionIfExtended = options->if_extended;
+	parserOptions->noWhitespace = options->no_whitespace;
+	parserOptions->noOptimize = options->no_optimize;
+	parserOptions->keepOverflows = options->checked;
+	return leaveLibrary(context);
+}
+
+LOOP_API int loop_parse_program(loop_context *context, const char *source, size_t size, const char *file_name, loop_program **program) {
+	*program = NULL;
+	if (setjmp(context->jump) != 0) return leaveLibrary(context);
+	enterLibrary(context);
+	const char *name = file_name != NULL ? file_name : "<memory>";
+	parseSource(context, source, size, name);
+	loop_program *parsed = (loop_program *) malloc(sizeof(loop_program));
+	char *fileName = strdup(name);
+	if (parsed == NULL || fileName == NULL) {
+		free(parsed);
+		free(fileName);
+		systemError();
+	}
+	parsed->program = context->program;
+	parsed->fileName = fileName;
+	context->program = NULL;
+	*program = parsed;
+	return leaveLibrary(context);
+}
+
+LOOP_API int loop_write_program(loop_context *context, const loop_program *program, char **code, size_t *size) {
+	*code = NULL;
+	*size = 0;
+	if (setjmp(context->jump) != 0) return leaveLibrary(context);
+	enterLibrary(context);
+	if (program == NULL) error("Encountered empty program");
+	writeCode(context, program->program, program->fileName, code, size);
+	return leaveLibrary(context);
+}
+
+LOOP_API void loop_free_program(loop_program *program) {
+	if (program == NULL) return;
+	freeProgram(program->program);
+	free(program->fileName);
+	free(program);
+}
+
+LOOP_API int loop_transpile(loop_context *context, const char *source, size_t size, const char *file_name, char **code, size_t *codeSize) {
+	*code = NULL;
+	*codeSize = 0;
+	if (setjmp(context->jump) != 0) return leaveLibrary(context);
+	enterLibrary(context);
+	const char *name = file_name != NULL ? file_name : "<memory>";
+	writeCode(context, parseSource(context, source, size, name), name, code, codeSize);
+	return leaveLibrary(context);
+}
+
+/*
+ * A request is one line "<flags> <size> [x1 x2 ...]" followed by <size> bytes of source, where
+ * <flags> are the letters of the parser options (w, W, O, a, i, I, N, k, X) and j, or "-" for none.
+ * Every request gets one line back, "ok <x0>" or "error <line> <column> <message>", with line and
+ * column 0 for errors outside the syntax. A client may send any number of requests over one connection.
+ */
+static const char serveFlags[] = "wWOaiINXj";
+
+uint32_t encodeServeFlags(ParserOptions *parserOptions, int extensionJit) {
+	int options[] = {
+		parserOptions->extensionWhile, parserOptions->extensionWhileExtended, parserOptions->extensionOperations,
+		parserOptions->extensionAssignment, parserOptions->extensionIf, parserOptions->extensionIfExtended,
+		parserOptions->noWhitespace, parserOptions->noOptimize, extensionJit
+	};
+	uint32_t flags = 0;
+	for (size_t k = 0; k < sizeof(options) / sizeof(int); ++k)
+		if (options[k]) flags |= 1u << k;
+	return flags;
+}
+
+/* Returns 0 on an unknown letter. */
+int decodeServeFlags(const char *letters, ParserOptions *parserOptions, int *extensionJit) {
+	uint32_t flags = 0;
+	for (const char *c = letters; *c != '\0'; ++c) {
+		const char *flag = strchr(serveFlags, *c);
+		if (*c == 'k')
+			flags |= 1u << 2 | 1u << 3 | 1u << 4 | 1u << 5;
+		else if (*c == '-' && c == letters && c[1] == '\0')
+			break;
+		else if (flag == NULL)
+			return 0;
+		else
+			flags |= 1u << (flag - serveFlags);
+	}
+	parserOptions->extensionWhile = (flags & 3) != 0;
+	parserOptions->extensionWhileExtended = (flags >> 1) & 1;
+	parserOptions->extensionOperations = (flags >> 2) & 1;
+	parserOptions->extensionAssignment = (flags >> 3) & 1;
+	parserOptions->extensionIf = (flags & 0x30) != 0;
+	parserOptions->extensionIfExtended = (flags >> 5) & 1;
+	parserOptions->noWhitespace = (flags >> 6) & 1;
+	parserOptions->noOptimize = (flags >> 7) & 1;
+	*extensionJit = (flags >> 8) & 1;
+	return 1;
+}
+
+/* The same program under the same flags gets parsed and compiled once, then stays resident. */
+typedef struct ServedProgram {
+	uint64_t hash;
+	uint32_t flags;
+	char *source;
+	size_t sourceSize;
+	Bytecode *bytecode;
+	void *function;
+	size_t functionSize;
+	int references;
+} ServedProgram;
+
+/* The buffer holds at least one request line and grows to hold a whole request on the server. */
+typedef struct Connection {
+	int fd;
+	char *buffer;
+	size_t capacity;
+	size_t start;
+	size_t end;
+	struct Connection *next;
+} Connection;
+
+/*
+ * The listening thread watches every idle connection and reads what clients send without blocking,
+ * and queues a connection once it holds a complete request. A worker takes one off the queue, answers
+ * that request, and hands the connection back, so clients that are idle or slow to send hold no worker.
+ */
+typedef struct Server {
+	int listener;
+	int wake[2];
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	Connection *queueHead;
+	Connection *queueTail;
+	Connection *returned;
+	ServedProgram *programs[SERVE_CACHE_SLOTS];
+} Server;
+
+typedef struct Request {
+	ParserOptions parserOptions;
+	int extensionJit;
+	char *source;
+	size_t sourceSize;
+	uint64_t *inputs;
+	int inputCount;
+} Request;
+
+uint64_t hashSource(const char *source, size_t size, uint32_t flags) {
+	uint64_t hash = 0xcbf29ce484222325u ^ flags;
+	for (size_t k = 0; k < size; ++k)
+		hash = (hash ^ (unsigned char) source[k]) * 0x100000001b3u;
+	return hash;
+}
+
+void freeServedProgram(ServedProgram *program) {
+	if (program->function != NULL) freeNative(program->function, program->functionSize);
+	freeBytecode(program->bytecode);
+	free(program->source);
+	free(program);
+}
+
+/* Every user holds a reference, and so does the cache until another program takes the slot. */
+void releaseServedProgram(Server *server, ServedProgram *program) {
+	pthread_mutex_lock(&server->lock);
+	int unused = --program->references == 0;
+	pthread_mutex_unlock(&server->lock);
+	if (unused) freeServedProgram(program);
+}
+
+ServedProgram *findServedProgram(Server *server, uint64_t hash, uint32_t flags, Request *request) {
+	pthread_mutex_lock(&server->lock);
+	ServedProgram *program = server->programs[hash % SERVE_CACHE_SLOTS];
+	if (program != NULL && program->hash == hash && program->flags == flags && program->sourceSize == request->sourceSize
+		&& memcmp(program->source, request->source, request->sourceSize) == 0)
+		++program->references;
+	else
+		program = NULL;
+	pthread_mutex_unlock(&server->lock);
+	return program;
+}
+
+void addServedProgram(Server *server, ServedProgram *program) {
+	pthread_mutex_lock(&server->lock);
+	ServedProgram **slot = server->programs + program->hash % SERVE_CACHE_SLOTS;
+	ServedProgram *evicted = *slot;
+	if (evicted != NULL && --evicted->references > 0) evicted = NULL;
+	program->references = 2;
+	*slot = program;
+	pthread_mutex_unlock(&server->lock);
+	if (evicted != NULL) freeServedProgram(evicted);
+}
+
+/* Parses and compiles the program of a request unless it is resident already. */
+ServedProgram *loadServedProgram(Server *server, loop_context *context, Request *request) {
+	uint32_t flags = encodeServeFlags(&request->parserOptions, request->extensionJit);
+	uint64_t hash = hashSource(request->source, request->sourceSize, flags);
+	ServedProgram *program = findServedProgram(server, hash, flags, request);
+	if (program != NULL) return program;
+	context->parserOptions = request->parserOptions;
+	Bytecode *bytecode = lowerProgram(parseSource(context, request->source, request->sourceSize, "<request>"));
+	program = (ServedProgram *) calloc(1, sizeof(ServedProgram));
+	if (program == NULL) systemError();
+	program->hash = hash;
+	program->flags = flags;
+	program->source = request->source;
+	program->sourceSize = request->sourceSize;
+	program->bytecode = bytecode;
+	if (request->extensionJit) program->function = compileNative(bytecode, &program->functionSize);
+	request->source = NULL;
+	addServedProgram(server, program);
+	return program;
+}
+
+int evaluateRequest(Server *server, loop_context *context, Request *request, uint64_t *result) {
+	if (setjmp(context->jump) != 0) return leaveLibrary(context);
+	enterLibrary(context);
+	ServedProgram *program = loadServedProgram(server, context, request);
+	int status = program->function != NULL
+		? executeNative(program->bytecode, program->function, request->inputs, request->inputCount, result)
+		: execute(program->bytecode, request->inputs, request->inputCount, result);
+	releaseServedProgram(server, program);
+	if (status != 0) error("Division by zero");
+	return leaveLibrary(context);
+}
+
+/* Returns 0 if the connection broke. */
+int sendAll(int fd, const char *data, size_t size) {
+	for (size_t sent = 0; sent < size;) {
+		ssize_t count = send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return 0;
+		sent += count;
+	}
+	return 1;
+}
+
+/* Returns NULL if out of memory. */
+Connection *newConnection(int fd) {
+	Connection *connection = (Connection *) malloc(sizeof(Connection));
+	char *buffer = (char *) malloc(MAX_REQUEST_LINE);
+	if (connection == NULL || buffer == NULL) {
+		free(connection);
+		free(buffer);
+		return NULL;
+	}
+	connection->fd = fd;
+	connection->buffer = buffer;
+	connection->capacity = MAX_REQUEST_LINE;
+	connection->start = connection->end = 0;
+	connection->next = NULL;
+	return connection;
+}
+
+void freeConnection(Connection *connection) {
+	close(connection->fd);
+	free(connection->buffer);
+	free(connection);
+}
+
+/* Moves the buffered bytes to the front, and gives back the memory of a large request once it is consumed. */
+void compactConnection(Connection *connection) {
+	memmove(connection->buffer, connection->buffer + connection->start, connection->end - connection->start);
+	connection->end -= connection->start;
+	connection->start = 0;
+	if (connection->capacity > MAX_REQUEST_LINE && connection->end <= MAX_REQUEST_LINE) {
+		char *buffer = (char *) realloc(connection->buffer, MAX_REQUEST_LINE);
+		if (buffer == NULL) return;
+		connection->buffer = buffer;
+		connection->capacity = MAX_REQUEST_LINE;
+	}
+}
+
+/* Returns 0 if the connection ended first. */
+int receiveAll(Connection *connection, char *data, size_t size) {
+	size_t buffered = connection->end - connection->start;
+	if (buffered > size) buffered = size;
+	memcpy(data, connection->buffer + connection->start, buffered);
+	connection->start += buffered;
+	for (size_t received = buffered; received < size;) {
+		ssize_t count = recv(connection->fd, data + received, size - received, 0);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return 0;
+		received += count;
+	}
+	return 1;
+}
+
+/* Returns the NUL-terminated line, or NULL if the connection ended or the line is too long. */
+char *receiveLine(Connection *connection) {
+	while (1) {
+		char *line = connection->buffer + connection->start;
+		size_t buffered = connection->end - connection->start;
+		char *newline = memchr(line, '\n', buffered < MAX_REQUEST_LINE ? buffered : MAX_REQUEST_LINE);
+		if (newline != NULL) {
+			*newline = '\0';
+			connection->start = newline + 1 - connection->buffer;
+			return line;
+		}
+		if (buffered >= MAX_REQUEST_LINE) return NULL;
+		compactConnection(connection);
+		ssize_t count = recv(connection->fd, connection->buffer + connection->end, MAX_REQUEST_LINE - connection->end, 0);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return NULL;
+		connection->end += count;
+	}
+}
+
+/* Returns 0 if the connection ended, and -1 with a message if the request is malformed. */
+int receiveRequest(Connection *connection, Request *request, char **message) {
+	char *line = receiveLine(connection);
+	if (line == NULL) {
+		*message = "Request line too long";
+		return connection->end - connection->start >= MAX_REQUEST_LINE ? -1 : 0;
+	}
+	*message = "Malformed request";
+	char *flags = strtok_r(line, " ", &line);
+	char *size = strtok_r(NULL, " ", &line);
+	uint64_t sourceSize;
+	if (flags == NULL || size == NULL || !parseInput(size, &sourceSize)) return -1;
+	if (!decodeServeFlags(flags, &request->parserOptions, &request->extensionJit)) {
+		*message = "Unknown flag";
+		return -1;
+	}
+	if (sourceSize > MAX_REQUEST_SOURCE) {
+		*message = "Program too large";
+		return -1;
+	}
+	request->inputs = (uint64_t *) malloc(MAX_REQUEST_LINE / 2 * sizeof(uint64_t));
+	request->source = (char *) malloc(sourceSize + 1);
+	if (request->inputs == NULL || request->source == NULL) {
+		*message = strerror(ENOMEM);
+		return -1;
+	}
+	request->inputCount = 0;
+	for (char *input; (input = strtok_r(NULL, " ", &line)) != NULL;)
+		if (!parseInput(input, request->inputs + request->inputCount++)) {
+			*message = "Inputs must be natural numbers";
+			return -1;
+		}
+	request->sourceSize = sourceSize;
+	return receiveAll(connection, request->source, sourceSize) ? 1 : 0;
+}
+
+/* Returns 0 once the connection should be closed. */
+int serveRequest(Server *server, loop_context *context, Connection *connection) {
+	Request request = {{NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, 0}, 0, NULL, 0, NULL, 0};
+	char *message, reply[sizeof(context->error.message) + 64];
+	uint64_t result;
+	int received = receiveRequest(connection, &request, &message);
+	if (received > 0 && evaluateRequest(server, context, &request, &result) == LOOP_OK)
+		snprintf(reply, sizeof(reply), "ok %" PRIu64 "\n", result);
+	else if (received > 0)
+		snprintf(reply, sizeof(reply), "error %" PRIu32 " %" PRIu32 " %s\n", context->error.line, context->error.column, context->error.message);
+	else
+		snprintf(reply, sizeof(reply), "error 0 0 %s\n", message);
+	free(request.source);
+	free(request.inputs);
+	return received != 0 && sendAll(connection->fd, reply, strlen(reply)) && received > 0;
+}
+
+/* Whether the buffer holds a whole request, or enough of a malformed one for receiveRequest to reject it. */
+int bufferedRequest(Connection *connection) {
+	const char *line = connection->buffer + connection->start;
+	size_t buffered = connection->end - connection->start;
+	const char *newline = memchr(line, '\n', buffered < MAX_REQUEST_LINE ? buffered : MAX_REQUEST_LINE);
+	if (newline == NULL) return buffered >= MAX_REQUEST_LINE;
+	const char *c = memchr(line, ' ', newline - line);
+	if (c == NULL) return 1;
+	while (c < newline && *c == ' ')
+		++c;
+	const char *digits = c;
+	uint64_t sourceSize = 0;
+	for (; c < newline && *c >= '0' && *c <= '9' && sourceSize <= MAX_REQUEST_SOURCE; ++c)
+		sourceSize = sourceSize * 10 + (*c - '0');
+	if (c == digits || (c < newline && *c != ' ') || sourceSize > MAX_REQUEST_SOURCE) return 1;
+	return (uint64_t) (line + buffered - (newline + 1)) >= sourceSize;
+}
+
+/* Reads what arrived without blocking. Returns 1 once a request is buffered, 0 to wait for more, and -1 if the connection ended or there is no memory for the request. */
+int fillConnection(Connection *connection) {
+	while (!bufferedRequest(connection)) {
+		if (connection->end == connection->capacity && connection->start > 0)
+			compactConnection(connection);
+		if (connection->end == connection->capacity) {
+			if (connection->capacity >= MAX_REQUEST_LINE + MAX_REQUEST_SOURCE) return -1;
+			size_t capacity = connection->capacity * 2;
+			if (capacity > MAX_REQUEST_LINE + MAX_REQUEST_SOURCE) capacity = MAX_REQUEST_LINE + MAX_REQUEST_SOURCE;
+			char *buffer = (char *) realloc(connection->buffer, capacity);
+			if (buffer == NULL) return -1;
+			connection->buffer = buffer;
+			connection->capacity = capacity;
+		}
+		ssize_t count = recv(connection->fd, connection->buffer + connection->end, connection->capacity - connection->end, MSG_DONTWAIT);
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if (count <= 0) return -1;
+		connection->end += count;
+	}
+	return 1;
+}
+
+void queueConnection(Server *server, Connection *connection) {
+	connection->next = NULL;
+	if (server->queueTail != NULL)
+		server->queueTail->next = connection;
+	else
+		server->queueHead = connection;
+	server->queueTail = connection;
+	pthread_cond_signal(&server->queued);
+}
+
+/* Every connection goes back to the listening thread, which queues it again if the next request is buffered already. */
+void *serveWorker(void *argument) {
+	Server *server = (Server *) argument;
+	loop_context *context = loop_context_new();
+	if (context == NULL) systemError();
+	while (1) {
+		pthread_mutex_lock(&server->lock);
+		while (server->queueHead == NULL)
+			pthread_cond_wait(&server->queued, &server->lock);
+		Connection *connection = server->queueHead;
+		server->queueHead = connection->next;
+		if (server->queueHead == NULL) server->queueTail = NULL;
+		pthread_mutex_unlock(&server->lock);
+		if (!serveRequest(server, context, connection)) {
+			freeConnection(connection);
+			continue;
+		}
+		pthread_mutex_lock(&server->lock);
+		connection->next = server->returned;
+		server->returned = connection;
+		pthread_mutex_unlock(&server->lock);
+		while (write(server->wake[1], "", 1) < 0 && errno == EINTR);
+	}
+}
+
+struct sockaddr_un socketAddress(char *socketName) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketName) >= sizeof(address.sun_path)) error("Socket name too long");
+	strcpy(address.sun_path, socketName);
+	return address;
+}
+
+/* Returns 0 if there is no memory to watch another connection. */
+int reservePolls(struct pollfd **polls, Connection ***idle, size_t *capacity, size_t size) {
+	if (size <= *capacity) return 1;
+	size_t grown = *capacity ? *capacity * 2 : 64;
+	struct pollfd *newPolls = (struct pollfd *) realloc(*polls, (grown + 2) * sizeof(struct pollfd));
+	if (newPolls == NULL) return 0;
+	*polls = newPolls;
+	Connection **newIdle = (Connection **) realloc(*idle, grown * sizeof(Connection *));
+	if (newIdle == NULL) return 0;
+	*idle = newIdle;
+	*capacity = grown;
+	return 1;
+}
+
+uint64_t monotonicMilliseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Never returns. Running out of file descriptors or memory pauses accepting for SERVE_ACCEPT_BACKOFF
+ * milliseconds instead of stopping the server, and the connection that could not be watched gets closed.
+ */
+void listenForRequests(Server *server) {
+	struct pollfd *polls = NULL;
+	Connection **idle = NULL;
+	size_t capacity = 0, idleCount = 0;
+	uint64_t acceptPausedUntil = 0;
+	if (!reservePolls(&polls, &idle, &capacity, 1)) systemError();
+	while (1) {
+		uint64_t now = monotonicMilliseconds();
+		int paused = now < acceptPausedUntil;
+		polls[0] = (struct pollfd) {server->wake[0], POLLIN, 0};
+		polls[1] = (struct pollfd) {paused ? -1 : server->listener, POLLIN, 0};
+		for (size_t k = 0; k < idleCount; ++k)
+			polls[k + 2] = (struct pollfd) {idle[k]->fd, POLLIN, 0};
+		if (poll(polls, idleCount + 2, paused ? (int) (acceptPausedUntil - now) : -1) < 0) {
+			if (errno == EINTR) continue;
+			systemError();
+		}
+		
+		/* drain before taking the returned connections, so that a wakeup after this can't get lost */
+		if (polls[0].revents != 0) {
+			char drained[64];
+			while (read(server->wake[0], drained, sizeof(drained)) == sizeof(drained));
+		}
+		size_t kept = 0;
+		for (size_t k = 0; k < idleCount; ++k) {
+			int filled = polls[k + 2].revents != 0 ? fillConnection(idle[k]) : 0;
+			if (filled == 0) {
+				idle[kept++] = idle[k];
+				continue;
+			}
+			if (filled < 0) {
+				freeConnection(idle[k]);
+				continue;
+			}
+			pthread_mutex_lock(&server->lock);
+			queueConnection(server, idle[k]);
+			pthread_mutex_unlock(&server->lock);
+		}
+		idleCount = kept;
+		pthread_mutex_lock(&server->lock);
+		Connection *returned = server->returned;
+		server->returned = NULL;
+		pthread_mutex_unlock(&server->lock);
+		while (returned != NULL) {
+			Connection *connection = returned;
+			returned = connection->next;
+			compactConnection(connection);
+			if (bufferedRequest(connection)) {
+				pthread_mutex_lock(&server->lock);
+				queueConnection(server, connection);
+				pthread_mutex_unlock(&server->lock);
+			} else if (reservePolls(&polls, &idle, &capacity, idleCount + 1))
+				idle[idleCount++] = connection;
+			else
+				freeConnection(connection);
+		}
+		
+		if (paused || polls[1].revents == 0) continue;
+		int fd = accept(server->listener, NULL, NULL);
+		if (fd < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOMEM || errno == ENOBUFS)) {
+			acceptPausedUntil = monotonicMilliseconds() + SERVE_ACCEPT_BACKOFF;
+			continue;
+		}
+		if (fd < 0) continue;
+		Connection *connection = newConnection(fd);
+		if (connection == NULL || !reservePolls(&polls, &idle, &capacity, idleCount + 1)) {
+			if (connection != NULL)
+				freeConnection(connection);
+			else
+				close(fd);
+			acceptPausedUntil = monotonicMilliseconds() + SERVE_ACCEPT_BACKOFF;
+			continue;
+		}
+		idle[idleCount++] = connection;
+	}
+}
+
+/* Only returns if setting up the socket fails. A socket left behind by an earlier server gets replaced. */
+void serve(RunOptions *runOptions, JobOptions *jobOptions) {
+	Server *server = (Server *) calloc(1, sizeof(Server));
+	if (server == NULL) systemError();
+	struct sockaddr_un address = socketAddress(runOptions->serveSocket);
+	struct stat status;
+	if (lstat(runOptions->serveSocket, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(runOptions->serveSocket);
+	server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->listener < 0) systemError();
+	if (bind(server->listener, (struct sockaddr *) &address, sizeof(address)) != 0) systemError();
+	if (listen(server->listener, SOMAXCONN) != 0) systemError();
+	/* a client that gives up between poll and accept must not block the listening thread */
+	if (fcntl(server->listener, F_SETFL, O_NONBLOCK) != 0) systemError();
+	if (pipe(server->wake) != 0) systemError();
+	if (fcntl(server->wake[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(server->wake[1], F_SETFL, O_NONBLOCK) != 0) systemError();
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->queued, NULL);
+	long threadCount = jobOptions->threadCount > 0 ? jobOptions->threadCount : sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t thread;
+	for (long k = 0; k < threadCount; ++k)
+		if (pthread_create(&thread, NULL, serveWorker, server) != 0) error("Could not create thread");
+	listenForRequests(server);
+}
+
+/* Sends the program and inputs to a server and prints x0 or the error just like --run would. */
+void requestServer(Lexer *lexer, ParserOptions *parserOptions, RunOptions *runOptions) {
+	uint64_t *inputs = parseInputs(runOptions);
+	uint32_t flags = encodeServeFlags(parserOptions, runOptions->extensionJit);
+	Output request = {NULL, 0, 0};
+	for (int k = 0; serveFlags[k] != '\0'; ++k)
+		if (flags & 1u << k) writeChar(&request, serveFlags[k]);
+	if (flags == 0) writeChar(&request, '-');
+	writeFormat(&request, " %zu", lexer->size);
+	for (int k = 0; k < runOptions->inputCount; ++k)
+		writeFormat(&request, " %" PRIu64, inputs[k]);
+	writeChar(&request, '\n');
+	writeBytes(&request, lexer->data, lexer->size);
+	
+	struct sockaddr_un address = socketAddress(runOptions->connectSocket);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) systemError();
+	Connection *connection = newConnection(fd);
+	if (connection == NULL) systemError();
+	if (connect(connection->fd, (struct sockaddr *) &address, sizeof(address)) != 0) systemError();
+	if (!sendAll(connection->fd, request.data, request.size)) systemError();
+	char *reply = receiveLine(connection);
+	if (reply == NULL) error("The server hung up without replying");
+	uint32_t line, column;
+	int offset = 0;
+	if (strncmp(reply, "ok ", 3) == 0) {
+		printf("%s\n", reply + 3);
+	} else if (sscanf(reply, "error %" SCNu32 " %" SCNu32 " %n", &line, &column, &offset) == 2 && offset > 0) {
+		if (line == 0) error(reply + offset);
+		/* point the lexer at the reported column so that the message looks the same as a local one */
+		size_t position = 0;
+		for (uint32_t k = 1; k < line && position < lexer->size; ++position)
+			if (lexer->data[position] == '\n') ++k;
+		lexer->position = position + column;
+		parserError(lexer, reply + offset);
+	} else
+		error("Malformed reply from the server");
+	freeConnection(connection);
+	freeOutput(&request);
+	free(inputs);
+}
+
+#ifndef LOOP_NO_MAIN
+int main(int argc, char **argv) {
+	ParserOptions parserOptions = {NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, 0};
+	WriteOptions writeOptions = {file, name, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, CACHE_CAPACITY, 0, 0};
+	JobOptions jobOptions = {NULL, 0, 0, 0, 0, NULL};
+	RunOptions runOptions = {0, 0, 0, NULL, NULL, NULL, 0, NULL};
+	handleArguments(argc, argv, &parserOptions, &writeOptions, &jobOptions, &runOptions);
+	if (runOptions.serveSocket != NULL) {
+		serve(&runOptions, &jobOptions);
+		return EXIT_FAILURE;
+	}
+	if (writeOptions.cacheDirectory != NULL && mkdir(writeOptions.cacheDirectory, 0777) != 0 && errno != EEXIST)
+		systemError();
+	if (jobOptions.multipleFiles) {
+		transpileAll(&jobOptions, &parserOptions, &writeOptions);
+		if (writeOptions.cacheDirectory != NULL)
+			recordCacheStatistics(&writeOptions, writeOptions.showCacheStatistics);
+		free(jobOptions.inputFileNames);
+		free(parserOptions.specializations);
+		return EXIT_SUCCESS;
+	}
+	if (parserOptions.inputFileName == NULL) {
+		recordCacheStatistics(&writeOptions, 1);
+		return EXIT_SUCCESS;
+	}
+	Lexer *lexer = newLexer(parserOptions.inputFileName, writeOptions.extensionStream);
+	if (runOptions.connectSocket != NULL) {
+		requestServer(lexer, &parserOptions, &runOptions);
+		freeLexer(lexer);
+		return EXIT_SUCCESS;
+	}
+	if (runOptions.extensionExec) {
+		execProgram(lexer, &parserOptions, &writeOptions, &runOptions);
+	} else if (runOptions.extensionRun) {
+		Program *program = prepareProgram(lexer, &parserOptions);
+		freeLexer(lexer);
+		runProgram(program, &runOptions);
+		freeProgram(program);
+	} else
+		transpileSource(lexer, &parserOptions, &writeOptions);
+	if (writeOptions.cacheDirectory != NULL)
+		recordCacheStatistics(&writeOptions, writeOptions.showCacheStatistics);
 	free(writeOptions.outputFileName);
+	free(jobOptions.inputFileNames);
+	free(parserOptions.specializations);
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,73 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Embeds the transpiler. Build loop.c with -DLOOP_NO_MAIN to leave out the command line tool, e.g.
+ *   cc -O2 -fPIC -shared -fvisibility=hidden -DLOOP_NO_MAIN -o libloop.so loop.c -pthread
+ * Functions return LOOP_OK or the code of the error that loop_last_error describes in detail.
+ * A context belongs to one thread at a time. Every thread may use its own context concurrently,
+ * and a parsed program may be written by several threads at once.
+ */
+
+#if defined(__GNUC__)
+#define LOOP_API __attribute__((visibility("default")))
+#else
+#define LOOP_API
+#endif
+
+enum loop_status {
+	LOOP_OK = 0,
+	LOOP_ERROR_SYNTAX,
+	LOOP_ERROR_INVALID,
+	LOOP_ERROR_SYSTEM
+};
+
+/* line and column are only set for LOOP_ERROR_SYNTAX, both counting from 1. */
+typedef struct loop_error {
+	int code;
+	uint32_t line;
+	uint32_t column;
+	char message[256];
+} loop_error;
+
+/* The same choices as the command line options of the same names. Zeroed means plain LOOP and 64 bits. */
+typedef struct loop_options {
+	int while_programs;
+	int while_extended;
+	int operations;
+	int assignment;
+	int if_programs;
+	int if_extended;
+	int no_whitespace;
+	int no_optimize;
+	int scalar;
+	int bignum;
+	int checked;
+	int batch;
+	int bench;
+	int profile;
+	int simd;
+	uint32_t memo;
+	const char *name;
+} loop_options;
+
+typedef struct loop_context loop_context;
+typedef struct loop_program loop_program;
+
+/* Returns NULL if out of memory. The options start zeroed. */
+LOOP_API loop_context *loop_context_new(void);
+LOOP_API void loop_context_free(loop_context *context);
+LOOP_API int loop_configure(loop_context *context, const loop_options *options);
+LOOP_API const loop_error *loop_last_error(const loop_context *context);
+
+/* file_name only appears in error messages and generated code, it is never opened. */
+LOOP_API int loop_parse_program(loop_context *context, const char *source, size_t size, const char *file_name, loop_program **program);
+/* The code is NUL-terminated, and the caller releases it with free. */
+LOOP_API int loop_write_program(loop_context *context, const loop_program *program, char **code, size_t *size);
+LOOP_API void loop_free_program(loop_program *program);
+LOOP_API int loop_transpile(loop_context *context, const char *source, size_t size, const char *file_name, char **code, size_t *code_size);
+
+#endif
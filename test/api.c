@@ -0,0 +1,124 @@
+/*
+ * Exercises the library API of loop.h against the command line tool, see api.sh.
+ * Usage: api <file> <expected>, where <expected> is the C code that "loop -k -W -o -" writes for <file>.
+ * Prints what went wrong and exits with 1 on the first failure.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "../loop.h"
+
+#define THREAD_COUNT 8
+#define ROUNDS 16
+
+typedef struct Shared {
+	const loop_program *program;
+	const char *expected;
+	size_t expectedSize;
+} Shared;
+
+static const loop_options klausur = {.while_programs = 1, .while_extended = 1, .operations = 1, .assignment = 1, .if_programs = 1, .if_extended = 1};
+
+static void fail(const char *message, const loop_context *context) {
+	if (context != NULL)
+		fprintf(stderr, "api: %s: %s\n", message, loop_last_error(context)->message);
+	else
+		fprintf(stderr, "api: %s\n", message);
+	exit(1);
+}
+
+static char *readFile(const char *fileName, size_t *size) {
+	FILE *file = fopen(fileName, "rb");
+	if (file == NULL) fail("Could not open an input file", NULL);
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	rewind(file);
+	char *data = (char *) malloc(*size + 1);
+	if (data == NULL || fread(data, 1, *size, file) != *size) fail("Could not read an input file", NULL);
+	data[*size] = '\0';
+	fclose(file);
+	return data;
+}
+
+static int sameCode(const char *code, size_t size, const char *expected, size_t expectedSize) {
+	return size == expectedSize && strlen(code) == size && memcmp(code, expected, size) == 0;
+}
+
+/* Every thread writes the same parsed program with a context of its own, and returns non-NULL if any code differs. */
+static void *writeShared(void *argument) {
+	Shared *shared = (Shared *) argument;
+	loop_context *context = loop_context_new();
+	int failed = context == NULL || loop_configure(context, &klausur) != LOOP_OK;
+	for (int k = 0; k < ROUNDS && !failed; ++k) {
+		char *code;
+		size_t size;
+		failed = loop_write_program(context, shared->program, &code, &size) != LOOP_OK || !sameCode(code, size, shared->expected, shared->expectedSize);
+		free(code);
+	}
+	loop_context_free(context);
+	return failed ? argument : NULL;
+}
+
+/* Errors have to leave the context usable and leak nothing, which AddressSanitizer checks at exit. */
+static void checkErrors(loop_context *context, const char *source, size_t size, const char *fileName, const char *expected, size_t expectedSize) {
+	const char *syntaxError = "x0 := 1;\nx1 := ;\n";
+	loop_program *program;
+	char *code;
+	size_t codeSize;
+	if (loop_parse_program(context, syntaxError, strlen(syntaxError), "broken.loop", &program) != LOOP_ERROR_SYNTAX || program != NULL)
+		fail("A syntax error did not fail parsing", NULL);
+	if (loop_last_error(context)->line != 2 || loop_last_error(context)->column == 0)
+		fail("A syntax error got the wrong position", context);
+	if (loop_transpile(context, syntaxError, strlen(syntaxError), "broken.loop", &code, &codeSize) != LOOP_ERROR_SYNTAX || code != NULL)
+		fail("A syntax error did not fail transpiling", NULL);
+	if (loop_write_program(context, NULL, &code, &codeSize) == LOOP_OK || code != NULL)
+		fail("Writing no program did not fail", NULL);
+
+	loop_options invalid = klausur;
+	invalid.bignum = invalid.checked = 1;
+	if (loop_configure(context, &invalid) != LOOP_ERROR_INVALID)
+		fail("Combining --bignum and --checked did not fail", NULL);
+	if (loop_transpile(context, source, size, fileName, &code, &codeSize) != LOOP_OK)
+		fail("Transpiling failed after an error", context);
+	if (!sameCode(code, codeSize, expected, expectedSize))
+		fail("An error changed the options of the context", NULL);
+	free(code);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) fail("Usage: api <file> <expected>", NULL);
+	size_t size, expectedSize;
+	char *source = readFile(argv[1], &size);
+	char *expected = readFile(argv[2], &expectedSize);
+	loop_context *context = loop_context_new();
+	if (context == NULL) fail("Out of memory", NULL);
+	if (loop_configure(context, &klausur) != LOOP_OK) fail("Configuring failed", context);
+
+	char *code;
+	size_t codeSize;
+	if (loop_transpile(context, source, size, argv[1], &code, &codeSize) != LOOP_OK) fail("Transpiling failed", context);
+	if (!sameCode(code, codeSize, expected, expectedSize)) fail("loop_transpile differs from the command line tool", NULL);
+	free(code);
+
+	loop_program *program;
+	if (loop_parse_program(context, source, size, argv[1], &program) != LOOP_OK) fail("Parsing failed", context);
+	Shared shared = {program, expected, expectedSize};
+	pthread_t threads[THREAD_COUNT];
+	int failed = 0;
+	for (int k = 0; k < THREAD_COUNT; ++k)
+		if (pthread_create(threads + k, NULL, writeShared, &shared) != 0) fail("Could not create thread", NULL);
+	for (int k = 0; k < THREAD_COUNT; ++k) {
+		void *result;
+		pthread_join(threads[k], &result);
+		failed |= result != NULL;
+	}
+	if (failed) fail("loop_write_program differs from the command line tool on some thread", NULL);
+	loop_free_program(program);
+
+	checkErrors(context, source, size, argv[1], expected, expectedSize);
+	loop_context_free(context);
+	free(source);
+	free(expected);
+	return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Builds the library with AddressSanitizer and checks with api.c that it writes the same
+# C code as the command line tool, also from several threads at once, and that its error
+# paths leave the context usable without leaking.
+#
+# Usage: test/api.sh
+# CC selects the compiler, SANITIZE the sanitizer flags. (Default: "-fsanitize=address,undefined")
+
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+SANITIZE=${SANITIZE:--fsanitize=address,undefined}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+$CC -O2 -pthread -o "$work/loop" ../loop.c
+$CC -g -O1 $SANITIZE -pthread -DLOOP_NO_MAIN -o "$work/api" api.c ../loop.c
+
+for file in ../program1.loop ../program2.loop ../program3.loop ../binlen.loop ../bench/nested.loop ../bench/search.loop division.loop; do
+	"$work/loop" -k -W -o - "$file" > "$work/expected.c"
+	"$work/api" "$file" "$work/expected.c"
+done
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Runs programs with and without the optimizer and fails if anything differs: x0,
+# the error message, or the exit status, both under --run and from the generated C.
+#
+# Usage: test/optimizer.sh
+# The differences go to stderr. CC selects the compiler.
+
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+$CC -O2 -pthread -o "$work/loop" ../loop.c
+
+# prints what "loop <options> --run" and the generated C answer, -c only builds C code with --checked
+run() {
+	options=$1 file=$2
+	shift 2
+	if [ "$options" != "-c" ]; then
+		"$work/loop" -k -W $optimize -r "$file" "$@" 2>&1 && echo "exit 0" || echo "exit $?"
+		options=""
+	fi
+	"$work/loop" -k -W $options $optimize -o "$work/program" "$file"
+	$CC -O1 -o "$work/program" "$work/program.c"
+	"$work/program" "$@" 2>&1 && echo "exit 0" || echo "exit $?"
+}
+
+failed=0
+while read -r options file inputs; do
+	optimize=""
+	expected=$(run "$options" "$file" $inputs)
+	optimize="-X"
+	actual=$(run "$options" "$file" $inputs)
+	if [ "$expected" != "$actual" ]; then
+		printf '%s %s %s\noptimized:\n%s\nunoptimized:\n%s\n' "$options" "$file" "$inputs" "$expected" "$actual" >&2
+		failed=1
+	fi
+done <<EOF
+- division.loop 7 0
+- division.loop 0 0
+- division.loop 7 2
+- subtraction.loop 100 7 50 11
+- subtraction.loop 100 7 3 11
+- subtraction.loop 7 0 5 2
+-c subtraction.loop 100 7 3 11
+- overflow.loop 4 5
+-c overflow.loop 4 5
+-c overflow.loop 1099511627776 5
+-c overflow.loop 18446744073709551615 5
+- ../program1.loop 10
+- ../program2.loop 10
+- ../program3.loop 10
+- ../binlen.loop 1000
+- ../bench/nested.loop 5 6 7
+- ../bench/straight.loop 100 2
+- ../bench/search.loop 1000
+EOF
+exit $failed